@@ -16,29 +16,30 @@
 
 #include "ext4_utils.h"
 #include "allocate.h"
+#include "freespace.h"
 
 #include "sparse/sparse.h"
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 struct region {
-	u32 block;
+	u64 block;
 	u32 len;
 	int bg;
-	struct region *next;
-	struct region *prev;
 };
 
 struct block_group_info {
-	u32 first_block;
+	u64 first_block;
 	int header_blocks;
 	int data_blocks_used;
 	int has_superblock;
 	u8 *bitmaps;
 	u8 *block_bitmap;
 	u8 *inode_bitmap;
-	u8 *inode_table;
+	u8 **inode_table;	/* its blocks, allocated as they are used */
 	u32 free_blocks;
 	u32 first_free_block;
 	u32 free_inodes;
@@ -56,20 +57,10 @@ struct xattr_list_element {
 struct block_allocation *create_allocation(jmp_buf *setjmp_env)
 {
 	size_t size = sizeof(struct block_allocation);
-	struct block_allocation *alloc = malloc(size);
+	struct block_allocation *alloc = calloc(1, size);
 	if (!alloc) {
-		critical_error_errno(setjmp_env, "malloc(%zu)", size);
+		critical_error_errno(setjmp_env, "calloc(%zu)", size);
 	}
-	alloc->list.first = NULL;
-	alloc->list.last = NULL;
-	alloc->oob_list.first = NULL;
-	alloc->oob_list.last = NULL;
-	alloc->list.iter = NULL;
-	alloc->list.partial_iter = 0;
-	alloc->oob_list.iter = NULL;
-	alloc->oob_list.partial_iter = 0;
-	alloc->filename = NULL;
-	alloc->next = NULL;
 	return alloc;
 }
 
@@ -101,68 +92,103 @@ static void xattr_list_insert(struct fs_aux_info *aux_info,
 	aux_info->xattrs = element;
 }
 
-static void region_list_remove(struct region_list *list, struct region *reg)
+/* Makes room for nr more regions at the end of a list.  The array grows
+   by doubling, so most allocations only ever malloc it once. */
+static void region_list_reserve(struct region_list *list, jmp_buf *setjmp_env,
+				u32 nr)
 {
-	if (reg->prev)
-		reg->prev->next = reg->next;
+	struct region *regs;
+	u32 size = list->size ? list->size : 4;
 
-	if (reg->next)
-		reg->next->prev = reg->prev;
+	if (list->nr + nr <= list->size)
+		return;
 
-	if (list->first == reg)
-		list->first = reg->next;
+	while (size < list->nr + nr)
+		size *= 2;
+	regs = realloc(list->regs, size * sizeof(struct region));
+	if (!regs)
+		critical_error_errno(setjmp_env, "realloc(%zu)",
+				     size * sizeof(struct region));
+	list->regs = regs;
+	list->size = size;
+}
 
-	if (list->last == reg)
-		list->last = reg->prev;
+static void region_list_append(struct region_list *list, jmp_buf *setjmp_env,
+			       u64 block, u32 len, int bg)
+{
+	struct region *reg;
 
-	reg->next = NULL;
-	reg->prev = NULL;
+	region_list_reserve(list, setjmp_env, 1);
+	reg = &list->regs[list->nr++];
+	reg->block = block;
+	reg->len = len;
+	reg->bg = bg;
+	list->len += len;
 }
 
-static void region_list_append(struct region_list *list, struct region *reg)
+/* Splits the regions of a list so that the regions from first on up to the
+   returned one hold exactly len blocks.  Returns -1 if there are fewer. */
+static int region_list_split(struct region_list *list, jmp_buf *setjmp_env,
+			     u32 first, u32 len)
 {
-	if (list->first == NULL) {
-		list->first = reg;
-		list->last = reg;
-		list->iter = reg;
-		list->partial_iter = 0;
-		reg->prev = NULL;
-	} else {
-		list->last->next = reg;
-		reg->prev = list->last;
-		list->last = reg;
-	}
-	reg->next = NULL;
+	struct region *reg;
+	u32 i;
+
+	for (i = first; i < list->nr && len >= list->regs[i].len; i++)
+		len -= list->regs[i].len;
+
+	if (len == 0)
+		return i;
+	if (i == list->nr)
+		return -1;
+
+	region_list_reserve(list, setjmp_env, 1);
+	memmove(&list->regs[i + 1], &list->regs[i],
+		(list->nr - i) * sizeof(struct region));
+	list->nr++;
+
+	reg = &list->regs[i];
+	reg[1].block = reg->block + len;
+	reg[1].len = reg->len - len;
+	reg->len = len;
+
+	return i + 1;
 }
 
 #if 0
-static void dump_starting_from(struct region *reg)
+static void dump_region_list(struct region_list *list)
 {
-	for (; reg; reg = reg->next) {
-		printf("%p: Blocks %d-%d (%d)\n", reg,
-		       reg->block, reg->block + reg->len - 1, reg->len)
-	}
+	u32 i;
+
+	for (i = 0; i < list->nr; i++)
+		printf("%u: Blocks %" PRIu64 "-%" PRIu64 " (%d)\n", i,
+		       list->regs[i].block,
+		       list->regs[i].block + list->regs[i].len - 1,
+		       list->regs[i].len);
 }
 
 static void dump_region_lists(struct block_allocation *alloc)
 {
 
 	printf("Main list:\n");
-	dump_starting_from(alloc->list.first);
+	dump_region_list(&alloc->list);
 
 	printf("OOB list:\n");
-	dump_starting_from(alloc->oob_list.first);
+	dump_region_list(&alloc->oob_list);
 }
 #endif
 
 void print_blocks(FILE *f, struct block_allocation *alloc)
 {
 	struct region *reg;
-	for (reg = alloc->list.first; reg; reg = reg->next) {
+	u32 i;
+
+	for (i = 0; i < alloc->list.nr; i++) {
+		reg = &alloc->list.regs[i];
 		if (reg->len == 1) {
-			fprintf(f, " %d", reg->block);
+			fprintf(f, " %" PRIu64, reg->block);
 		} else {
-			fprintf(f, " %d-%d", reg->block,
+			fprintf(f, " %" PRIu64 "-%" PRIu64, reg->block,
 				reg->block + reg->len - 1);
 		}
 	}
@@ -170,65 +196,212 @@ void print_blocks(FILE *f, struct block_allocation *alloc)
 }
 
 void append_region(struct block_allocation *alloc, jmp_buf *setjmp_env,
-		   u32 block, u32 len, int bg_num)
+		   u64 block, u32 len, int bg_num)
+{
+	region_list_append(&alloc->list, setjmp_env, block, len, bg_num);
+}
+
+/* Returns a new allocation of the data blocks of alloc, for a file that
+   shares them */
+struct block_allocation *copy_allocation(jmp_buf *setjmp_env,
+					 const struct block_allocation *alloc)
 {
-	size_t size = sizeof(struct region);
+	struct block_allocation *copy = create_allocation(setjmp_env);
 	struct region *reg;
-	reg = malloc(size);
-	if (!reg) {
-		critical_error_errno(setjmp_env, "malloc(%zu)", size);
-	}
-	reg->block = block;
-	reg->len = len;
-	reg->bg = bg_num;
-	reg->next = NULL;
+	u32 i;
 
-	region_list_append(&alloc->list, reg);
+	for (i = 0; i < alloc->list.nr; i++) {
+		reg = &alloc->list.regs[i];
+		region_list_append(&copy->list, setjmp_env, reg->block,
+				   reg->len, reg->bg);
+	}
+	return copy;
 }
 
-static void allocate_bg_inode_table(struct fs_info *info,
-				    struct fs_aux_info *aux_info,
-				    struct sparse_file *ext4_sparse_file,
-				    jmp_buf *setjmp_env, int i)
+/* Returns the block of the inode table of block group i that holds inode,
+   counted from 0 in the group, allocating it the first time.  The blocks
+   are queued by queue_bg_metadata() once all inodes are known. */
+static u8 *inode_table_block(struct fs_info *info,
+			     struct fs_aux_info *aux_info,
+			     jmp_buf *setjmp_env, int i, u32 inode)
 {
 	struct block_group_info *bg = &aux_info->bgs[i];
-	if (bg->inode_table != NULL)
-		return;
+	u32 block = inode / (info->block_size / info->inode_size);
+
+	if (bg->inode_table == NULL) {
+		bg->inode_table = calloc(aux_info->inode_table_blocks,
+					 sizeof(*bg->inode_table));
+		if (bg->inode_table == NULL)
+			critical_error_errno(setjmp_env, "calloc(%zu, %zu)",
+					     (size_t)aux_info->inode_table_blocks,
+					     sizeof(*bg->inode_table));
+		bg->flags &= ~EXT4_BG_INODE_UNINIT;
+	}
 
-	u32 block = bg->first_block + 2;
+	if (bg->inode_table[block] == NULL) {
+		bg->inode_table[block] = calloc(1, info->block_size);
+		if (bg->inode_table[block] == NULL)
+			critical_error_errno(setjmp_env, "calloc(1, %zu)",
+					     (size_t)info->block_size);
+	}
 
-	if (bg->has_superblock)
-		block +=
-		    aux_info->bg_desc_blocks + info->bg_desc_reserve_blocks + 1;
+	return bg->inode_table[block];
+}
 
-	bg->inode_table =
-	    calloc(aux_info->inode_table_blocks, info->block_size);
-	if (bg->inode_table == NULL)
-		critical_error_errno(setjmp_env, "calloc(%zu, %zu)",
-				     (size_t)aux_info->inode_table_blocks,
-				     (size_t)info->block_size);
+/* Returns 1 if the only used blocks of block group i are the ones that the
+   kernel marks itself in the block bitmap of a group with
+   EXT4_BG_BLOCK_UNINIT: the superblock and group descriptor backups and the
+   group's own bitmaps and inode table.  The first group of a flex group
+   also holds the metadata of the others, and the last group has blocks
+   past the end of the filesystem. */
+static int bg_block_uninit(struct fs_aux_info *aux_info, u32 i)
+{
+	struct block_group_info *bg = &aux_info->bgs[i];
 
-	sparse_file_add_data(ext4_sparse_file, bg->inode_table,
-			     aux_info->inode_table_blocks * info->block_size,
-			     block);
+	if (i == aux_info->groups - 1 ||
+	    (aux_info->groups_per_flex > 1 &&
+	     i % aux_info->groups_per_flex == 0))
+		return 0;
 
-	bg->flags &= ~EXT4_BG_INODE_UNINIT;
+	return bg->free_blocks + bg->header_blocks ==
+	    aux_info->sb->s_blocks_per_group;
 }
 
-static int bitmap_set_bit(u8 *bitmap, u32 bit)
+/* Queues the bitmaps of the n groups from first on, which follow each other
+   in data and on disk from block on, leaving out the ones of the groups
+   with flag set, which the kernel initializes itself */
+static void queue_bitmaps(struct fs_info *info, struct fs_aux_info *aux_info,
+			  struct sparse_file *ext4_sparse_file, u8 *data,
+			  u64 block, u32 first, u32 n, u16 flag)
 {
-	if (bitmap[bit / 8] & 1 << (bit % 8))
-		return 1;
+	u32 start;
+	u32 end;
+
+	for (start = 0; start < n; start = end) {
+		end = start + 1;
+		if (aux_info->bgs[first + start].flags & flag)
+			continue;
+
+		while (end < n && !(aux_info->bgs[first + end].flags & flag))
+			end++;
+		sparse_file_add_data(ext4_sparse_file,
+				     data + start * info->block_size,
+				     (end - start) * info->block_size,
+				     block + start);
+	}
+}
 
-	bitmap[bit / 8] |= 1 << (bit % 8);
-	return 0;
+/* Sets the checksums of the bitmaps of block group i in its descriptor */
+static void bitmaps_csum_set(struct fs_info *info,
+			     struct fs_aux_info *aux_info, u32 i,
+			     const u8 *block_bitmap, const u8 *inode_bitmap)
+{
+	struct ext2_group_desc *desc = ext4_bg_desc(aux_info, i);
+	struct ext2_group_desc_hi *desc_hi = ext4_bg_desc_hi(aux_info, i);
+	u32 block_csum = ext4_crc32c(aux_info->csum_seed, block_bitmap,
+				     info->blocks_per_group / 8);
+	u32 inode_csum = ext4_crc32c(aux_info->csum_seed, inode_bitmap,
+				     info->inodes_per_group / 8);
+
+	desc->bg_block_bitmap_csum_lo = block_csum & 0xFFFF;
+	desc->bg_inode_bitmap_csum_lo = inode_csum & 0xFFFF;
+	if (desc_hi) {
+		desc_hi->bg_block_bitmap_csum_hi = block_csum >> 16;
+		desc_hi->bg_inode_bitmap_csum_hi = inode_csum >> 16;
+	}
 }
 
-static int bitmap_set_8_bits(u8 *bitmap, u32 bit)
+/* Queues the bitmaps and inode tables of the block groups once all blocks
+   and inodes are allocated.  Groups without data get EXT4_BG_BLOCK_UNINIT,
+   and neither their block bitmaps nor the inode bitmaps of groups without
+   inodes are written.  The inode tables are written up to the last used
+   inode of each group, and the rest is left to be zeroed by the kernel, as
+   bg_itable_unused tells it.  A group whose table is written in full is
+   marked EXT4_BG_INODE_ZEROED.  All of it is queued in the order of the
+   blocks on disk, which keeps queuing linear.  With metadata_csum, the
+   bitmaps and the used inodes get their checksums here, as they are
+   final. */
+void queue_bg_metadata(struct fs_info *info, struct fs_aux_info *aux_info,
+		       struct sparse_file *ext4_sparse_file,
+		       jmp_buf *setjmp_env)
 {
-	int ret = bitmap[bit / 8];
-	bitmap[bit / 8] = 0xFF;
-	return ret;
+	u32 inodes_per_block = info->block_size / info->inode_size;
+	u64 block_bitmap;
+	u64 inode_bitmap;
+	u64 inode_table;
+	u8 *bitmaps;
+	u32 first;
+	u32 used;
+	u32 n;
+	u32 i;
+	u32 j;
+
+	for (first = 0; first < aux_info->groups;
+	     first += aux_info->groups_per_flex) {
+		n = min(aux_info->groups_per_flex, aux_info->groups - first);
+		bitmaps = aux_info->bgs[first].bitmaps;
+
+		for (i = first; i < first + n; i++) {
+			if (bg_block_uninit(aux_info, i))
+				aux_info->bgs[i].flags |= EXT4_BG_BLOCK_UNINIT;
+			if (ext4_has_metadata_csum(info))
+				bitmaps_csum_set(info, aux_info, i,
+						 bitmaps + (i - first) *
+						 info->block_size,
+						 bitmaps + (n + i - first) *
+						 info->block_size);
+		}
+
+		ext4_bg_metadata(info, aux_info, first, &block_bitmap,
+				 &inode_bitmap, &inode_table);
+		queue_bitmaps(info, aux_info, ext4_sparse_file, bitmaps,
+			      block_bitmap, first, n, EXT4_BG_BLOCK_UNINIT);
+		queue_bitmaps(info, aux_info, ext4_sparse_file,
+			      bitmaps + n * info->block_size, block_bitmap + n,
+			      first, n, EXT4_BG_INODE_UNINIT);
+
+		for (i = first; i < first + n; i++) {
+			struct block_group_info *bg = &aux_info->bgs[i];
+
+			if (bg->inode_table == NULL)
+				continue;
+
+			ext4_bg_metadata(info, aux_info, i, &block_bitmap,
+					 &inode_bitmap, &inode_table);
+
+			/* the blocks of used inodes that were never filled in,
+			   such as reserved ones, still have to be written as
+			   zeros */
+			used = DIV_ROUND_UP(bg->first_free_inode - 1,
+					    inodes_per_block);
+			for (j = 0; j < used; j++)
+				inode_table_block(info, aux_info, setjmp_env, i,
+						  j * inodes_per_block);
+
+			for (j = 0; ext4_has_metadata_csum(info) &&
+			     j < bg->first_free_inode - 1; j++) {
+				u8 *block = inode_table_block(info, aux_info,
+							      setjmp_env, i, j);
+				struct ext4_inode *inode = (struct ext4_inode *)
+				    (block + j % inodes_per_block *
+				     info->inode_size);
+
+				ext4_inode_csum_set(info, aux_info,
+						    i * info->inodes_per_group +
+						    j + 1, inode);
+			}
+
+			for (j = 0; j < aux_info->inode_table_blocks; j++)
+				if (bg->inode_table[j])
+					sparse_file_add_data(ext4_sparse_file,
+							     bg->inode_table[j],
+							     info->block_size,
+							     inode_table + j);
+
+			if (used == aux_info->inode_table_blocks)
+				bg->flags |= EXT4_BG_INODE_ZEROED;
+		}
+	}
 }
 
 /* Marks a the first num_blocks blocks in a block group as used, and accounts
@@ -236,35 +409,15 @@ static int bitmap_set_8_bits(u8 *bitmap, u32 bit)
 static int reserve_blocks(int force, jmp_buf *setjmp_env,
 			  struct block_group_info *bg, u32 start, u32 num)
 {
-	unsigned int i = 0;
-
-	u32 block = start;
 	if (num > bg->free_blocks)
 		return -1;
 
-	for (i = 0; i < num && block % 8 != 0; i++, block++) {
-		if (bitmap_set_bit(bg->block_bitmap, block)) {
-			error(force, setjmp_env,
-			      "attempted to reserve already reserved block");
-			return -1;
-		}
-	}
-
-	for (; i + 8 <= (num & ~7); i += 8, block += 8) {
-		if (bitmap_set_8_bits(bg->block_bitmap, block)) {
-			error(force, setjmp_env,
-			      "attempted to reserve already reserved block");
-			return -1;
-		}
-	}
-
-	for (; i < num; i++, block++) {
-		if (bitmap_set_bit(bg->block_bitmap, block)) {
-			error(force, setjmp_env,
-			      "attempted to reserve already reserved block");
-			return -1;
-		}
+	if (bitmap_test_bits(bg->block_bitmap, start, num)) {
+		error(force, setjmp_env,
+		      "attempted to reserve already reserved block");
+		return -1;
 	}
+	bitmap_set_bits(bg->block_bitmap, start, num);
 
 	bg->free_blocks -= num;
 	if (start == bg->first_free_block)
@@ -273,14 +426,17 @@ static int reserve_blocks(int force, jmp_buf *setjmp_env,
 	return 0;
 }
 
-static void free_blocks(struct block_group_info *bg, u32 num_blocks)
+static void free_blocks(struct fs_aux_info *aux_info, int bg_num,
+			u32 num_blocks)
 {
-	unsigned int i;
-	u32 block = bg->first_free_block - 1;
-	for (i = 0; i < num_blocks; i++, block--)
-		bg->block_bitmap[block / 8] &= ~(1 << (block % 8));
+	struct block_group_info *bg = &aux_info->bgs[bg_num];
+
+	bitmap_clear_bits(bg->block_bitmap, bg->first_free_block - num_blocks,
+			  num_blocks);
 	bg->free_blocks += num_blocks;
 	bg->first_free_block -= num_blocks;
+	aux_info->free_blocks += num_blocks;
+	free_space_set(aux_info->free_space, bg_num, bg->free_blocks);
 }
 
 /* Reduces an existing allocation by len blocks by return the last blocks
@@ -289,63 +445,60 @@ static void free_blocks(struct block_group_info *bg, u32 num_blocks)
 void reduce_allocation(struct fs_aux_info *aux_info,
 		       struct block_allocation *alloc, u32 len)
 {
-	while (len) {
-		struct region *last_reg = alloc->list.last;
+	struct region_list *list = &alloc->list;
+
+	while (len && list->nr) {
+		struct region *last_reg = &list->regs[list->nr - 1];
 
 		if (last_reg->len > len) {
-			free_blocks(&aux_info->bgs[last_reg->bg], len);
+			free_blocks(aux_info, last_reg->bg, len);
 			last_reg->len -= len;
+			list->len -= len;
 			len = 0;
 		} else {
-			struct region *reg = alloc->list.last->prev;
-			free_blocks(&aux_info->bgs[last_reg->bg],
-				    last_reg->len);
+			free_blocks(aux_info, last_reg->bg, last_reg->len);
 			len -= last_reg->len;
-			if (reg) {
-				reg->next = NULL;
-			} else {
-				alloc->list.first = NULL;
-				alloc->list.last = NULL;
-				alloc->list.iter = NULL;
-				alloc->list.partial_iter = 0;
-			}
-			free(last_reg);
+			list->len -= last_reg->len;
+			list->nr--;
 		}
 	}
+
+	if (list->iter >= list->nr) {
+		list->iter = list->nr;
+		list->partial_iter = 0;
+	}
 }
 
 static void init_bg(struct fs_info *info, struct fs_aux_info *aux_info,
-		    struct sparse_file *ext4_sparse_file, int force,
-		    jmp_buf *setjmp_env, size_t i)
+		    int force, jmp_buf *setjmp_env, size_t i)
 {
 	struct block_group_info *bg = &aux_info->bgs[i];
-	int header_blocks = 2 + aux_info->inode_table_blocks;
+	size_t first = i - i % aux_info->groups_per_flex;
+	u32 n = min(aux_info->groups_per_flex, aux_info->groups - first);
+	int header_blocks = ext4_bg_super_blocks(info, aux_info, i);
+	u8 *bitmaps;
 
 	bg->has_superblock = ext4_bg_has_super_block(info, i);
 
-	if (bg->has_superblock)
-		header_blocks +=
-		    1 + aux_info->bg_desc_blocks + info->bg_desc_reserve_blocks;
+	/* the first group of a flex group holds the metadata of all of it,
+	   and the bitmaps of its groups are one buffer, laid out as on disk */
+	if (i == first) {
+		header_blocks += n * (2 + aux_info->inode_table_blocks);
 
-	bg->bitmaps = calloc(info->block_size, 2);
-	if (!bg->bitmaps) {
-		critical_error_errno(setjmp_env, "calloc(%zu, 2)",
-				     (size_t)info->block_size);
+		bg->bitmaps = calloc(info->block_size, 2 * n);
+		if (!bg->bitmaps) {
+			critical_error_errno(setjmp_env, "calloc(%zu, %u)",
+					     (size_t)info->block_size, 2 * n);
+		}
 	}
-	bg->block_bitmap = bg->bitmaps;
-	bg->inode_bitmap = bg->bitmaps + info->block_size;
+	bitmaps = aux_info->bgs[first].bitmaps;
+	bg->block_bitmap = bitmaps + (i - first) * info->block_size;
+	bg->inode_bitmap = bitmaps + (n + i - first) * info->block_size;
 
 	bg->header_blocks = header_blocks;
 	bg->first_block =
 	    aux_info->first_data_block + i * info->blocks_per_group;
 
-	u32 block = bg->first_block;
-	if (bg->has_superblock)
-		block +=
-		    1 + aux_info->bg_desc_blocks + info->bg_desc_reserve_blocks;
-	sparse_file_add_data(ext4_sparse_file, bg->bitmaps,
-			     2 * info->block_size, block);
-
 	bg->data_blocks_used = 0;
 	bg->free_blocks = info->blocks_per_group;
 	bg->first_free_block = 0;
@@ -369,10 +522,10 @@ static void init_bg(struct fs_info *info, struct fs_aux_info *aux_info,
 }
 
 void block_allocator_init(struct fs_info *info, struct fs_aux_info *aux_info,
-			  struct sparse_file *ext4_sparse_file, int force,
-			  jmp_buf *setjmp_env)
+			  int force, jmp_buf *setjmp_env)
 {
 	size_t i;
+	u32 *bg_free;
 
 	aux_info->bgs =
 	    calloc(sizeof(struct block_group_info), aux_info->groups);
@@ -382,26 +535,62 @@ void block_allocator_init(struct fs_info *info, struct fs_aux_info *aux_info,
 				     (size_t)aux_info->groups);
 
 	for (i = 0; i < aux_info->groups; i++)
-		init_bg(info, aux_info, ext4_sparse_file, force, setjmp_env, i);
+		init_bg(info, aux_info, force, setjmp_env, i);
+
+	bg_free = malloc(aux_info->groups * sizeof(u32));
+	aux_info->free_space = malloc(sizeof(struct free_space));
+	if (!bg_free || !aux_info->free_space)
+		critical_error_errno(setjmp_env, "malloc");
+	aux_info->free_blocks = 0;
+	aux_info->free_inodes = 0;
+	aux_info->used_dirs = 0;
+	for (i = 0; i < aux_info->groups; i++) {
+		bg_free[i] = aux_info->bgs[i].free_blocks;
+		aux_info->free_blocks += aux_info->bgs[i].free_blocks;
+		aux_info->free_inodes += aux_info->bgs[i].free_inodes;
+	}
+	free_space_init(aux_info->free_space, setjmp_env, bg_free,
+			aux_info->groups);
+	free(bg_free);
+
+	aux_info->inode_groups = calloc(DIV_ROUND_UP(aux_info->groups, 64),
+					sizeof(u64));
+	if (!aux_info->inode_groups)
+		critical_error_errno(setjmp_env, "calloc");
+	for (i = 0; i < aux_info->groups; i++)
+		if (aux_info->bgs[i].free_inodes)
+			aux_info->inode_groups[i / 64] |= 1ULL << (i % 64);
+	aux_info->first_inode_bg = 0;
+	if (aux_info->groups && !aux_info->bgs[0].free_inodes)
+		aux_info->first_inode_bg = aux_info->groups;
+
+	aux_info->goal_bg = -1;
 }
 
 void block_allocator_free(struct fs_aux_info *aux_info)
 {
 	unsigned int i;
+	u32 j;
 
 	for (i = 0; i < aux_info->groups; i++) {
 		free(aux_info->bgs[i].bitmaps);
+		if (aux_info->bgs[i].inode_table)
+			for (j = 0; j < aux_info->inode_table_blocks; j++)
+				free(aux_info->bgs[i].inode_table[j]);
 		free(aux_info->bgs[i].inode_table);
 	}
 	free(aux_info->bgs);
+	free_space_free(aux_info->free_space);
+	free(aux_info->free_space);
+	free(aux_info->inode_groups);
 }
 
-static u32 ext4_allocate_blocks_from_block_group(struct fs_aux_info *aux_info,
+static u64 ext4_allocate_blocks_from_block_group(struct fs_aux_info *aux_info,
 						 int force, jmp_buf *setjmp_env,
 						 u32 len, int bg_num)
 {
 	if (get_free_blocks(aux_info, bg_num) < len)
-		return EXT4_ALLOCATE_FAILED;
+		return EXT4_ALLOCATE_BLOCK_FAILED;
 
 	u32 block = aux_info->bgs[bg_num].first_free_block;
 	struct block_group_info *bg = &aux_info->bgs[bg_num];
@@ -410,115 +599,212 @@ static u32 ext4_allocate_blocks_from_block_group(struct fs_aux_info *aux_info,
 		error(force, setjmp_env,
 		      "failed to reserve %u blocks in block group %u\n", len,
 		      bg_num);
-		return EXT4_ALLOCATE_FAILED;
+		return EXT4_ALLOCATE_BLOCK_FAILED;
 	}
 
 	aux_info->bgs[bg_num].data_blocks_used += len;
+	aux_info->free_blocks -= len;
+	free_space_set(aux_info->free_space, bg_num, bg->free_blocks);
 
 	return bg->first_block + block;
 }
 
-/* Allocate a single block and return its block number */
-u32 allocate_block(struct fs_aux_info *aux_info, int force, jmp_buf *setjmp_env)
+/* Allocate a single block and return its block number.  The search starts
+   at the goal block group, if there is one. */
+u64 allocate_block(struct fs_aux_info *aux_info, int force, jmp_buf *setjmp_env)
 {
-	unsigned int i;
-	for (i = 0; i < aux_info->groups; i++) {
-		u32 block =
-		    ext4_allocate_blocks_from_block_group(aux_info, force,
-							  setjmp_env, 1, i);
+	unsigned int start = aux_info->goal_bg >= 0 ? aux_info->goal_bg : 0;
+	int bg = free_space_first_fit(aux_info->free_space, start, 1);
 
-		if (block != EXT4_ALLOCATE_FAILED)
-			return block;
-	}
+	if (bg < 0)
+		return EXT4_ALLOCATE_BLOCK_FAILED;
 
-	return EXT4_ALLOCATE_FAILED;
+	return ext4_allocate_blocks_from_block_group(aux_info, force, setjmp_env,
+						     1, bg);
 }
 
-static struct region *ext4_allocate_best_fit_partial(struct fs_aux_info
-						     *aux_info, int force,
-						     jmp_buf *setjmp_env,
-						     u32 len)
+/* Appends a region of the free blocks of the group that fits len best, or
+   of the largest group if none has len blocks free, to list.  Returns the
+   number of blocks allocated, or 0. */
+static u32 ext4_allocate_best_fit_partial(struct fs_aux_info *aux_info,
+					  int force, jmp_buf *setjmp_env,
+					  struct region_list *list, u32 len)
 {
-	unsigned int i;
-	unsigned int found_bg = 0;
+	int found_bg = free_space_best_fit(aux_info->free_space, len);
 	u32 found_bg_len = 0;
 
-	for (i = 0; i < aux_info->groups; i++) {
-		u32 bg_len = aux_info->bgs[i].free_blocks;
-
-		if ((len <= bg_len
-		     && (found_bg_len == 0 || bg_len < found_bg_len))
-		    || (len > found_bg_len && bg_len > found_bg_len)) {
-			found_bg = i;
-			found_bg_len = bg_len;
-		}
-	}
+	if (found_bg >= 0)
+		found_bg_len = aux_info->bgs[found_bg].free_blocks;
 
 	if (found_bg_len) {
 		u32 allocate_len = min(len, found_bg_len);
-		struct region *reg;
-		u32 block = ext4_allocate_blocks_from_block_group(aux_info,
+		u64 block = ext4_allocate_blocks_from_block_group(aux_info,
 								  force,
 								  setjmp_env,
 								  allocate_len,
 								  found_bg);
-		if (block == EXT4_ALLOCATE_FAILED) {
+		if (block == EXT4_ALLOCATE_BLOCK_FAILED) {
 			error(force, setjmp_env,
 			      "failed to allocate %d blocks in block group %d",
 			      allocate_len, found_bg);
-			return NULL;
-		}
-		reg = malloc(sizeof(struct region));
-		if (!reg) {
-			critical_error_errno(setjmp_env, "malloc(%zu)",
-					     sizeof(struct region));
+			return 0;
 		}
-		reg->block = block;
-		reg->len = allocate_len;
-		reg->next = NULL;
-		reg->prev = NULL;
-		reg->bg = found_bg;
-		return reg;
+		region_list_append(list, setjmp_env, block, allocate_len,
+				   found_bg);
+		return allocate_len;
 	} else {
 		error(force, setjmp_env,
 		      "failed to allocate %u blocks, out of space?", len);
 	}
 
-	return NULL;
+	return 0;
 }
 
-static struct region *ext4_allocate_best_fit(struct fs_aux_info *aux_info,
-					     int force, jmp_buf *setjmp_env,
-					     u32 len)
+static int ext4_allocate_best_fit(struct fs_aux_info *aux_info,
+				  int force, jmp_buf *setjmp_env,
+				  struct region_list *list, u32 len)
 {
-	struct region *first_reg = NULL;
-	struct region *prev_reg = NULL;
-	struct region *reg;
+	u32 allocated;
 
 	while (len > 0) {
-		reg = ext4_allocate_best_fit_partial(aux_info, force,
-						     setjmp_env, len);
-		if (reg == NULL)
-			return NULL;
+		allocated = ext4_allocate_best_fit_partial(aux_info, force,
+							   setjmp_env, list,
+							   len);
+		if (allocated == 0)
+			return -1;
+
+		len -= allocated;
+	}
+
+	return 0;
+}
+
+/* Allocates all len blocks from the goal block group, next to the inode
+   that they belong to, if they fit there */
+static int ext4_allocate_goal(struct fs_aux_info *aux_info,
+			      int force, jmp_buf *setjmp_env,
+			      struct region_list *list, u32 len)
+{
+	int bg = aux_info->goal_bg;
+	u64 block;
+
+	if (bg < 0 || len > aux_info->bgs[bg].free_blocks)
+		return -1;
+
+	block = ext4_allocate_blocks_from_block_group(aux_info, force,
+						      setjmp_env, len, bg);
+	if (block == EXT4_ALLOCATE_BLOCK_FAILED)
+		return -1;
 
-		if (first_reg == NULL)
-			first_reg = reg;
+	region_list_append(list, setjmp_env, block, len, bg);
+	return 0;
+}
+
+/* Returns the first block group of a run of groups from the groups between
+   from and to whose free blocks follow on from each other, as they do with
+   flex_bg when the groups after the first have no metadata of their own,
+   that has at least len free blocks, or of the longest run if none does,
+   or -1 if there are no free blocks.  The free blocks of the run are put
+   in *run_len. */
+static int find_free_run(struct fs_aux_info *aux_info, u32 from, u32 to,
+			 u32 len, u32 *run_len)
+{
+	u32 run_start = from;
+	u32 cur_len = 0;
+	u32 end = 0;
+	int best = -1;
+	u32 i;
+
+	*run_len = 0;
+	for (i = from; i < to; i++) {
+		struct block_group_info *bg = &aux_info->bgs[i];
+
+		if (cur_len && bg->first_free_block == 0 &&
+		    bg->first_block == end) {
+			cur_len += bg->free_blocks;
+		} else {
+			run_start = i;
+			cur_len = bg->free_blocks;
+		}
+		if (cur_len > *run_len) {
+			best = run_start;
+			*run_len = cur_len;
+			if (cur_len >= len)
+				break;
+		}
+		end = bg->first_block + bg->first_free_block + bg->free_blocks;
+	}
+
+	return best;
+}
+
+/* Allocates len blocks that do not fit in any one block group in runs over
+   consecutive groups: the first that they all fit in, searching from the
+   goal block group on first, or else the longest, until what is left fits
+   in a block group.  Only flex_bg leaves groups free from their first block
+   on, so without it there are no such runs.  Returns the number of blocks
+   allocated. */
+static u32 ext4_allocate_run(struct fs_aux_info *aux_info, int force,
+			     jmp_buf *setjmp_env, struct region_list *list,
+			     u32 len)
+{
+	u32 start = aux_info->goal_bg >= 0 ? aux_info->goal_bg : 0;
+	u32 allocated = 0;
+	u32 run_len;
+	u32 wrap_len;
+	int wrap;
+	int bg;
+
+	if (aux_info->groups_per_flex == 1)
+		return 0;
 
-		if (prev_reg) {
-			prev_reg->next = reg;
-			reg->prev = prev_reg;
+	while (allocated < len) {
+		u32 want = len - allocated;
+
+		bg = free_space_best_fit(aux_info->free_space, want);
+		if (bg < 0 || aux_info->bgs[bg].free_blocks >= want)
+			break;
+
+		bg = find_free_run(aux_info, start, aux_info->groups, want,
+				   &run_len);
+		if (run_len < want) {
+			wrap = find_free_run(aux_info, 0, start, want,
+					     &wrap_len);
+			if (wrap_len > run_len) {
+				bg = wrap;
+				run_len = wrap_len;
+			}
 		}
+		if (bg < 0)
+			break;
 
-		prev_reg = reg;
-		len -= reg->len;
+		for (want = min(want, run_len); want > 0; bg++) {
+			u32 n = min(want, aux_info->bgs[bg].free_blocks);
+			u64 block =
+			    ext4_allocate_blocks_from_block_group(aux_info,
+								  force,
+								  setjmp_env,
+								  n, bg);
+			if (block == EXT4_ALLOCATE_BLOCK_FAILED)
+				return allocated;
+
+			region_list_append(list, setjmp_env, block, n, bg);
+			allocated += n;
+			want -= n;
+		}
 	}
 
-	return first_reg;
+	return allocated;
 }
 
 /* Allocate len blocks.  The blocks may be spread across multiple block groups,
-   and are returned in a linked list of the blocks in each block group.  The
+   and are returned in an array of the blocks in each block group.  The
    allocation algorithm is:
+      0.  If the allocation fits in the goal block group, allocate it there
+      0a. If it does not fit in any block group but there are runs of them
+          whose free blocks follow on from each other, allocate it from the
+          first run it fits in, or else the longest, until the rest fits in
+          a block group
       1.  If the remaining allocation is larger than any available contiguous region,
           allocate the largest contiguous region and loop
       2.  Otherwise, allocate the smallest contiguous region that it fits in
@@ -527,82 +813,72 @@ struct block_allocation *allocate_blocks(struct fs_aux_info *aux_info,
 					 int force, jmp_buf *setjmp_env,
 					 u32 len)
 {
-	struct region *reg = ext4_allocate_best_fit(aux_info, force, setjmp_env,
-						    len);
+	struct block_allocation *alloc = create_allocation(setjmp_env);
+
+	if (ext4_allocate_goal(aux_info, force, setjmp_env, &alloc->list,
+			       len) == 0)
+		return alloc;
 
-	if (reg == NULL)
+	len -= ext4_allocate_run(aux_info, force, setjmp_env, &alloc->list,
+				 len);
+	if (len && ext4_allocate_best_fit(aux_info, force, setjmp_env,
+					  &alloc->list, len) < 0) {
+		free_alloc(alloc);
 		return NULL;
+	}
 
-	struct block_allocation *alloc = create_allocation(setjmp_env);
-	alloc->list.first = reg;
-	alloc->list.last = reg;
-	alloc->list.iter = alloc->list.first;
-	alloc->list.partial_iter = 0;
 	return alloc;
 }
 
 /* Returns the number of discontiguous regions used by an allocation */
 int block_allocation_num_regions(struct block_allocation *alloc)
 {
-	unsigned int i;
-	struct region *reg = alloc->list.first;
-
-	for (i = 0; reg != NULL; reg = reg->next)
-		i++;
-
-	return i;
+	return alloc->list.nr;
 }
 
 int block_allocation_len(struct block_allocation *alloc)
 {
-	unsigned int i;
-	struct region *reg = alloc->list.first;
-
-	for (i = 0; reg != NULL; reg = reg->next)
-		i += reg->len;
-
-	return i;
+	return alloc->list.len;
 }
 
-/* Returns the block number of the block'th block in an allocation */
-u32 get_block(struct block_allocation *alloc, u32 block)
+static u64 region_list_block(struct region_list *list, u32 block)
 {
-	struct region *reg = alloc->list.iter;
-	block += alloc->list.partial_iter;
+	u32 i;
 
-	for (; reg; reg = reg->next) {
-		if (block < reg->len)
-			return reg->block + block;
-		block -= reg->len;
+	block += list->partial_iter;
+	for (i = list->iter; i < list->nr; i++) {
+		if (block < list->regs[i].len)
+			return list->regs[i].block + block;
+		block -= list->regs[i].len;
 	}
-	return EXT4_ALLOCATE_FAILED;
+	return EXT4_ALLOCATE_BLOCK_FAILED;
 }
 
-u32 get_oob_block(struct block_allocation *alloc, u32 block)
+/* Returns the block number of the block'th block in an allocation */
+u64 get_block(struct block_allocation *alloc, u32 block)
 {
-	struct region *reg = alloc->oob_list.iter;
-	block += alloc->oob_list.partial_iter;
+	return region_list_block(&alloc->list, block);
+}
 
-	for (; reg; reg = reg->next) {
-		if (block < reg->len)
-			return reg->block + block;
-		block -= reg->len;
-	}
-	return EXT4_ALLOCATE_FAILED;
+u64 get_oob_block(struct block_allocation *alloc, u32 block)
+{
+	return region_list_block(&alloc->oob_list, block);
 }
 
 /* Gets the starting block and length in blocks of the first region
    of an allocation */
-void get_region(struct block_allocation *alloc, u32 *block, u32 *len)
+void get_region(struct block_allocation *alloc, u64 *block, u32 *len)
 {
-	*block = alloc->list.iter->block;
-	*len = alloc->list.iter->len - alloc->list.partial_iter;
+	struct region *reg = &alloc->list.regs[alloc->list.iter];
+
+	*block = reg->block;
+	*len = reg->len - alloc->list.partial_iter;
 }
 
 /* Move to the next region in an allocation */
 void get_next_region(struct block_allocation *alloc)
 {
-	alloc->list.iter = alloc->list.iter->next;
+	alloc->list.iter++;
 	alloc->list.partial_iter = 0;
 }
 
@@ -614,102 +890,61 @@ u32 get_free_blocks(struct fs_aux_info *aux_info, u32 bg)
 
 int last_region(struct block_allocation *alloc)
 {
-	return (alloc->list.iter == NULL);
+	return alloc->list.iter >= alloc->list.nr;
 }
 
 void rewind_alloc(struct block_allocation *alloc)
 {
-	alloc->list.iter = alloc->list.first;
-	alloc->list.partial_iter = 0;
-}
-
-static struct region *do_split_allocation(struct block_allocation *alloc,
-					  jmp_buf *setjmp_env, u32 len)
-{
-	struct region *reg = alloc->list.iter;
-	struct region *new;
-	struct region *tmp;
-
-	while (reg && len >= reg->len) {
-		len -= reg->len;
-		reg = reg->next;
-	}
-
-	if (reg == NULL && len > 0)
-		return NULL;
-
-	if (len > 0) {
-		new = malloc(sizeof(struct region));
-		if (!new) {
-			critical_error_errno(setjmp_env, "malloc(%zu)",
-					     sizeof(struct region));
-		}
-
-		new->bg = reg->bg;
-		new->block = reg->block + len;
-		new->len = reg->len - len;
-		new->next = reg->next;
-		new->prev = reg;
-
-		reg->next = new;
-		reg->len = len;
-
-		tmp = alloc->list.iter;
-		alloc->list.iter = new;
-		return tmp;
-	} else {
-		return reg;
-	}
-}
-
-/* Splits an allocation into two allocations.  The returned allocation will
-   point to the first half, and the original allocation ptr will point to the
-   second half. */
-static struct region *split_allocation(struct block_allocation *alloc,
-				       jmp_buf *setjmp_env, u32 len)
-{
-	/* First make sure there is a split at the current ptr */
-	do_split_allocation(alloc, setjmp_env, alloc->list.partial_iter);
-
-	/* Then split off len blocks */
-	struct region *middle = do_split_allocation(alloc, setjmp_env, len);
+	alloc->list.iter = 0;
 	alloc->list.partial_iter = 0;
-	return middle;
 }
 
 /* Reserve the next blocks for oob data (indirect or extent blocks) */
 int reserve_oob_blocks(struct block_allocation *alloc, jmp_buf *setjmp_env,
 		       int blocks)
 {
-	struct region *oob = split_allocation(alloc, setjmp_env, blocks);
-	struct region *next;
-
-	if (oob == NULL)
+	struct region_list *list = &alloc->list;
+	int start;
+	int end;
+	int i;
+
+	/* split at the current block, then after the oob blocks */
+	start = region_list_split(list, setjmp_env, list->iter,
+				  list->partial_iter);
+	if (start < 0)
+		return -1;
+	end = region_list_split(list, setjmp_env, start, blocks);
+	if (end < 0)
 		return -1;
 
-	while (oob && oob != alloc->list.iter) {
-		next = oob->next;
-		region_list_remove(&alloc->list, oob);
-		region_list_append(&alloc->oob_list, oob);
-		oob = next;
+	for (i = start; i < end; i++) {
+		region_list_append(&alloc->oob_list, setjmp_env,
+				   list->regs[i].block, list->regs[i].len,
+				   list->regs[i].bg);
+		list->len -= list->regs[i].len;
 	}
+	memmove(&list->regs[start], &list->regs[end],
+		(list->nr - end) * sizeof(struct region));
+	list->nr -= end - start;
+	list->iter = start;
+	list->partial_iter = 0;
 
 	return 0;
 }
 
 static int advance_list_ptr(struct region_list *list, int blocks)
 {
-	struct region *reg = list->iter;
+	while (list->iter < list->nr && blocks > 0) {
+		u32 left = list->regs[list->iter].len - list->partial_iter;
 
-	while (reg != NULL && blocks > 0) {
-		if (reg->len > list->partial_iter + blocks) {
+		if (left > (u32)blocks) {
 			list->partial_iter += blocks;
 			return 0;
 		}
 
-		blocks -= (reg->len - list->partial_iter);
+		blocks -= left;
+		list->iter++;
 		list->partial_iter = 0;
-		reg = reg->next;
 	}
 
 	if (blocks > 0)
@@ -733,17 +968,12 @@ int append_oob_allocation(struct fs_aux_info *aux_info, int force,
 			  jmp_buf *setjmp_env, struct block_allocation *alloc,
 			  u32 len)
 {
-	struct region *reg = ext4_allocate_best_fit(aux_info, force, setjmp_env,
-						    len);
-
-	if (reg == NULL) {
+	if (ext4_allocate_best_fit(aux_info, force, setjmp_env,
+				   &alloc->oob_list, len) < 0) {
 		error(force, setjmp_env, "failed to allocate %d blocks", len);
 		return -1;
 	}
 
-	for (; reg; reg = reg->next)
-		region_list_append(&alloc->oob_list, reg);
-
 	return 0;
 }
 
@@ -752,13 +982,17 @@ struct ext4_inode *get_inode(struct fs_info *info, struct fs_aux_info *aux_info,
 			     struct sparse_file *ext4_sparse_file,
 			     jmp_buf *setjmp_env, u32 inode)
 {
+	u32 inodes_per_block = info->block_size / info->inode_size;
+	u8 *block;
+
+	(void)ext4_sparse_file;	/* queued by queue_bg_metadata() */
+
 	inode -= 1;
 	int bg = inode / info->inodes_per_group;
 	inode %= info->inodes_per_group;
 
-	allocate_bg_inode_table(info, aux_info, ext4_sparse_file, setjmp_env,
-				bg);
-	return (struct ext4_inode *)(aux_info->bgs[bg].inode_table + inode *
+	block = inode_table_block(info, aux_info, setjmp_env, bg, inode);
+	return (struct ext4_inode *)(block + (inode % inodes_per_block) *
 				     info->inode_size);
 }
 
@@ -773,7 +1007,7 @@ struct ext4_xattr_header *get_xattr_block_for_inode(struct fs_info *info, struct
 	if (block != NULL)
 		return block;
 
-	u32 block_num = allocate_block(aux_info, force, setjmp_env);
+	u64 block_num = allocate_block(aux_info, force, setjmp_env);
 	block = calloc(info->block_size, 1);
 	if (block == NULL) {
 		error(force, setjmp_env, "get_xattr: failed to allocate %d",
@@ -788,6 +1022,7 @@ struct ext4_xattr_header *get_xattr_block_for_inode(struct fs_info *info, struct
 	    cpu_to_le32(le32_to_cpu(inode->i_blocks_lo) +
 			(info->block_size / 512));
 	inode->i_file_acl_lo = cpu_to_le32(block_num);
+	inode->osd2.linux2.l_i_file_acl_high = cpu_to_le16(block_num >> 32);
 
 	int result =
 	    sparse_file_add_data(ext4_sparse_file, block, info->block_size,
@@ -802,42 +1037,175 @@ struct ext4_xattr_header *get_xattr_block_for_inode(struct fs_info *info, struct
 	return block;
 }
 
+/* Returns the first group from start on that has free inodes, or the number
+   of groups if none does */
+static u32 next_inode_group(struct fs_aux_info *aux_info, u32 start)
+{
+	u32 words = DIV_ROUND_UP(aux_info->groups, 64);
+	u32 i = start / 64;
+	u64 word;
+
+	if (start >= aux_info->groups)
+		return aux_info->groups;
+
+	/* full groups are skipped 64 at a time */
+	word = aux_info->inode_groups[i] & (~0ULL << (start % 64));
+	while (!word) {
+		if (++i == words)
+			return aux_info->groups;
+		word = aux_info->inode_groups[i];
+	}
+
+	for (start = i * 64; !(word & 1); word >>= 1)
+		start++;
+	return start;
+}
+
 /* Mark the first len inodes in a block group as used */
 u32 reserve_inodes(struct fs_aux_info *aux_info, int bg, u32 num)
 {
-	unsigned int i;
 	u32 inode;
 
 	if (get_free_inodes(aux_info, bg) < num)
 		return EXT4_ALLOCATE_FAILED;
 
-	for (i = 0; i < num; i++) {
-		inode = aux_info->bgs[bg].first_free_inode + i - 1;
-		aux_info->bgs[bg].inode_bitmap[inode / 8] |= 1 << (inode % 8);
-	}
-
 	inode = aux_info->bgs[bg].first_free_inode;
+	bitmap_set_bits(aux_info->bgs[bg].inode_bitmap, inode - 1, num);
 
 	aux_info->bgs[bg].first_free_inode += num;
 	aux_info->bgs[bg].free_inodes -= num;
+	aux_info->free_inodes -= num;
+	if (!aux_info->bgs[bg].free_inodes) {
+		aux_info->inode_groups[bg / 64] &= ~(1ULL << (bg % 64));
+		if ((u32)bg == aux_info->first_inode_bg)
+			aux_info->first_inode_bg =
+			    next_inode_group(aux_info, bg + 1);
+	}
 
 	return inode;
 }
 
-/* Returns the first free inode number
-   TODO: Inodes should be allocated in the block group of the data? */
+/* Returns the first free inode number, searching from the goal block group
+   so that files end up in the group of their directory.  Without a goal,
+   the first group with free inodes is known already. */
 u32 allocate_inode(struct fs_info *info, struct fs_aux_info *aux_info)
 {
-	unsigned int bg;
+	u32 bg = aux_info->first_inode_bg;
 	u32 inode;
 
-	for (bg = 0; bg < aux_info->groups; bg++) {
-		inode = reserve_inodes(aux_info, bg, 1);
-		if (inode != EXT4_ALLOCATE_FAILED)
-			return bg * info->inodes_per_group + inode;
+	if (aux_info->goal_bg >= 0) {
+		bg = next_inode_group(aux_info, aux_info->goal_bg);
+		if (bg == aux_info->groups)
+			bg = aux_info->first_inode_bg;
 	}
+	if (bg == aux_info->groups)
+		return EXT4_ALLOCATE_FAILED;
 
-	return EXT4_ALLOCATE_FAILED;
+	inode = reserve_inodes(aux_info, bg, 1);
+	if (inode == EXT4_ALLOCATE_FAILED)
+		return EXT4_ALLOCATE_FAILED;
+
+	return bg * info->inodes_per_group + inode;
+}
+
+/* Picks the block group for a new directory, after the Orlov allocator of
+   the kernel.  Directories in the root are spread out over the groups with
+   more free inodes and blocks than average, taking the one with the fewest
+   directories.  Deeper directories stay near their parent, in the first
+   group from the parent's on that is not much fuller than average. */
+static int find_dir_group(struct fs_info *info, struct fs_aux_info *aux_info,
+			  u32 parent_inode)
+{
+	unsigned int parent_bg = (parent_inode - 1) / info->inodes_per_group;
+	u32 avg_inodes = aux_info->free_inodes / aux_info->groups;
+	u32 avg_blocks = aux_info->free_blocks / aux_info->groups;
+	u32 max_dirs;
+	u32 min_inodes;
+	u32 min_blocks;
+	struct block_group_info *bg;
+	int best = -1;
+	unsigned int i;
+
+	if (parent_inode == EXT4_ROOT_INO) {
+		for (i = 0; i < aux_info->groups; i++) {
+			bg = &aux_info->bgs[i];
+			if (!bg->free_inodes || bg->free_inodes < avg_inodes ||
+			    bg->free_blocks < avg_blocks)
+				continue;
+			if (best < 0 ||
+			    bg->used_dirs < aux_info->bgs[best].used_dirs)
+				best = i;
+		}
+		if (best >= 0)
+			return best;
+	} else {
+		max_dirs = aux_info->used_dirs / aux_info->groups +
+		    info->inodes_per_group / 16;
+		min_inodes = avg_inodes > info->inodes_per_group / 4 ?
+		    avg_inodes - info->inodes_per_group / 4 : 1;
+		min_blocks = avg_blocks > info->blocks_per_group / 4 ?
+		    avg_blocks - info->blocks_per_group / 4 : 0;
+
+		for (i = 0; i < aux_info->groups; i++) {
+			bg = &aux_info->bgs[(parent_bg + i) %
+					    aux_info->groups];
+			if (bg->used_dirs < max_dirs &&
+			    bg->free_inodes >= min_inodes &&
+			    bg->free_blocks >= min_blocks)
+				return (parent_bg + i) % aux_info->groups;
+		}
+	}
+
+	/* the filesystem is nearly full, take any group with a free inode */
+	i = next_inode_group(aux_info, parent_bg);
+	if (i == aux_info->groups)
+		i = aux_info->first_inode_bg;
+
+	return i < aux_info->groups ? (int)i : -1;
+}
+
+/* Allocates the inode of a new directory in parent_inode, in the group
+   chosen by find_dir_group(), and makes that group the goal for what is
+   allocated for the directory */
+u32 allocate_dir_inode(struct fs_info *info, struct fs_aux_info *aux_info,
+		       u32 parent_inode)
+{
+	int bg = find_dir_group(info, aux_info, parent_inode);
+	u32 inode;
+
+	if (bg < 0)
+		return EXT4_ALLOCATE_FAILED;
+
+	inode = reserve_inodes(aux_info, bg, 1);
+	if (inode == EXT4_ALLOCATE_FAILED)
+		return EXT4_ALLOCATE_FAILED;
+
+	aux_info->goal_bg = bg;
+	return bg * info->inodes_per_group + inode;
+}
+
+/* Makes the block group of inode the goal for the inodes and blocks that
+   are allocated next */
+void set_alloc_goal(struct fs_info *info, struct fs_aux_info *aux_info,
+		    u32 inode)
+{
+	aux_info->goal_bg = (inode - 1) / info->inodes_per_group;
+}
+
+/* Makes the block group that len blocks fit best, or the one with the most
+   free blocks if they fit in none, the goal for the inodes and blocks that
+   are allocated next */
+void set_alloc_goal_fit(struct fs_aux_info *aux_info, u32 len)
+{
+	aux_info->goal_bg = free_space_best_fit(aux_info->free_space, len);
+}
+
+/* Returns the number of inodes at the end of the inode table of a block
+   group that have never been used */
+u32 get_itable_unused(struct fs_aux_info *aux_info, u32 bg)
+{
+	return aux_info->sb->s_inodes_per_group -
+	    (aux_info->bgs[bg].first_free_inode - 1);
 }
 
 /* Returns the number of free inodes in a block group */
@@ -852,6 +1220,7 @@ void add_directory(struct fs_info *info, struct fs_aux_info *aux_info,
 {
 	int bg = (inode - 1) / info->inodes_per_group;
 	aux_info->bgs[bg].used_dirs += 1;
+	aux_info->used_dirs += 1;
 }
 
 /* Returns the number of inodes in a block group that are directories */
@@ -869,21 +1238,7 @@ u16 get_bg_flags(struct fs_aux_info *aux_info, int bg)
 /* Frees the memory used by a linked list of allocation regions */
 void free_alloc(struct block_allocation *alloc)
 {
-	struct region *reg;
-
-	reg = alloc->list.first;
-	while (reg) {
-		struct region *next = reg->next;
-		free(reg);
-		reg = next;
-	}
-
-	reg = alloc->oob_list.first;
-	while (reg) {
-		struct region *next = reg->next;
-		free(reg);
-		reg = next;
-	}
-
+	free(alloc->list.regs);
+	free(alloc->oob_list.regs);
 	free(alloc);
 }
@@ -18,16 +18,20 @@
 #define _ALLOCATE_H_
 
 #define EXT4_ALLOCATE_FAILED (u32)(~0)
+#define EXT4_ALLOCATE_BLOCK_FAILED (u64)(~0ULL)
 
 #include "ext4_utils.h"
 
 struct region;
 
+/* The regions of an allocation, in order, in one array */
 struct region_list {
-	struct region *first;
-	struct region *last;
-	struct region *iter;
-	u32 partial_iter;
+	struct region *regs;
+	u32 nr;			/* regions in use */
+	u32 size;		/* regions allocated */
+	u32 len;		/* blocks in all the regions */
+	u32 iter;		/* current region, nr at the end */
+	u32 partial_iter;	/* blocks of the current region used */
 };
 
 struct block_allocation {
@@ -40,10 +44,12 @@ struct block_allocation {
 struct sparse_file;
 
 void block_allocator_init(struct fs_info *info, struct fs_aux_info *aux_info,
-			  struct sparse_file *ext4_sparse_file, int force,
-			  jmp_buf *setjmp_env);
+			  int force, jmp_buf *setjmp_env);
+void queue_bg_metadata(struct fs_info *info, struct fs_aux_info *aux_info,
+		       struct sparse_file *ext4_sparse_file,
+		       jmp_buf *setjmp_env);
 void block_allocator_free(struct fs_aux_info *aux_info);
-u32 allocate_block(struct fs_aux_info *aux_info, int force,
+u64 allocate_block(struct fs_aux_info *aux_info, int force,
 		   jmp_buf *setjmp_env);
 struct block_allocation *allocate_blocks(struct fs_aux_info *aux_info,
 					 int force, jmp_buf *setjmp_env,
@@ -61,11 +67,12 @@ struct ext4_xattr_header *get_xattr_block_for_inode(struct fs_info *info, struct
 						    struct ext4_inode *inode);
 void reduce_allocation(struct fs_aux_info *aux_info,
 		       struct block_allocation *alloc, u32 len);
-u32 get_block(struct block_allocation *alloc, u32 block);
-u32 get_oob_block(struct block_allocation *alloc, u32 block);
+u64 get_block(struct block_allocation *alloc, u32 block);
+u64 get_oob_block(struct block_allocation *alloc, u32 block);
 void get_next_region(struct block_allocation *alloc);
-void get_region(struct block_allocation *alloc, u32 *block, u32 *len);
+void get_region(struct block_allocation *alloc, u64 *block, u32 *len);
 u32 get_free_blocks(struct fs_aux_info *aux_info, u32 bg);
+u32 get_itable_unused(struct fs_aux_info *aux_info, u32 bg);
 u32 get_free_inodes(struct fs_aux_info *aux_info, u32 bg);
 u32 reserve_inodes(struct fs_aux_info *aux_info, int bg, u32 inodes);
 void add_directory(struct fs_info *info, struct fs_aux_info *aux_info,
@@ -73,6 +80,11 @@ void add_directory(struct fs_info *info, struct fs_aux_info *aux_info,
 u16 get_directories(struct fs_aux_info *aux_info, int bg);
 u16 get_bg_flags(struct fs_aux_info *aux_info, int bg);
 u32 allocate_inode(struct fs_info *info, struct fs_aux_info *aux_info);
+u32 allocate_dir_inode(struct fs_info *info, struct fs_aux_info *aux_info,
+		       u32 parent_inode);
+void set_alloc_goal(struct fs_info *info, struct fs_aux_info *aux_info,
+		    u32 inode);
+void set_alloc_goal_fit(struct fs_aux_info *aux_info, u32 len);
 void free_alloc(struct block_allocation *alloc);
 int reserve_oob_blocks(struct block_allocation *alloc, jmp_buf *setjmp_env,
 		       int blocks);
@@ -81,8 +93,10 @@ int advance_oob_blocks(struct block_allocation *alloc, int blocks);
 int last_region(struct block_allocation *alloc);
 void rewind_alloc(struct block_allocation *alloc);
 void append_region(struct block_allocation *alloc, jmp_buf *setjmp_env,
-		   u32 block, u32 len, int bg);
+		   u64 block, u32 len, int bg);
 struct block_allocation *create_allocation(jmp_buf *setjmp_env);
+struct block_allocation *copy_allocation(jmp_buf *setjmp_env,
+					 const struct block_allocation *alloc);
 int append_oob_allocation(struct fs_aux_info *aux_info, int force,
 			  jmp_buf *setjmp_env, struct block_allocation *alloc,
 			  u32 len);
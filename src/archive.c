@@ -0,0 +1,1186 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ext4_utils.h"
+#include "archive.h"
+#include "contents.h"
+#include "dedup.h"
+#include "gzindex.h"
+#include "holes.h"
+#include "hardlink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Reads a tar (v7, ustar, GNU or pax) or cpio (newc) archive, optionally
+   gzip compressed, into the same tree of dentries that scan_directory_tree()
+   builds from a directory.  File data is not copied if the archive is a
+   regular file: the dentries point at the data inside it, and gzip data is
+   decompressed again through a gz_index when it is written.  Otherwise,
+   as for a pipe, the data is copied once to an unlinked temporary file
+   while the archive is read.  Either way, the image is then built from the
+   data source filled in by read_archive(). */
+
+#define TAR_BLOCK_SIZE 512
+#define CPIO_HEADER_SIZE 110
+#define ARCHIVE_BUF_SIZE (64 * 1024)
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+struct archive_entry {
+	char *path;		/* relative to the root of the image */
+	const char *name;	/* last component of path */
+	struct archive_entry **children;
+	u32 nr_children;
+	u32 children_alloc;
+	u8 file_type;
+	u16 mode;
+	u16 uid;
+	u16 gid;
+	u32 mtime;
+	u64 size;
+	dev_t rdev;
+	char *link;
+	u64 data_offset;
+	u32 nlink;		/* cpio: hard links share ino */
+	u64 ino;
+	struct hardlink *hardlink;
+};
+
+struct archive {
+	int force;
+	jmp_buf *setjmp_env;
+	time_t fixed_time;
+	const char *filename;
+	gzFile gz;		/* NULL when read through data.gz */
+	int fd;
+	struct data_source data;
+	bool in_place;
+	u64 base;		/* offset of the archive in data */
+	u64 pos;		/* offset in the uncompressed archive */
+	u64 data_len;		/* bytes copied to data.fd */
+	char *buf;
+	struct archive_entry root;
+	struct archive_entry **table;	/* entries by path */
+	size_t table_size;
+	size_t table_used;
+	struct archive_entry **links;	/* cpio entries with nlink > 1 */
+	size_t nr_links;
+	size_t links_alloc;
+	struct hardlink_table *hardlinks;
+	u64 nr_hardlinks;
+	struct dedup_table *dedups;
+	u32 block_size;
+	int zero_blocks;
+};
+
+static size_t archive_read(struct archive *ar, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		unsigned int chunk = min(len - done, (size_t)ARCHIVE_BUF_SIZE);
+
+		if (ar->gz) {
+			ret = gzread(ar->gz, (char *)buf + done, chunk);
+			if (ret < 0) {
+				int err;
+				critical_error(ar->setjmp_env, "%s: %s",
+					       ar->filename,
+					       gzerror(ar->gz, &err));
+			}
+		} else {
+			ret = data_source_pread(&ar->data, (char *)buf + done,
+						chunk, ar->base + ar->pos + done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				critical_error_errno(ar->setjmp_env, "%s",
+						     ar->filename);
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	ar->pos += done;
+
+	return done;
+}
+
+static void archive_read_all(struct archive *ar, void *buf, size_t len)
+{
+	if (archive_read(ar, buf, len) != len)
+		critical_error(ar->setjmp_env, "%s: unexpected end of archive",
+			       ar->filename);
+}
+
+static void archive_skip(struct archive *ar, u64 len)
+{
+	if (ar->in_place) {
+		/* a gz_index only decompresses what is read */
+		if (ar->gz && gzseek(ar->gz, len, SEEK_CUR) < 0)
+			critical_error(ar->setjmp_env, "%s: seek failed",
+				       ar->filename);
+		ar->pos += len;
+		return;
+	}
+
+	while (len > 0) {
+		size_t chunk = min(len, (u64) ARCHIVE_BUF_SIZE);
+		archive_read_all(ar, ar->buf, chunk);
+		len -= chunk;
+	}
+}
+
+/* Takes note of where the next len bytes of file data are, and moves past
+   them.  Returns their offset in ar->data. */
+static u64 archive_data(struct archive *ar, u64 len)
+{
+	u64 offset;
+
+	if (ar->in_place) {
+		offset = ar->base + ar->pos;
+		archive_skip(ar, len);
+		return offset;
+	}
+
+	offset = ar->data_len;
+	while (len > 0) {
+		size_t chunk = min(len, (u64) ARCHIVE_BUF_SIZE);
+		archive_read_all(ar, ar->buf, chunk);
+		if (write(ar->data.fd, ar->buf, chunk) != (ssize_t)chunk)
+			critical_error_errno(ar->setjmp_env,
+					     "writing temporary file");
+		ar->data_len += chunk;
+		len -= chunk;
+	}
+
+	return offset;
+}
+
+static u32 archive_hash(const char *path)
+{
+	u32 hash = 2166136261u;
+
+	while (*path)
+		hash = (hash ^ (u8)*path++) * 16777619u;
+
+	return hash;
+}
+
+static struct archive_entry **archive_slot(struct archive *ar,
+					   const char *path)
+{
+	size_t i = archive_hash(path) & (ar->table_size - 1);
+
+	while (ar->table[i] && strcmp(ar->table[i]->path, path))
+		i = (i + 1) & (ar->table_size - 1);
+
+	return &ar->table[i];
+}
+
+static struct archive_entry *archive_lookup(struct archive *ar,
+					    const char *path)
+{
+	if (!*path)
+		return &ar->root;
+	if (!ar->table_size)
+		return NULL;
+	return *archive_slot(ar, path);
+}
+
+static void archive_insert(struct archive *ar, struct archive_entry *entry)
+{
+	if ((ar->table_used + 1) * 2 > ar->table_size) {
+		struct archive_entry **old = ar->table;
+		size_t old_size = ar->table_size;
+		size_t i;
+
+		ar->table_size = old_size ? old_size * 2 : 1024;
+		ar->table = calloc(ar->table_size, sizeof(*ar->table));
+		if (!ar->table)
+			critical_error_errno(ar->setjmp_env, "calloc");
+		for (i = 0; i < old_size; i++)
+			if (old[i])
+				*archive_slot(ar, old[i]->path) = old[i];
+		free(old);
+	}
+
+	*archive_slot(ar, entry->path) = entry;
+	ar->table_used++;
+}
+
+/* Turns a member name into a path relative to the root of the image,
+   without leading "/" or "./" or empty or "." components.  Returns NULL
+   if the name has a ".." component. */
+static char *archive_normalize(struct archive *ar, const char *name)
+{
+	char *path = malloc(strlen(name) + 1);
+	char *p = path;
+	const char *end;
+	size_t len;
+
+	if (!path)
+		critical_error_errno(ar->setjmp_env, "malloc");
+
+	while (*name) {
+		end = strchrnul(name, '/');
+		len = end - name;
+		if (len == 2 && name[0] == '.' && name[1] == '.') {
+			free(path);
+			return NULL;
+		}
+		if (len && !(len == 1 && name[0] == '.')) {
+			if (p != path)
+				*p++ = '/';
+			memcpy(p, name, len);
+			p += len;
+		}
+		name = *end ? end + 1 : end;
+	}
+	*p = '\0';
+
+	return path;
+}
+
+static void archive_add_child(struct archive *ar, struct archive_entry *dir,
+			      struct archive_entry *entry)
+{
+	if (dir->nr_children == dir->children_alloc) {
+		u32 alloc = dir->children_alloc ? dir->children_alloc * 2 : 8;
+		struct archive_entry **children;
+
+		children = realloc(dir->children, alloc * sizeof(*children));
+		if (!children)
+			critical_error_errno(ar->setjmp_env, "realloc");
+		dir->children = children;
+		dir->children_alloc = alloc;
+	}
+	dir->children[dir->nr_children++] = entry;
+}
+
+static struct archive_entry *archive_new_entry(struct archive *ar,
+					       struct archive_entry *dir,
+					       char *path)
+{
+	struct archive_entry *entry = calloc(1, sizeof(struct archive_entry));
+	const char *slash;
+
+	if (!entry)
+		critical_error_errno(ar->setjmp_env, "calloc");
+
+	entry->path = path;
+	slash = strrchr(path, '/');
+	entry->name = slash ? slash + 1 : path;
+
+	archive_add_child(ar, dir, entry);
+	archive_insert(ar, entry);
+
+	return entry;
+}
+
+/* Returns the directory that path goes in, creating any missing parent
+   directories the archive did not list. */
+static struct archive_entry *archive_parent(struct archive *ar,
+					    const char *path)
+{
+	struct archive_entry *dir;
+	struct archive_entry *parent;
+	const char *slash = strrchr(path, '/');
+	char *dir_path;
+
+	if (!slash)
+		return &ar->root;
+
+	dir_path = strndup(path, slash - path);
+	if (!dir_path)
+		critical_error_errno(ar->setjmp_env, "strndup");
+
+	dir = archive_lookup(ar, dir_path);
+	if (dir) {
+		free(dir_path);
+		if (dir->file_type != EXT4_FT_DIR) {
+			error(ar->force, ar->setjmp_env, "%s: not a directory",
+			      dir->path);
+			return NULL;
+		}
+		return dir;
+	}
+
+	parent = archive_parent(ar, dir_path);
+	if (!parent) {
+		free(dir_path);
+		return NULL;
+	}
+
+	dir = archive_new_entry(ar, parent, dir_path);
+	dir->file_type = EXT4_FT_DIR;
+	dir->mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+	dir->mtime = ar->fixed_time != -1 ? ar->fixed_time : 0;
+
+	return dir;
+}
+
+/* Adds a member of the archive, or replaces an earlier member with the same
+   path, as extracting the archive would.  Returns NULL if it was skipped. */
+static struct archive_entry *archive_add(struct archive *ar, const char *name,
+					 const struct archive_entry *attrs)
+{
+	struct archive_entry *entry;
+	struct archive_entry *dir;
+	char *path;
+
+	path = archive_normalize(ar, name);
+	if (!path) {
+		error(ar->force, ar->setjmp_env,
+		      "%s: refusing path with \"..\": %s", ar->filename, name);
+		return NULL;
+	}
+
+	if (!*path) {
+		/* the root directory is created with fixed permissions */
+		free(path);
+		return NULL;
+	}
+
+	entry = archive_lookup(ar, path);
+	if (entry) {
+		free(path);
+		if (entry->file_type == EXT4_FT_DIR &&
+		    attrs->file_type != EXT4_FT_DIR) {
+			error(ar->force, ar->setjmp_env,
+			      "%s: cannot replace directory %s",
+			      ar->filename, entry->path);
+			return NULL;
+		}
+		free(entry->link);
+	} else {
+		dir = archive_parent(ar, path);
+		if (!dir) {
+			free(path);
+			return NULL;
+		}
+		entry = archive_new_entry(ar, dir, path);
+	}
+
+	entry->file_type = attrs->file_type;
+	entry->mode = attrs->mode;
+	entry->uid = attrs->uid;
+	entry->gid = attrs->gid;
+	entry->mtime = ar->fixed_time != -1 ? ar->fixed_time : attrs->mtime;
+	entry->size = attrs->size;
+	entry->rdev = attrs->rdev;
+	entry->link = attrs->link;
+	entry->data_offset = attrs->data_offset;
+	entry->nlink = attrs->nlink;
+	entry->ino = attrs->ino;
+	entry->hardlink = attrs->hardlink;
+
+	return entry;
+}
+
+/* A new group of names for the same file */
+static struct hardlink *archive_hardlink(struct archive *ar)
+{
+	struct hardlink *link;
+
+	link = hardlink_get(ar->hardlinks, 0, ++ar->nr_hardlinks);
+	if (!link)
+		critical_error_errno(ar->setjmp_env, "hardlink_get");
+
+	return link;
+}
+
+static u8 archive_file_type(mode_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		return EXT4_FT_REG_FILE;
+	case S_IFDIR:
+		return EXT4_FT_DIR;
+	case S_IFCHR:
+		return EXT4_FT_CHRDEV;
+	case S_IFBLK:
+		return EXT4_FT_BLKDEV;
+	case S_IFIFO:
+		return EXT4_FT_FIFO;
+	case S_IFSOCK:
+		return EXT4_FT_SOCK;
+	case S_IFLNK:
+		return EXT4_FT_SYMLINK;
+	}
+	return EXT4_FT_UNKNOWN;
+}
+
+/* Parses an octal number field, or a GNU base-256 one */
+static u64 tar_number(const char *field, size_t len)
+{
+	u64 n = 0;
+	size_t i = 0;
+
+	if ((u8)field[0] & 0x80) {
+		if ((u8)field[0] == 0xff)
+			return 0;	/* negative */
+		n = field[0] & 0x3f;
+		for (i = 1; i < len; i++)
+			n = (n << 8) | (u8)field[i];
+		return n;
+	}
+
+	while (i < len && field[i] == ' ')
+		i++;
+	while (i < len && field[i] >= '0' && field[i] <= '7')
+		n = n * 8 + field[i++] - '0';
+
+	return n;
+}
+
+static bool tar_checksum_ok(const u8 *block, const struct tar_header *hdr)
+{
+	u64 expected = tar_number(hdr->chksum, sizeof(hdr->chksum));
+	unsigned int sum = 0;
+	int ssum = 0;
+	size_t i;
+
+	for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+		u8 c = block[i];
+		if (i >= offsetof(struct tar_header, chksum) &&
+		    i < offsetof(struct tar_header, typeflag))
+			c = ' ';
+		sum += c;
+		ssum += (signed char)c;
+	}
+
+	return sum == expected || ssum == (int)expected;
+}
+
+static char *tar_read_string(struct archive *ar, u64 size)
+{
+	char *str = malloc(size + 1);
+
+	if (!str)
+		critical_error_errno(ar->setjmp_env, "malloc");
+	archive_read_all(ar, str, size);
+	str[size] = '\0';
+	archive_skip(ar, -size & (TAR_BLOCK_SIZE - 1));
+
+	return str;
+}
+
+/* Values from pax and GNU extension headers for the next member */
+struct tar_pending {
+	char *name;
+	char *link;
+	int64_t size;
+	int64_t uid;
+	int64_t gid;
+	int64_t mtime;
+	bool sparse;
+};
+
+static void tar_parse_pax(struct archive *ar, struct tar_pending *pending,
+			  char *data, u64 size)
+{
+	char *p = data;
+	char *end = data + size;
+
+	while (p < end && *p) {
+		char *key;
+		char *value;
+		char *eq;
+		char *next;
+		u64 len = strtoull(p, &key, 10);
+
+		if (*key != ' ' || len == 0 || len > (u64) (end - p))
+			critical_error(ar->setjmp_env,
+				       "%s: malformed pax header", ar->filename);
+		next = p + len;
+		key++;
+		eq = memchr(key, '=', next - key);
+		if (!eq)
+			critical_error(ar->setjmp_env,
+				       "%s: malformed pax header", ar->filename);
+		*eq = '\0';
+		value = eq + 1;
+		next[-1] = '\0';	/* the newline */
+
+		if (!strcmp(key, "path")) {
+			free(pending->name);
+			pending->name = strdup(value);
+		} else if (!strcmp(key, "linkpath")) {
+			free(pending->link);
+			pending->link = strdup(value);
+		} else if (!strcmp(key, "size")) {
+			pending->size = strtoll(value, NULL, 10);
+		} else if (!strcmp(key, "uid")) {
+			pending->uid = strtoll(value, NULL, 10);
+		} else if (!strcmp(key, "gid")) {
+			pending->gid = strtoll(value, NULL, 10);
+		} else if (!strcmp(key, "mtime")) {
+			pending->mtime = strtoll(value, NULL, 10);
+		} else if (!strncmp(key, "GNU.sparse.", 11)) {
+			pending->sparse = true;
+		}
+
+		p = next;
+	}
+}
+
+static void tar_clear_pending(struct tar_pending *pending)
+{
+	free(pending->name);
+	free(pending->link);
+	memset(pending, 0, sizeof(*pending));
+	pending->size = -1;
+	pending->uid = -1;
+	pending->gid = -1;
+	pending->mtime = -1;
+}
+
+static void read_tar(struct archive *ar, u8 *block)
+{
+	struct tar_header *hdr = (struct tar_header *)block;
+	struct tar_pending pending;
+	struct archive_entry attrs;
+	struct archive_entry *target;
+	char name[sizeof(hdr->prefix) + 1 + sizeof(hdr->name) + 1];
+	char linkname[sizeof(hdr->linkname) + 1];
+	const char *member;
+	char *data;
+	char *path;
+	u64 size;
+	u64 consumed;
+	size_t len;
+	size_t n;
+	int i;
+
+	memset(&pending, 0, sizeof(pending));
+	tar_clear_pending(&pending);
+
+	for (;;) {
+		for (i = 0; i < TAR_BLOCK_SIZE && !block[i]; i++) ;
+		if (i == TAR_BLOCK_SIZE)
+			break;	/* end of archive */
+
+		if (!tar_checksum_ok(block, hdr))
+			critical_error(ar->setjmp_env,
+				       "%s: bad tar header checksum at offset %"
+				       PRIu64, ar->filename,
+				       ar->pos - TAR_BLOCK_SIZE);
+
+		size = tar_number(hdr->size, sizeof(hdr->size));
+
+		switch (hdr->typeflag) {
+		case 'L':
+			free(pending.name);
+			pending.name = tar_read_string(ar, size);
+			goto next;
+		case 'K':
+			free(pending.link);
+			pending.link = tar_read_string(ar, size);
+			goto next;
+		case 'x':
+			data = tar_read_string(ar, size);
+			tar_parse_pax(ar, &pending, data, size);
+			free(data);
+			goto next;
+		case 'g':
+			archive_skip(ar, (size + TAR_BLOCK_SIZE - 1) &
+				     ~(u64) (TAR_BLOCK_SIZE - 1));
+			goto next;
+		}
+
+		if (pending.name) {
+			member = pending.name;
+		} else {
+			len = 0;
+			if (!memcmp(hdr->magic, "ustar", 6) && hdr->prefix[0]) {
+				len = strnlen(hdr->prefix, sizeof(hdr->prefix));
+				memcpy(name, hdr->prefix, len);
+				name[len++] = '/';
+			}
+			n = strnlen(hdr->name, sizeof(hdr->name));
+			memcpy(name + len, hdr->name, n);
+			name[len + n] = '\0';
+			member = name;
+		}
+		if (!pending.link) {
+			memcpy(linkname, hdr->linkname, sizeof(hdr->linkname));
+			linkname[sizeof(hdr->linkname)] = '\0';
+		}
+		if (pending.size >= 0)
+			size = pending.size;
+
+		consumed = 0;
+		memset(&attrs, 0, sizeof(attrs));
+		attrs.mode = tar_number(hdr->mode, sizeof(hdr->mode)) & 07777;
+		attrs.uid = pending.uid >= 0 ? (u64) pending.uid :
+		    tar_number(hdr->uid, sizeof(hdr->uid));
+		attrs.gid = pending.gid >= 0 ? (u64) pending.gid :
+		    tar_number(hdr->gid, sizeof(hdr->gid));
+		attrs.mtime = pending.mtime >= 0 ? (u64) pending.mtime :
+		    tar_number(hdr->mtime, sizeof(hdr->mtime));
+
+		switch (hdr->typeflag) {
+		case '\0':
+		case '0':
+		case '7':
+			if (hdr->typeflag == '\0' && *member &&
+			    member[strlen(member) - 1] == '/') {
+				attrs.file_type = EXT4_FT_DIR;
+				break;
+			}
+			if (pending.sparse) {
+				error(ar->force, ar->setjmp_env,
+				      "%s: sparse members are not supported: %s",
+				      ar->filename, member);
+				break;
+			}
+			attrs.file_type = EXT4_FT_REG_FILE;
+			attrs.size = size;
+			attrs.data_offset = archive_data(ar, size);
+			consumed = size;
+			break;
+		case '1':
+			/* another name for an earlier member */
+			path = archive_normalize(ar, pending.link ?
+						 pending.link : linkname);
+			target = path ? archive_lookup(ar, path) : NULL;
+			free(path);
+			if (!target || target->file_type == EXT4_FT_DIR) {
+				error(ar->force, ar->setjmp_env,
+				      "%s: bad hard link target for %s",
+				      ar->filename, member);
+				break;
+			}
+			if (!target->hardlink)
+				target->hardlink = archive_hardlink(ar);
+			attrs.file_type = target->file_type;
+			attrs.size = target->size;
+			attrs.data_offset = target->data_offset;
+			attrs.rdev = target->rdev;
+			attrs.hardlink = target->hardlink;
+			if (target->link) {
+				attrs.link = strdup(target->link);
+				if (!attrs.link)
+					critical_error_errno(ar->setjmp_env,
+							     "strdup");
+			}
+			break;
+		case '2':
+			attrs.file_type = EXT4_FT_SYMLINK;
+			attrs.link = strdup(pending.link ?
+					    pending.link : linkname);
+			if (!attrs.link)
+				critical_error_errno(ar->setjmp_env, "strdup");
+			break;
+		case '3':
+		case '4':
+			attrs.file_type = hdr->typeflag == '3' ?
+			    EXT4_FT_CHRDEV : EXT4_FT_BLKDEV;
+			attrs.rdev =
+			    makedev(tar_number
+				    (hdr->devmajor, sizeof(hdr->devmajor)),
+				    tar_number(hdr->devminor,
+					       sizeof(hdr->devminor)));
+			break;
+		case '5':
+			attrs.file_type = EXT4_FT_DIR;
+			break;
+		case '6':
+			attrs.file_type = EXT4_FT_FIFO;
+			break;
+		default:
+			error(ar->force, ar->setjmp_env,
+			      "%s: unsupported tar member type '%c' for %s",
+			      ar->filename, hdr->typeflag, member);
+			break;
+		}
+
+		if (attrs.file_type != EXT4_FT_UNKNOWN) {
+			if (!archive_add(ar, member, &attrs))
+				free(attrs.link);
+		}
+
+		/* the rest of the data, and the padding after it */
+		archive_skip(ar, ((size + TAR_BLOCK_SIZE - 1) &
+				  ~(u64) (TAR_BLOCK_SIZE - 1)) - consumed);
+		tar_clear_pending(&pending);
+next:
+		if (archive_read(ar, block, TAR_BLOCK_SIZE) != TAR_BLOCK_SIZE)
+			break;	/* tolerate a missing end of archive marker */
+	}
+
+	tar_clear_pending(&pending);
+}
+
+static u32 cpio_number(const char *field)
+{
+	char buf[9];
+
+	memcpy(buf, field, 8);
+	buf[8] = '\0';
+	return strtoul(buf, NULL, 16);
+}
+
+static int compare_links(const void *a, const void *b)
+{
+	const struct archive_entry *ea = *(const struct archive_entry **)a;
+	const struct archive_entry *eb = *(const struct archive_entry **)b;
+
+	if (ea->ino != eb->ino)
+		return ea->ino < eb->ino ? -1 : 1;
+	return 0;
+}
+
+/* In a cpio archive, only one of the names of a hard linked file carries
+   its data.  All the names that share an ino become one file. */
+static void cpio_resolve_links(struct archive *ar)
+{
+	struct archive_entry *data;
+	struct hardlink *link;
+	size_t i;
+	size_t j;
+	size_t k;
+
+	if (!ar->nr_links)
+		return;
+
+	qsort(ar->links, ar->nr_links, sizeof(*ar->links), compare_links);
+
+	for (i = 0; i < ar->nr_links; i = j) {
+		data = NULL;
+		for (j = i; j < ar->nr_links &&
+		     ar->links[j]->ino == ar->links[i]->ino; j++)
+			if (ar->links[j]->file_type == EXT4_FT_REG_FILE &&
+			    ar->links[j]->size)
+				data = ar->links[j];
+		link = archive_hardlink(ar);
+		for (k = i; k < j; k++) {
+			if (ar->links[k]->file_type != EXT4_FT_REG_FILE ||
+			    ar->links[k]->ino != ar->links[i]->ino)
+				continue;
+			if (data) {
+				ar->links[k]->size = data->size;
+				ar->links[k]->data_offset = data->data_offset;
+			}
+			ar->links[k]->hardlink = link;
+		}
+	}
+
+	free(ar->links);
+	ar->links = NULL;
+	ar->nr_links = 0;
+}
+
+static void read_cpio(struct archive *ar, u8 *block)
+{
+	struct archive_entry attrs;
+	struct archive_entry *entry;
+	char *name;
+	u32 namesize;
+	u32 mode;
+
+	for (;;) {
+		if (memcmp(block, "070701", 6) && memcmp(block, "070702", 6))
+			critical_error(ar->setjmp_env,
+				       "%s: bad cpio header at offset %" PRIu64,
+				       ar->filename, ar->pos - CPIO_HEADER_SIZE);
+
+		namesize = cpio_number((char *)block + 94);
+		name = malloc(namesize + 1);
+		if (!name)
+			critical_error_errno(ar->setjmp_env, "malloc");
+		archive_read_all(ar, name, namesize);
+		name[namesize] = '\0';
+		archive_skip(ar, -ar->pos & 3);
+
+		if (!strcmp(name, "TRAILER!!!")) {
+			free(name);
+			break;
+		}
+
+		memset(&attrs, 0, sizeof(attrs));
+		mode = cpio_number((char *)block + 14);
+		attrs.mode = mode & 07777;
+		attrs.uid = cpio_number((char *)block + 22);
+		attrs.gid = cpio_number((char *)block + 30);
+		attrs.nlink = cpio_number((char *)block + 38);
+		attrs.mtime = cpio_number((char *)block + 46);
+		attrs.size = cpio_number((char *)block + 54);
+		attrs.ino = (u64) cpio_number((char *)block + 62) << 48 ^
+		    (u64) cpio_number((char *)block + 70) << 32 ^
+		    cpio_number((char *)block + 6);
+		attrs.rdev = makedev(cpio_number((char *)block + 78),
+				     cpio_number((char *)block + 86));
+		attrs.file_type = archive_file_type(mode);
+
+		switch (attrs.file_type) {
+		case EXT4_FT_REG_FILE:
+			attrs.data_offset = archive_data(ar, attrs.size);
+			break;
+		case EXT4_FT_SYMLINK:
+			attrs.link = malloc(attrs.size + 1);
+			if (!attrs.link)
+				critical_error_errno(ar->setjmp_env, "malloc");
+			archive_read_all(ar, attrs.link, attrs.size);
+			attrs.link[attrs.size] = '\0';
+			break;
+		case EXT4_FT_UNKNOWN:
+			error(ar->force, ar->setjmp_env,
+			      "%s: unknown file type on %s", ar->filename,
+			      name);
+			/* fall through */
+		default:
+			archive_skip(ar, attrs.size);
+			break;
+		}
+		archive_skip(ar, -ar->pos & 3);
+
+		entry = NULL;
+		if (attrs.file_type != EXT4_FT_UNKNOWN) {
+			entry = archive_add(ar, name, &attrs);
+			if (!entry)
+				free(attrs.link);
+		}
+		if (entry && attrs.file_type == EXT4_FT_REG_FILE &&
+		    attrs.nlink > 1) {
+			if (ar->nr_links == ar->links_alloc) {
+				size_t alloc = ar->links_alloc ?
+				    ar->links_alloc * 2 : 64;
+				struct archive_entry **links =
+				    realloc(ar->links, alloc * sizeof(*links));
+				if (!links)
+					critical_error_errno(ar->setjmp_env,
+							     "realloc");
+				ar->links = links;
+				ar->links_alloc = alloc;
+			}
+			ar->links[ar->nr_links++] = entry;
+		}
+		free(name);
+
+		archive_read_all(ar, block, CPIO_HEADER_SIZE);
+	}
+
+	cpio_resolve_links(ar);
+}
+
+/* Finds the blocks of a regular file that are not all zeros */
+static void archive_data_ranges(struct archive *ar, struct dentry *dentry)
+{
+	u32 file_blocks = DIV_ROUND_UP(dentry->size, ar->block_size);
+	int nr;
+
+	nr = find_data_ranges(&ar->data, dentry->data_offset, dentry->size,
+			      ar->block_size, 0, 1, (u8 *)ar->buf,
+			      ARCHIVE_BUF_SIZE, &dentry->ranges);
+	if (nr < 0)
+		critical_error_errno(ar->setjmp_env, "%s: reading %s",
+				     ar->filename, dentry->filename);
+
+	if (nr == 1 && dentry->ranges[0].block == 0 &&
+	    dentry->ranges[0].len == file_blocks) {
+		free(dentry->ranges);
+		dentry->ranges = NULL;
+		return;
+	}
+	dentry->nr_ranges = nr;
+	dentry->holes = 1;
+}
+
+/* Hashes the data of a regular file so that files with the same contents
+   can share their blocks */
+static void archive_dedup(struct archive *ar, struct dentry *dentry)
+{
+	u8 digest[SHA1_DIGEST_LENGTH];
+
+	if (dedup_hash_data(&ar->data, dentry->data_offset, dentry->size,
+			    (u8 *)ar->buf, ARCHIVE_BUF_SIZE, digest) < 0)
+		critical_error_errno(ar->setjmp_env, "%s: reading %s",
+				     ar->filename, dentry->filename);
+
+	dentry->dedup = dedup_get(ar->dedups, dentry->size, digest);
+	if (!dentry->dedup)
+		critical_error_errno(ar->setjmp_env, "dedup_get");
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	return strcmp((*(struct archive_entry *const *)a)->name,
+		      (*(struct archive_entry *const *)b)->name);
+}
+
+/* Turns the children of an archive directory into the dentries of dir,
+   laid out as scan_dir() does: one allocation for the dentries and all of
+   their strings.  Frees the archive entries as it goes. */
+static void archive_build_dentries(struct archive *ar,
+				   struct fs_config_list *config_list,
+				   fs_config_func_t fs_config_func,
+				   struct archive_entry *adir,
+				   struct dentry *dir)
+{
+	struct archive_entry *entry;
+	struct dentry *dentries;
+	struct dentry *dentry;
+	size_t size;
+	char *p;
+	int extra = 0;
+	u32 i;
+	u32 n;
+
+	qsort(adir->children, adir->nr_children, sizeof(*adir->children),
+	      compare_entries);
+
+	if (adir == &ar->root) {
+		/* root directory, check if lost+found already exists */
+		for (i = 0; i < adir->nr_children; i++)
+			if (!strcmp(adir->children[i]->name, "lost+found"))
+				break;
+		if (i == adir->nr_children)
+			extra = 1;
+	}
+
+	size = extra * (sizeof(struct dentry) + sizeof("lost+found"));
+	for (i = 0; i < adir->nr_children; i++) {
+		entry = adir->children[i];
+		size += sizeof(struct dentry) + strlen(entry->name) + 1;
+		if (entry->file_type == EXT4_FT_DIR)
+			size += strlen(entry->path) + 1;
+		else if (entry->file_type == EXT4_FT_SYMLINK)
+			size += strlen(entry->link) + 1;
+	}
+
+	dentries = calloc(1, size ? size : 1);
+	if (!dentries)
+		critical_error_errno(ar->setjmp_env, "calloc");
+	dir->dentries = dentries;
+	dir->entries = extra + adir->nr_children;
+	p = (char *)&dentries[dir->entries];
+
+	if (extra) {
+		/* insert a lost+found directory at the beginning of the dentries */
+		strcpy(p, "lost+found");
+		dentries[0].filename = p;
+		dentries[0].path = p;
+		p += sizeof("lost+found");
+		dentries[0].mode = S_IRWXU;
+		dentries[0].file_type = EXT4_FT_DIR;
+		dir->dirs++;
+	}
+
+	for (i = 0, n = extra; i < adir->nr_children; i++, n++) {
+		entry = adir->children[i];
+		dentry = &dentries[n];
+
+		strcpy(p, entry->name);
+		dentry->filename = p;
+		p += strlen(p) + 1;
+
+		dentry->file_type = entry->file_type;
+		dentry->size = entry->size;
+		dentry->rdev = entry->rdev;
+		dentry->data_offset = entry->data_offset;
+		dentry->hardlink = entry->hardlink;
+		if (ar->zero_blocks && entry->file_type == EXT4_FT_REG_FILE &&
+		    entry->size)
+			archive_data_ranges(ar, dentry);
+		if (ar->dedups && entry->file_type == EXT4_FT_REG_FILE &&
+		    entry->size)
+			archive_dedup(ar, dentry);
+		dentry->mode = entry->mode;
+		dentry->uid = entry->uid;
+		dentry->gid = entry->gid;
+		dentry->mtime = entry->mtime;
+
+		if (fs_config_func != NULL) {
+			unsigned int mode = 0;
+			unsigned int uid = 0;
+			unsigned int gid = 0;
+			uint64_t capabilities;
+			int is_dir = entry->file_type == EXT4_FT_DIR;
+			if (fs_config_func(config_list, entry->path, is_dir,
+					   &uid, &gid, &mode, &capabilities)) {
+				dentry->mode = mode;
+				dentry->uid = uid;
+				dentry->gid = gid;
+				dentry->capabilities = capabilities;
+			}
+		}
+
+		if (entry->file_type == EXT4_FT_DIR) {
+			strcpy(p, entry->path);
+			dentry->path = p;
+			p += strlen(p) + 1;
+			dir->dirs++;
+		} else if (entry->file_type == EXT4_FT_SYMLINK) {
+			strcpy(p, entry->link);
+			dentry->link = p;
+			p += strlen(p) + 1;
+		}
+	}
+
+	for (i = 0, n = extra; i < adir->nr_children; i++, n++) {
+		entry = adir->children[i];
+		if (entry->file_type == EXT4_FT_DIR)
+			archive_build_dentries(ar, config_list, fs_config_func,
+					       entry, &dentries[n]);
+		free(entry->children);
+		free(entry->link);
+		free(entry->path);
+		free(entry);
+	}
+	free(adir->children);
+	adir->children = NULL;
+	adir->nr_children = 0;
+}
+
+/* Reads the archive in filename ("-" for standard input) into root, and
+   fills in data, which the file data is to be read from at the data_offset
+   of each regular file dentry.  data is to be closed with
+   gz_index_free() and close() once the image is written.  Hard links share an entry of hardlinks, and
+   if dedups is not NULL, files with the same contents share an entry of
+   it.  If zero_blocks is set, the blocks of block_size bytes that are all
+   zeros are left out of the data ranges of each regular file. */
+void read_archive(struct fs_config_list *config_list,
+		  fs_config_func_t fs_config_func, time_t fixed_time,
+		  int force, jmp_buf *setjmp_env, const char *filename,
+		  struct hardlink_table *hardlinks, struct dedup_table *dedups,
+		  u32 block_size, int zero_blocks, struct dentry *root,
+		  struct data_source *data)
+{
+	struct archive ar;
+	struct stat st;
+	u8 block[TAR_BLOCK_SIZE];
+	off_t base;
+	bool regular;
+	FILE *tmp;
+	int fd;
+
+	memset(&ar, 0, sizeof(ar));
+	ar.force = force;
+	ar.setjmp_env = setjmp_env;
+	ar.fixed_time = fixed_time;
+	ar.filename = filename;
+	ar.hardlinks = hardlinks;
+	ar.dedups = dedups;
+	ar.block_size = block_size;
+	ar.zero_blocks = zero_blocks;
+	ar.root.path = "";
+	ar.root.file_type = EXT4_FT_DIR;
+
+	if (!strcmp(filename, "-")) {
+		ar.filename = "<stdin>";
+		ar.fd = STDIN_FILENO;
+	} else {
+		ar.fd = open(filename, O_RDONLY);
+		if (ar.fd < 0)
+			critical_error_errno(setjmp_env, "open %s", filename);
+	}
+
+	ar.buf = malloc(ARCHIVE_BUF_SIZE);
+	if (!ar.buf)
+		critical_error_errno(setjmp_env, "malloc");
+
+	ar.data.fd = -1;
+	base = lseek(ar.fd, 0, SEEK_CUR);
+	regular = base >= 0 && fstat(ar.fd, &st) == 0 && S_ISREG(st.st_mode);
+	if (regular && gz_index_is_gzip(ar.fd, base)) {
+		ar.in_place = true;
+		ar.data.fd = ar.fd;
+		ar.data.gz = gz_index_new(ar.fd, base);
+		if (!ar.data.gz)
+			critical_error_errno(setjmp_env, "%s", ar.filename);
+	} else {
+		fd = dup(ar.fd);
+		if (fd < 0)
+			critical_error_errno(setjmp_env, "dup");
+		ar.gz = gzdopen(fd, "rb");
+		if (!ar.gz)
+			critical_error(setjmp_env, "%s: gzdopen failed",
+				       ar.filename);
+		gzbuffer(ar.gz, 128 * 1024);
+	}
+
+	/* the tar magic, if any, is well inside the first header */
+	archive_read_all(&ar, block, CPIO_HEADER_SIZE);
+
+	if (ar.gz && regular && gzdirect(ar.gz)) {
+		ar.in_place = true;
+		ar.base = base;
+		ar.data.fd = ar.fd;
+	} else if (ar.gz) {
+		/* data on a pipe can only be read once */
+		tmp = tmpfile();
+		if (!tmp)
+			critical_error_errno(setjmp_env, "tmpfile");
+		ar.data.fd = dup(fileno(tmp));
+		fclose(tmp);
+		if (ar.data.fd < 0)
+			critical_error_errno(setjmp_env, "dup");
+	}
+
+	if (!memcmp(block, "070701", 6) || !memcmp(block, "070702", 6)) {
+		read_cpio(&ar, block);
+	} else {
+		archive_read_all(&ar, block + CPIO_HEADER_SIZE,
+				 TAR_BLOCK_SIZE - CPIO_HEADER_SIZE);
+		read_tar(&ar, block);
+	}
+
+	if (ar.gz)
+		gzclose(ar.gz);
+	if (!ar.in_place && ar.fd != STDIN_FILENO)
+		close(ar.fd);
+
+	root->path = "";
+	root->file_type = EXT4_FT_DIR;
+	archive_build_dentries(&ar, config_list, fs_config_func, &ar.root,
+			       root);
+	free(ar.table);
+	free(ar.buf);
+
+	*data = ar.data;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include "ext4_utils.h"
+#include "contents.h"
+#include "dedup.h"
+#include "gzindex.h"
+#include "hardlink.h"
+
+void read_archive(struct fs_config_list *config_list,
+		  fs_config_func_t fs_config_func, time_t fixed_time,
+		  int force, jmp_buf *setjmp_env, const char *filename,
+		  struct hardlink_table *hardlinks, struct dedup_table *dedups,
+		  u32 block_size, int zero_blocks, struct dentry *root,
+		  struct data_source *data);
+
+#endif
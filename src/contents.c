@@ -15,6 +15,7 @@
  */
 
 #include <sys/stat.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -26,19 +27,92 @@
 #include "ext4_utils.h"
 #include "allocate.h"
 #include "contents.h"
+#include "dirhash.h"
 #include "extent.h"
 #include "indirect.h"
 
+/* Directory leaves whose entries get their inode numbers only as the rest
+   of the tree is made, so that they are checksummed once it is built */
+struct dir_leaves {
+	u8 *data;
+	u32 blocks;
+	u32 csum_seed;
+	struct dir_leaves *next;
+};
+
+/* Returns the space for entries in a directory block, which leaves room for
+   the checksum tail with metadata_csum */
+static u32 dir_block_space(struct fs_info *info)
+{
+	if (ext4_has_metadata_csum(info))
+		return info->block_size - sizeof(struct ext4_dir_entry_tail);
+
+	return info->block_size;
+}
+
+/* Puts the checksum tails at the end of blocks leaf blocks from data on, and
+   remembers them for set_directory_csums() */
+static void dir_leaves_add(struct fs_info *info, struct fs_aux_info *aux_info,
+			   jmp_buf *setjmp_env, u8 *data, u32 blocks,
+			   u32 inode_num, struct ext4_inode *inode)
+{
+	struct ext4_dir_entry_tail *tail;
+	struct dir_leaves *leaves;
+	u32 i;
+
+	for (i = 0; i < blocks; i++) {
+		tail = (struct ext4_dir_entry_tail *)(data + (i + 1) *
+						      info->block_size) - 1;
+		tail->det_rec_len = sizeof(*tail);
+		tail->det_reserved_ft = EXT4_FT_DIR_CSUM;
+	}
+
+	leaves = malloc(sizeof(*leaves));
+	if (!leaves)
+		critical_error_errno(setjmp_env, "malloc");
+	leaves->data = data;
+	leaves->blocks = blocks;
+	leaves->csum_seed = ext4_inode_csum_seed(aux_info, inode_num,
+						 inode->i_generation);
+	leaves->next = aux_info->dir_leaves;
+	aux_info->dir_leaves = leaves;
+}
+
+/* Sets the checksums of all directory leaves, once the inode numbers of
+   their entries are filled in */
+void set_directory_csums(struct fs_info *info, struct fs_aux_info *aux_info)
+{
+	struct ext4_dir_entry_tail *tail;
+	struct dir_leaves *leaves;
+	u8 *block;
+	u32 i;
+
+	while ((leaves = aux_info->dir_leaves) != NULL) {
+		for (i = 0; i < leaves->blocks; i++) {
+			block = leaves->data + i * info->block_size;
+			tail = (struct ext4_dir_entry_tail *)(block +
+							      info->block_size)
+			    - 1;
+			tail->det_checksum =
+			    ext4_crc32c(leaves->csum_seed, block,
+					(u8 *)tail - block);
+		}
+		aux_info->dir_leaves = leaves->next;
+		free(leaves);
+	}
+}
+
 static u32 dentry_size(struct fs_info *info, u32 entries,
 		       struct dentry *dentries)
 {
+	u32 space = dir_block_space(info);
 	u32 len = 24;
 	unsigned int i;
 	unsigned int dentry_len;
 
 	for (i = 0; i < entries; i++) {
 		dentry_len = 8 + EXT4_ALIGN(strlen(dentries[i].filename), 4);
-		if (len % info->block_size + dentry_len > info->block_size)
+		if (len % info->block_size + dentry_len > space)
 			len += info->block_size - (len % info->block_size);
 		len += dentry_len;
 	}
@@ -57,15 +131,15 @@ static struct ext4_dir_entry_2 *add_dentry(struct fs_info *info,
 	u16 rec_len = 8 + EXT4_ALIGN(name_len, 4);
 	struct ext4_dir_entry_2 *dentry;
 
-	u32 start_block = *offset / info->block_size;
-	u32 end_block = (*offset + rec_len - 1) / info->block_size;
-	if (start_block != end_block) {
-		/* Adding this dentry will cross a block boundary, so pad the previous
-		   dentry to the block boundary */
+	u32 block_start = *offset - *offset % info->block_size;
+	u32 block_end = block_start + dir_block_space(info);
+	if (*offset + rec_len > block_end) {
+		/* Adding this dentry will run past the entries of the block, so
+		   pad the previous dentry to their end */
 		if (!prev)
 			critical_error(setjmp_env, "no prev");
-		prev->rec_len += end_block * info->block_size - *offset;
-		*offset = end_block * info->block_size;
+		prev->rec_len += block_end - *offset;
+		*offset = block_start + info->block_size;
 	}
 
 	dentry = (struct ext4_dir_entry_2 *)(data + *offset);
@@ -79,16 +153,404 @@ static struct ext4_dir_entry_2 *add_dentry(struct fs_info *info,
 	return dentry;
 }
 
+static u8 *inline_data_xattr(struct fs_info *info, int force,
+			     jmp_buf *setjmp_env, struct ext4_inode *inode,
+			     const void *value, size_t value_len);
+
+/* Returns the largest value of the system.data attribute that fits in the
+   body of an inode, or 0 if the inodes have no room for attributes */
+static u32 inline_xattr_space(struct fs_info *info)
+{
+	int space = info->inode_size - (int)sizeof(struct ext4_inode) -
+	    (int)sizeof(struct ext4_xattr_ibody_header) -
+	    (int)EXT4_XATTR_LEN(strlen(EXT4_INLINE_DATA_NAME)) -
+	    (int)sizeof(u32);
+
+	return space > 0 ? space & ~EXT4_XATTR_ROUND : 0;
+}
+
+/* Returns the largest file that make_inline_file() can store, or 0 if the
+   filesystem does not have inline data */
+u32 inline_data_max(struct fs_info *info)
+{
+	if (!(info->feat_incompat & EXT4_FEATURE_INCOMPAT_INLINE_DATA))
+		return 0;
+	if (!inline_xattr_space(info))
+		return 0;
+
+	return EXT4_MIN_INLINE_DATA_SIZE + inline_xattr_space(info);
+}
+
+/* Works out whether the entries of a directory fit in its inode.  The first
+   ones go in i_block after the inode number of .., the rest in the value
+   of system.data.  Returns the length of that value, or -1 if they do not
+   fit, and sets *in_iblock to the number of entries in i_block. */
+static int inline_dir_layout(struct fs_info *info, u32 entries,
+			     struct dentry *dentries, u32 *in_iblock)
+{
+	u32 offset = EXT4_INLINE_DOTDOT_SIZE;
+	u32 value_len = 0;
+	u32 dentry_len;
+	u32 i;
+
+	for (i = 0; i < entries; i++) {
+		dentry_len = 8 + EXT4_ALIGN(strlen(dentries[i].filename), 4);
+		if (value_len == 0 &&
+		    offset + dentry_len <= EXT4_MIN_INLINE_DATA_SIZE) {
+			offset += dentry_len;
+			*in_iblock = i + 1;
+		} else {
+			value_len += dentry_len;
+		}
+	}
+	if (offset == EXT4_INLINE_DOTDOT_SIZE)
+		*in_iblock = 0;
+
+	if (value_len > inline_xattr_space(info))
+		return -1;
+
+	return value_len;
+}
+
+/* Stores a directory's entries in its inode, as laid out by
+   inline_dir_layout().  Directories in inodes have no . and .. entries;
+   i_block starts with the inode number of .. instead. */
+static int make_inline_directory(struct fs_info *info, int force,
+				 jmp_buf *setjmp_env, struct ext4_inode *inode,
+				 u32 dir_inode_num, u32 entries,
+				 struct dentry *dentries, u32 in_iblock,
+				 u32 value_len)
+{
+	u8 *data = (u8 *)inode->i_block;
+	struct ext4_dir_entry_2 *dentry = NULL;
+	u32 offset = EXT4_INLINE_DOTDOT_SIZE;
+	u32 i;
+
+	*(u32 *)data = cpu_to_le32(dir_inode_num);
+	for (i = 0; i < in_iblock; i++) {
+		dentry = add_dentry(info, setjmp_env, data, &offset, dentry, 0,
+				    dentries[i].filename,
+				    dentries[i].file_type);
+		dentries[i].inode = &dentry->inode;
+	}
+	if (!dentry) {
+		/* an unused entry covers the space */
+		dentry = (struct ext4_dir_entry_2 *)(data + offset);
+		dentry->rec_len = 0;
+	}
+	dentry->rec_len += EXT4_MIN_INLINE_DATA_SIZE - offset;
+
+	/* the rest go in system.data, which needs to exist even when empty */
+	data = inline_data_xattr(info, force, setjmp_env, inode, NULL,
+				 value_len);
+	if (!data)
+		return -1;
+
+	offset = 0;
+	dentry = NULL;
+	for (i = in_iblock; i < entries; i++) {
+		dentry = add_dentry(info, setjmp_env, data, &offset, dentry, 0,
+				    dentries[i].filename,
+				    dentries[i].file_type);
+		dentries[i].inode = &dentry->inode;
+	}
+
+	inode->i_size_lo = EXT4_MIN_INLINE_DATA_SIZE + value_len;
+	inode->i_flags |= EXT4_INLINE_DATA_FL;
+
+	return 0;
+}
+
+/* The index blocks of hashed directories, as in fs/ext4/namei.c */
+struct dx_root_info {
+	u32 reserved_zero;
+	u8 hash_version;
+	u8 info_length;
+	u8 indirect_levels;
+	u8 unused_flags;
+};
+
+struct dx_entry {
+	u32 hash;
+	u32 block;
+};
+
+/* overlays the hash of the first dx_entry of an index block */
+struct dx_countlimit {
+	u16 limit;
+	u16 count;
+};
+
+/* follows the last possible dx_entry of a block with metadata_csum */
+struct dx_tail {
+	u32 dt_reserved;
+	u32 dt_checksum;
+};
+
+#define DX_ROOT_ENTRIES_OFFSET (12 + 12 + sizeof(struct dx_root_info))
+#define DX_NODE_ENTRIES_OFFSET 8
+
+struct dx_name {
+	u32 hash;
+	u32 minor_hash;
+	u32 index;
+};
+
+/* The layout of a hashed directory: dx_root in block 0, then the leaves
+   holding the entries in hash order, then any dx_node blocks */
+struct dx_dir {
+	struct dx_name *names;
+	u32 *leaves;		/* index in names of the first entry of each */
+	u32 nr_leaves;
+	u32 nr_nodes;
+};
+
+static int compare_dx_names(const void *a, const void *b)
+{
+	const struct dx_name *x = a;
+	const struct dx_name *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	if (x->minor_hash != y->minor_hash)
+		return x->minor_hash < y->minor_hash ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Returns how many dx_entries fit in an index block from offset on */
+static u32 dx_limit(struct fs_info *info, u32 offset)
+{
+	u32 space = info->block_size - offset;
+
+	if (ext4_has_metadata_csum(info))
+		space -= sizeof(struct dx_tail);
+
+	return space / sizeof(struct dx_entry);
+}
+
+/* Sets the checksum of a dx_root or dx_node block, whose entries start at
+   offset, which covers the block up to the last entry and the tail */
+static void dx_csum_set(u8 *block, u32 offset, u32 csum_seed)
+{
+	struct dx_countlimit *countlimit = (struct dx_countlimit *)(block +
+								   offset);
+	struct dx_tail *tail = (struct dx_tail *)(block + offset +
+						  countlimit->limit *
+						  sizeof(struct dx_entry));
+	u32 zero = 0;
+	u32 crc;
+
+	crc = ext4_crc32c(csum_seed, block,
+			  offset + countlimit->count * sizeof(struct dx_entry));
+	crc = ext4_crc32c(crc, &tail->dt_reserved, sizeof(tail->dt_reserved));
+	tail->dt_checksum = ext4_crc32c(crc, &zero, sizeof(zero));
+}
+
+/* Returns whether a directory of entries that takes blocks linear blocks
+   should be hashed */
+static int dx_wanted(struct fs_info *info, u32 entries, u32 blocks)
+{
+	if (!(info->feat_compat & EXT4_FEATURE_COMPAT_DIR_INDEX) || !entries)
+		return 0;
+
+	if (info->dir_index_entries)
+		return entries >= info->dir_index_entries;
+
+	return blocks > 1;
+}
+
+/* Sorts the entries of a directory by hash and packs them into leaf
+   blocks.  Returns 0, or -1 if the directory needs more than one level of
+   dx_node blocks, which would take the largedir feature. */
+static int dx_layout(struct fs_info *info, struct fs_aux_info *aux_info,
+		     jmp_buf *setjmp_env, u32 entries,
+		     struct dentry *dentries, struct dx_dir *dx)
+{
+	u32 root_limit = dx_limit(info, DX_ROOT_ENTRIES_OFFSET);
+	u32 node_limit = dx_limit(info, DX_NODE_ENTRIES_OFFSET);
+	u32 space = dir_block_space(info);
+	const char *name;
+	u32 offset = info->block_size;
+	u32 dentry_len;
+	u32 i;
+
+	memset(dx, 0, sizeof(*dx));
+	dx->names = malloc(entries * sizeof(*dx->names));
+	dx->leaves = malloc(entries * sizeof(*dx->leaves));
+	if (!dx->names || !dx->leaves)
+		critical_error_errno(setjmp_env, "malloc");
+
+	for (i = 0; i < entries; i++) {
+		name = dentries[i].filename;
+		dx->names[i].hash =
+		    ext4_dirhash_tea(name, strlen(name),
+				     aux_info->sb->s_hash_seed,
+				     &dx->names[i].minor_hash);
+		dx->names[i].index = i;
+	}
+	qsort(dx->names, entries, sizeof(*dx->names), compare_dx_names);
+
+	for (i = 0; i < entries; i++) {
+		name = dentries[dx->names[i].index].filename;
+		dentry_len = 8 + EXT4_ALIGN(strlen(name), 4);
+		if (offset + dentry_len > space) {
+			dx->leaves[dx->nr_leaves++] = i;
+			offset = 0;
+		}
+		offset += dentry_len;
+	}
+
+	if (dx->nr_leaves > root_limit) {
+		dx->nr_nodes = DIV_ROUND_UP(dx->nr_leaves, node_limit);
+		if (dx->nr_nodes > root_limit) {
+			free(dx->names);
+			free(dx->leaves);
+			memset(dx, 0, sizeof(*dx));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Returns the first leaf under a dx_node, spreading them evenly */
+static u32 dx_node_first_leaf(struct dx_dir *dx, u32 node)
+{
+	return (u64)node * dx->nr_leaves / dx->nr_nodes;
+}
+
+/* Returns the hash that leads to a leaf in the index, with the low bit set
+   if the entries with the hash before the leaf's first one continue in it */
+static u32 dx_leaf_hash(struct dx_dir *dx, u32 leaf)
+{
+	u32 first = dx->leaves[leaf];
+	u32 hash = dx->names[first].hash;
+
+	if (leaf == 0)
+		return 0;
+	if (dx->names[first - 1].hash == hash)
+		hash |= 1;
+
+	return hash;
+}
+
+/* Fills in the entries of a dx_root or dx_node block pointing to count
+   leaves, or dx_node blocks, starting from first */
+static void dx_fill_entries(struct dx_dir *dx, u8 *at, u32 limit,
+			    u32 first, u32 count, int nodes)
+{
+	struct dx_entry *entry = (struct dx_entry *)at;
+	struct dx_countlimit *countlimit = (struct dx_countlimit *)at;
+	u32 leaf;
+	u32 i;
+
+	for (i = 0; i < count; i++) {
+		if (nodes) {
+			leaf = dx_node_first_leaf(dx, first + i);
+			entry[i].block = 1 + dx->nr_leaves + first + i;
+		} else {
+			leaf = first + i;
+			entry[i].block = 1 + leaf;
+		}
+		entry[i].hash = dx_leaf_hash(dx, leaf);
+	}
+	countlimit->limit = limit;
+	countlimit->count = count;
+}
+
+/* Writes out a hashed directory laid out by dx_layout() into data.  With
+   metadata_csum, the index blocks are checksummed right away, and the
+   leaves once their entries are filled in. */
+static void make_dx_directory(struct fs_info *info,
+			      struct fs_aux_info *aux_info,
+			      jmp_buf *setjmp_env, u8 *data,
+			      struct ext4_inode *inode, u32 inode_num,
+			      u32 dir_inode_num, u32 entries,
+			      struct dentry *dentries, struct dx_dir *dx)
+{
+	u32 block_size = info->block_size;
+	u32 root_limit = dx_limit(info, DX_ROOT_ENTRIES_OFFSET);
+	u32 node_limit = dx_limit(info, DX_NODE_ENTRIES_OFFSET);
+	u32 space = dir_block_space(info);
+	int csum = ext4_has_metadata_csum(info);
+	u32 csum_seed = csum ? ext4_inode_csum_seed(aux_info, inode_num,
+						    inode->i_generation) : 0;
+	struct ext4_dir_entry_2 *dentry;
+	struct dx_root_info *root_info;
+	u8 *block;
+	u32 offset;
+	u32 first;
+	u32 end;
+	u32 i;
+	u32 j;
+
+	/* dx_root: . and .., with the index hidden in the space of .. */
+	offset = 0;
+	dentry = add_dentry(info, setjmp_env, data, &offset, NULL, inode_num,
+			    ".", EXT4_FT_DIR);
+	dentry = add_dentry(info, setjmp_env, data, &offset, dentry,
+			    dir_inode_num, "..", EXT4_FT_DIR);
+	dentry->rec_len = block_size - 12;
+
+	root_info = (struct dx_root_info *)(data + offset);
+	root_info->hash_version = DX_HASH_TEA;
+	root_info->info_length = sizeof(struct dx_root_info);
+	root_info->indirect_levels = dx->nr_nodes ? 1 : 0;
+
+	if (dx->nr_nodes) {
+		dx_fill_entries(dx, data + DX_ROOT_ENTRIES_OFFSET, root_limit,
+				0, dx->nr_nodes, 1);
+		for (i = 0; i < dx->nr_nodes; i++) {
+			block = data + (1 + dx->nr_leaves + i) * block_size;
+			dentry = (struct ext4_dir_entry_2 *)block;
+			dentry->rec_len = block_size;
+			first = dx_node_first_leaf(dx, i);
+			end = dx_node_first_leaf(dx, i + 1);
+			dx_fill_entries(dx, block + DX_NODE_ENTRIES_OFFSET,
+					node_limit, first, end - first, 0);
+			if (csum)
+				dx_csum_set(block, DX_NODE_ENTRIES_OFFSET,
+					    csum_seed);
+		}
+	} else {
+		dx_fill_entries(dx, data + DX_ROOT_ENTRIES_OFFSET, root_limit,
+				0, dx->nr_leaves, 0);
+	}
+	if (csum)
+		dx_csum_set(data, DX_ROOT_ENTRIES_OFFSET, csum_seed);
+
+	for (i = 0; i < dx->nr_leaves; i++) {
+		block = data + (1 + i) * block_size;
+		end = i + 1 < dx->nr_leaves ? dx->leaves[i + 1] : entries;
+		offset = 0;
+		dentry = NULL;
+		for (j = dx->leaves[i]; j < end; j++) {
+			struct dentry *d = &dentries[dx->names[j].index];
+
+			dentry = add_dentry(info, setjmp_env, block, &offset,
+					    dentry, 0, d->filename,
+					    d->file_type);
+			d->inode = &dentry->inode;
+		}
+		dentry->rec_len += space - offset;
+	}
+	if (csum)
+		dir_leaves_add(info, aux_info, setjmp_env, data + block_size,
+			       dx->nr_leaves, inode_num, inode);
+}
+
 /* Creates a directory structure for an array of directory entries, dentries,
    and stores the location of the structure in an inode.  The new inode's
    .. link is set to dir_inode_num.  Stores the location of the inode number
    of each directory entry into dentries[i].inode, to be filled in later
-   when the inode for the entry is allocated.  Returns the inode number of the
-   new directory */
+   when the inode for the entry is allocated.  If inline_ok is set and the
+   filesystem has inline data, small directories are kept in the inode,
+   and with dir_index, large ones are hashed.  Returns the inode number of
+   the new directory */
 u32 make_directory(struct fs_info *info, struct fs_aux_info *aux_info,
 		   struct sparse_file *ext4_sparse_file, int force,
 		   jmp_buf *setjmp_env, u32 dir_inode_num, u32 entries,
-		   struct dentry *dentries, u32 dirs)
+		   struct dentry *dentries, u32 dirs, int inline_ok)
 {
 	struct ext4_inode *inode;
 	u32 blocks;
@@ -98,17 +560,29 @@ u32 make_directory(struct fs_info *info, struct fs_aux_info *aux_info,
 	u8 *data;
 	unsigned int i;
 	struct ext4_dir_entry_2 *dentry;
+	u32 in_iblock = 0;
+	int value_len = -1;
+	struct dx_dir dx = { 0 };
+
+	/* the kernel does not mount a root directory without blocks */
+	if (inline_ok && dir_inode_num && inline_data_max(info))
+		value_len = inline_dir_layout(info, entries, dentries,
+					      &in_iblock);
 
 	blocks =
 	    DIV_ROUND_UP(dentry_size(info, entries, dentries),
 			 info->block_size);
+	if (value_len < 0 && dx_wanted(info, entries, blocks) &&
+	    dx_layout(info, aux_info, setjmp_env, entries, dentries, &dx) == 0)
+		blocks = 1 + dx.nr_leaves + dx.nr_nodes;
 	len = blocks * info->block_size;
 
 	if (dir_inode_num) {
-		inode_num = allocate_inode(info, aux_info);
+		inode_num = allocate_dir_inode(info, aux_info, dir_inode_num);
 	} else {
 		dir_inode_num = EXT4_ROOT_INO;
 		inode_num = EXT4_ROOT_INO;
+		set_alloc_goal(info, aux_info, inode_num);
 	}
 
 	if (inode_num == EXT4_ALLOCATE_FAILED) {
@@ -125,8 +599,21 @@ u32 make_directory(struct fs_info *info, struct fs_aux_info *aux_info,
 		return EXT4_ALLOCATE_FAILED;
 	}
 
+	if (value_len >= 0) {
+		inode->i_mode = S_IFDIR;
+		inode->i_links_count = dirs + 2;
+		inode->i_flags |= aux_info->default_i_flags;
+		if (make_inline_directory(info, force, setjmp_env, inode,
+					  dir_inode_num, entries, dentries,
+					  in_iblock, value_len) == 0)
+			return inode_num;
+		error(force, setjmp_env, "failed to add inline data");
+		return EXT4_ALLOCATE_FAILED;
+	}
+
 	data = inode_allocate_data_extents(info, aux_info, ext4_sparse_file,
-					   force, setjmp_env, inode, len, len);
+					   force, setjmp_env, inode, inode_num,
+					   len, len);
 	if (data == NULL) {
 		error(force, setjmp_env, "failed to allocate %u extents", len);
 		return EXT4_ALLOCATE_FAILED;
@@ -136,6 +623,16 @@ u32 make_directory(struct fs_info *info, struct fs_aux_info *aux_info,
 	inode->i_links_count = dirs + 2;
 	inode->i_flags |= aux_info->default_i_flags;
 
+	if (dx.names) {
+		make_dx_directory(info, aux_info, setjmp_env, data, inode,
+				  inode_num, dir_inode_num, entries, dentries,
+				  &dx);
+		inode->i_flags |= EXT4_INDEX_FL;
+		free(dx.names);
+		free(dx.leaves);
+		return inode_num;
+	}
+
 	dentry = NULL;
 
 	dentry = add_dentry(info, setjmp_env, data, &offset, NULL, inode_num,
@@ -168,17 +665,27 @@ u32 make_directory(struct fs_info *info, struct fs_aux_info *aux_info,
 		}
 	}
 
-	/* pad the last dentry out to the end of the block */
-	dentry->rec_len += len - offset;
+	/* pad the last dentry out to the end of the entries of the block */
+	dentry->rec_len += len - (info->block_size - dir_block_space(info)) -
+	    offset;
+	if (ext4_has_metadata_csum(info))
+		dir_leaves_add(info, aux_info, setjmp_env, data,
+			       len / info->block_size, inode_num, inode);
 
 	return inode_num;
 }
 
-/* Creates a file on disk.  Returns the inode number of the new file */
+/* Creates a file on disk.  Returns the inode number of the new file.
+   The contents are read from filename, or from data at data_offset if
+   data is not NULL.  If nr_ranges is not -1, only the nr_ranges runs of
+   blocks in ranges are allocated, and the rest of the file is left as
+   holes. */
 u32 make_file(struct fs_info *info, struct fs_aux_info *aux_info,
 	      struct sparse_file *ext4_sparse_file,
 	      struct block_allocation *saved_allocation_head, int force,
-	      jmp_buf *setjmp_env, const char *filename, u64 len)
+	      jmp_buf *setjmp_env, const char *filename,
+	      const struct data_source *data, u64 data_offset, u64 len, const struct data_range *ranges,
+	      int nr_ranges)
 {
 	struct ext4_inode *inode;
 	u32 inode_num;
@@ -198,14 +705,32 @@ u32 make_file(struct fs_info *info, struct fs_aux_info *aux_info,
 
 	if (len > 0) {
 		struct block_allocation *alloc;
-		alloc = inode_allocate_file_extents(info, aux_info,
-						    ext4_sparse_file,
-						    force, setjmp_env,
-						    inode, len, filename);
+		if (nr_ranges >= 0)
+			alloc = inode_allocate_sparse_extents(info, aux_info,
+							      ext4_sparse_file,
+							      force, setjmp_env,
+							      inode, inode_num,
+							      len, ranges,
+							      nr_ranges,
+							      filename, data,
+							      data_offset);
+		else if (data)
+			alloc = inode_allocate_fd_extents(info, aux_info,
+							  ext4_sparse_file,
+							  force, setjmp_env,
+							  inode, inode_num,
+							  len, data,
+							  data_offset);
+		else
+			alloc = inode_allocate_file_extents(info, aux_info,
+							    ext4_sparse_file,
+							    force, setjmp_env,
+							    inode, inode_num,
+							    len, filename);
 		if (alloc) {
 			alloc->filename = strdup(filename);
-			alloc->next = saved_allocation_head;
-			saved_allocation_head = alloc;
+			alloc->next = saved_allocation_head->next;
+			saved_allocation_head->next = alloc;
 		}
 	}
 
@@ -216,6 +741,105 @@ u32 make_file(struct fs_info *info, struct fs_aux_info *aux_info,
 	return inode_num;
 }
 
+/* Creates a file whose len bytes of data, no more than inline_data_max(),
+   are stored in the inode itself.  Returns the inode number of the new
+   file */
+u32 make_inline_file(struct fs_info *info, struct fs_aux_info *aux_info,
+		     struct sparse_file *ext4_sparse_file, int force,
+		     jmp_buf *setjmp_env, const u8 *data, u32 len)
+{
+	struct ext4_inode *inode;
+	u32 inode_num;
+	u32 in_iblock = min(len, (u32)EXT4_MIN_INLINE_DATA_SIZE);
+
+	inode_num = allocate_inode(info, aux_info);
+	if (inode_num == EXT4_ALLOCATE_FAILED) {
+		error(force, setjmp_env, "failed to allocate inode\n");
+		return EXT4_ALLOCATE_FAILED;
+	}
+
+	inode = get_inode(info, aux_info, ext4_sparse_file, setjmp_env,
+			  inode_num);
+	if (inode == NULL) {
+		error(force, setjmp_env, "failed to get inode %u", inode_num);
+		return EXT4_ALLOCATE_FAILED;
+	}
+
+	memcpy(inode->i_block, data, in_iblock);
+	if (!inline_data_xattr(info, force, setjmp_env, inode,
+			       data + in_iblock, len - in_iblock)) {
+		error(force, setjmp_env, "failed to add inline data");
+		return EXT4_ALLOCATE_FAILED;
+	}
+
+	inode->i_mode = S_IFREG;
+	inode->i_links_count = 1;
+	inode->i_flags |= aux_info->default_i_flags | EXT4_INLINE_DATA_FL;
+	inode->i_size_lo = len;
+
+	return inode_num;
+}
+
+/* Creates a file with the same contents as src_inode_num, pointing its
+   extent tree at the blocks of the existing file, src_alloc.  Returns the
+   inode number of the new file, or 0 if the extent tree has blocks of its
+   own, whose checksums only hold for src_inode_num with metadata_csum. */
+u32 make_shared_file(struct fs_info *info, struct fs_aux_info *aux_info,
+		     struct sparse_file *ext4_sparse_file,
+		     struct block_allocation *saved_allocation_head, int force,
+		     jmp_buf *setjmp_env, const char *filename,
+		     u32 src_inode_num,
+		     const struct block_allocation *src_alloc)
+{
+	struct block_allocation *alloc;
+	struct ext4_inode *src;
+	struct ext4_inode *inode;
+	u32 inode_num;
+
+	src = get_inode(info, aux_info, ext4_sparse_file, setjmp_env,
+			src_inode_num);
+	if (src == NULL) {
+		error(force, setjmp_env, "failed to get inode %u",
+		      src_inode_num);
+		return EXT4_ALLOCATE_FAILED;
+	}
+
+	if (ext4_has_metadata_csum(info) &&
+	    ((struct ext4_extent_header *)src->i_block)->eh_depth > 0)
+		return 0;
+
+	inode_num = allocate_inode(info, aux_info);
+	if (inode_num == EXT4_ALLOCATE_FAILED) {
+		error(force, setjmp_env, "failed to allocate inode\n");
+		return EXT4_ALLOCATE_FAILED;
+	}
+
+	inode = get_inode(info, aux_info, ext4_sparse_file, setjmp_env,
+			  inode_num);
+	if (inode == NULL) {
+		error(force, setjmp_env, "failed to get inode %u", inode_num);
+		return EXT4_ALLOCATE_FAILED;
+	}
+
+	inode->i_mode = S_IFREG;
+	inode->i_links_count = 1;
+	inode->i_flags = src->i_flags;
+	inode->i_size_lo = src->i_size_lo;
+	inode->i_size_high = src->i_size_high;
+	inode->i_blocks_lo = src->i_blocks_lo;
+	inode->osd2.linux2.l_i_blocks_high = src->osd2.linux2.l_i_blocks_high;
+	memcpy(inode->i_block, src->i_block, sizeof(inode->i_block));
+
+	if (src_alloc) {
+		alloc = copy_allocation(setjmp_env, src_alloc);
+		alloc->filename = strdup(filename);
+		alloc->next = saved_allocation_head->next;
+		saved_allocation_head->next = alloc;
+	}
+
+	return inode_num;
+}
+
 /* Creates a file on disk.  Returns the inode number of the new file */
 u32 make_link(struct fs_info *info, struct fs_aux_info *aux_info,
 	      struct sparse_file *ext4_sparse_file, int force,
@@ -262,14 +886,28 @@ u32 make_link(struct fs_info *info, struct fs_aux_info *aux_info,
 /* Creates a special file on disk.  Returns the inode number of the new file */
 u32 make_special(struct fs_info *info, struct fs_aux_info *aux_info,
 		 struct sparse_file *ext4_sparse_file, int force,
-		 jmp_buf *setjmp_env, const char *path)
+		 jmp_buf *setjmp_env, u8 file_type, dev_t rdev)
 {
 	struct ext4_inode *inode;
-	struct stat s;
 	u32 inode_num;
-
-	if (stat(path, &s)) {
-		error(force, setjmp_env, "failed to stat file\n");
+	u16 mode;
+
+	switch (file_type) {
+	case EXT4_FT_CHRDEV:
+		mode = S_IFCHR;
+		break;
+	case EXT4_FT_BLKDEV:
+		mode = S_IFBLK;
+		break;
+	case EXT4_FT_FIFO:
+		mode = S_IFIFO;
+		break;
+	case EXT4_FT_SOCK:
+		mode = S_IFSOCK;
+		break;
+	default:
+		error(force, setjmp_env, "not a special file type: %u",
+		      file_type);
 		return EXT4_ALLOCATE_FAILED;
 	}
 
@@ -286,16 +924,33 @@ u32 make_special(struct fs_info *info, struct fs_aux_info *aux_info,
 		return EXT4_ALLOCATE_FAILED;
 	}
 
-	inode->i_mode = s.st_mode & S_IFMT;
+	inode->i_mode = mode;
 	inode->i_links_count = 1;
 	inode->i_flags |= aux_info->default_i_flags;
 
-	((u8 *)inode->i_block)[0] = major(s.st_rdev);
-	((u8 *)inode->i_block)[1] = minor(s.st_rdev);
+	((u8 *)inode->i_block)[0] = major(rdev);
+	((u8 *)inode->i_block)[1] = minor(rdev);
 
 	return inode_num;
 }
 
+/* Adds a name to an existing inode.  Returns 0 on success, or -1 if the
+   inode cannot take another link and the caller should create a new one */
+int inode_add_link(struct fs_info *info, struct fs_aux_info *aux_info,
+		   struct sparse_file *ext4_sparse_file, jmp_buf *setjmp_env,
+		   u32 inode_num)
+{
+	struct ext4_inode *inode = get_inode(info, aux_info, ext4_sparse_file,
+					     setjmp_env, inode_num);
+
+	if (!inode || inode->i_links_count >= EXT4_LINK_MAX)
+		return -1;
+
+	inode->i_links_count++;
+
+	return 0;
+}
+
 int inode_set_permissions(struct fs_info *info, struct fs_aux_info *aux_info,
 			  struct sparse_file *ext4_sparse_file,
 			  jmp_buf *setjmp_env, u32 inode_num, u16 mode, u16 uid,
@@ -463,7 +1118,9 @@ static struct ext4_xattr_entry *xattr_addto_range(int force,
 	    (char *)new_entry + available_size - EXT4_XATTR_SIZE(value_len);
 	size_t e_value_offs = val - (char *)block_start;
 
-	new_entry->e_value_offs = cpu_to_le16(e_value_offs);
+	/* an empty value has no offset, or the kernel would not move it
+	   along with the entries when it grows i_extra_isize */
+	new_entry->e_value_offs = cpu_to_le16(value_len ? e_value_offs : 0);
 	memset(val, 0, EXT4_XATTR_SIZE(value_len));
 	memcpy(val, value, value_len);
 
@@ -481,6 +1138,10 @@ static int xattr_addto_inode(struct fs_info *info, int force,
 	struct ext4_xattr_entry *first = (struct ext4_xattr_entry *)(hdr + 1);
 	char *block_end = ((char *)inode) + info->inode_size;
 
+	/* small inodes have no room past the extra fields */
+	if ((char *)first >= block_end)
+		return -1;
+
 	struct ext4_xattr_entry *result;
 	result = xattr_addto_range(force, setjmp_env, first, block_end, first,
 				   name_index, name, value, value_len);
@@ -495,6 +1156,58 @@ static int xattr_addto_inode(struct fs_info *info, int force,
 	return 0;
 }
 
+/* Adds the system.data attribute of an inode with inline data, holding
+   what does not fit in i_block.  A NULL value adds value_len zero bytes.
+   Returns where the value is in the inode, or NULL if it does not fit. */
+static u8 *inline_data_xattr(struct fs_info *info, int force,
+			     jmp_buf *setjmp_env, struct ext4_inode *inode,
+			     const void *value, size_t value_len)
+{
+	struct ext4_xattr_ibody_header *hdr =
+	    (struct ext4_xattr_ibody_header *)(inode + 1);
+	struct ext4_xattr_entry *first = (struct ext4_xattr_entry *)(hdr + 1);
+	struct ext4_xattr_entry *entry;
+	u8 *zeros = NULL;
+
+	if (!value) {
+		zeros = calloc(1, value_len + 1);
+		if (!zeros)
+			critical_error_errno(setjmp_env, "calloc");
+		value = zeros;
+	}
+
+	if (xattr_addto_inode(info, force, setjmp_env, inode,
+			      EXT4_XATTR_INDEX_SYSTEM, EXT4_INLINE_DATA_NAME,
+			      value, value_len)) {
+		free(zeros);
+		return NULL;
+	}
+	free(zeros);
+
+	for (entry = first; !IS_LAST_ENTRY(entry);
+	     entry = EXT4_XATTR_NEXT(entry))
+		if (entry->e_name_index == EXT4_XATTR_INDEX_SYSTEM)
+			break;
+
+	return (u8 *)first + le16_to_cpu(entry->e_value_offs);
+}
+
+/* Sets the checksum of the attribute block of an inode, which is seeded
+   with its block number rather than with the inode */
+static void xattr_block_csum_set(struct fs_info *info,
+				 struct fs_aux_info *aux_info,
+				 struct ext4_inode *inode,
+				 struct ext4_xattr_header *header)
+{
+	u64 block_nr = le32_to_cpu(inode->i_file_acl_lo) |
+	    (u64)le16_to_cpu(inode->osd2.linux2.l_i_file_acl_high) << 32;
+	u32 crc;
+
+	header->h_checksum = 0;
+	crc = ext4_crc32c(aux_info->csum_seed, &block_nr, sizeof(block_nr));
+	header->h_checksum = ext4_crc32c(crc, header, info->block_size);
+}
+
 static int xattr_addto_block(struct fs_info *info, struct fs_aux_info *aux_info,
 			     struct sparse_file *ext4_sparse_file, int force,
 			     jmp_buf *setjmp_env, struct ext4_inode *inode,
@@ -524,6 +1237,8 @@ static int xattr_addto_block(struct fs_info *info, struct fs_aux_info *aux_info,
 		return -1;
 
 	ext4_xattr_hash_entry(header, result);
+	if (ext4_has_metadata_csum(info))
+		xattr_block_csum_set(info, aux_info, inode, header);
 	return 0;
 }
 
@@ -17,35 +17,70 @@
 #ifndef _DIRECTORY_H_
 #define _DIRECTORY_H_
 
+struct scan_error;
+struct hardlink;
+struct dedup;
+struct data_range;
+struct data_source;
+
 struct dentry {
-	char *path;
-	char *full_path;
+	char *path;		/* relative to the source directory, for directories */
 	const char *filename;
 	char *link;
 	unsigned long size;
+	dev_t rdev;
+	u64 data_offset;	/* of a regular file read from an archive */
+	struct hardlink *hardlink;	/* if the file has more than one name */
+	struct dedup *dedup;	/* if blocks are shared between equal files */
+	struct data_range *ranges;
+	u32 nr_ranges;
 	u8 file_type;
+	u8 holes;		/* a regular file with only ranges allocated */
 	u16 mode;
 	u16 uid;
 	u16 gid;
 	u32 *inode;
+	u32 layout_inode;	/* made ahead of the tree for a layout order */
 	u32 mtime;
 	uint64_t capabilities;
+	/* contents of an EXT4_FT_DIR entry, filled in by the scanner */
+	struct dentry *dentries;
+	u32 entries;
+	u32 dirs;
+	int scan_errno;
+	struct scan_error *scan_errors;
 };
 
 u32 make_directory(struct fs_info *info, struct fs_aux_info *aux_info,
 		   struct sparse_file *ext4_sparse_file, int force,
 		   jmp_buf *setjmp_env, u32 dir_inode_num, u32 entries,
-		   struct dentry *dentries, u32 dirs);
+		   struct dentry *dentries, u32 dirs, int inline_ok);
 u32 make_file(struct fs_info *info, struct fs_aux_info *aux_info,
 	      struct sparse_file *ext4_sparse_file,
 	      struct block_allocation *saved_allocation_head, int force,
-	      jmp_buf *setjmp_env, const char *filename, u64 len);
+	      jmp_buf *setjmp_env, const char *filename,
+	      const struct data_source *data, u64 data_offset, u64 len, const struct data_range *ranges,
+	      int nr_ranges);
+u32 inline_data_max(struct fs_info *info);
+u32 make_inline_file(struct fs_info *info, struct fs_aux_info *aux_info,
+		     struct sparse_file *ext4_sparse_file, int force,
+		     jmp_buf *setjmp_env, const u8 *data, u32 len);
+u32 make_shared_file(struct fs_info *info, struct fs_aux_info *aux_info,
+		     struct sparse_file *ext4_sparse_file,
+		     struct block_allocation *saved_allocation_head, int force,
+		     jmp_buf *setjmp_env, const char *filename,
+		     u32 src_inode_num,
+		     const struct block_allocation *src_alloc);
+void set_directory_csums(struct fs_info *info, struct fs_aux_info *aux_info);
 u32 make_link(struct fs_info *info, struct fs_aux_info *aux_info,
 	      struct sparse_file *ext4_sparse_file, int force,
 	      jmp_buf *setjmp_env, const char *link);
 u32 make_special(struct fs_info *info, struct fs_aux_info *aux_info,
 		 struct sparse_file *ext4_sparse_file, int force,
-		 jmp_buf *setjmp_env, const char *path);
+		 jmp_buf *setjmp_env, u8 file_type, dev_t rdev);
+int inode_add_link(struct fs_info *info, struct fs_aux_info *aux_info,
+		   struct sparse_file *ext4_sparse_file, jmp_buf *setjmp_env,
+		   u32 inode_num);
 int inode_set_permissions(struct fs_info *info, struct fs_aux_info *aux_info,
 			  struct sparse_file *ext4_sparse_file,
 			  jmp_buf *setjmp_env, u32 inode_num, u16 mode, u16 uid,
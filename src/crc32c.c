@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* CRC32c (Castagnoli), which checksums the metadata of ext4 with
+   metadata_csum.  As in the kernel's ext4_chksum(), the crc is neither
+   inverted on the way in nor on the way out, so that checksums over
+   several pieces can be chained.  The CRC instructions of SSE4.2 and
+   ARMv8 are used when the CPU has them, and a slice-by-8 table, which
+   takes eight bytes per step, otherwise. */
+
+#include "ext4_utils.h"
+
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define CRC32C_ARMV8
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+
+static u32 crc32c_table[8][256];
+static u32 (*crc32c_impl)(u32 crc, const u8 *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Reads 4 bytes in little endian order, which is one load on most CPUs */
+static inline u32 load_le32(const u8 *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+}
+
+static u32 crc32c_slice8(u32 crc, const u8 *p, size_t len)
+{
+	u32 lo;
+	u32 hi;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		lo = load_le32(p) ^ crc;
+		hi = load_le32(p + 4);
+		crc = crc32c_table[7][lo & 0xFF] ^
+		    crc32c_table[6][(lo >> 8) & 0xFF] ^
+		    crc32c_table[5][(lo >> 16) & 0xFF] ^
+		    crc32c_table[4][lo >> 24] ^
+		    crc32c_table[3][hi & 0xFF] ^
+		    crc32c_table[2][(hi >> 8) & 0xFF] ^
+		    crc32c_table[1][(hi >> 16) & 0xFF] ^
+		    crc32c_table[0][hi >> 24];
+	}
+
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static u32 crc32c_sse42(u32 crc, const u8 *p, size_t len)
+{
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+#ifdef __x86_64__
+	{
+		u64 crc64 = crc;
+		u64 word;
+
+		for (; len >= 8; len -= 8, p += 8) {
+			memcpy(&word, p, sizeof(word));
+			crc64 = _mm_crc32_u64(crc64, word);
+		}
+		crc = crc64;
+	}
+#endif
+	for (; len >= 4; len -= 4, p += 4)
+		crc = _mm_crc32_u32(crc, load_le32(p));
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#endif
+
+#ifdef CRC32C_ARMV8
+__attribute__((target("+crc")))
+static u32 crc32c_armv8(u32 crc, const u8 *p, size_t len)
+{
+	uint64_t word;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = __crc32cb(crc, *p++);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&word, p, sizeof(word));
+		crc = __crc32cd(crc, word);
+	}
+
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#endif
+
+/* Picks the fastest implementation the CPU runs, once for all threads */
+static void crc32c_init(void)
+{
+	u32 crc;
+	int i;
+	int j;
+
+#ifdef CRC32C_SSE42
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_impl = crc32c_sse42;
+		return;
+	}
+#endif
+#ifdef CRC32C_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc32c_impl = crc32c_armv8;
+		return;
+	}
+#endif
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = crc;
+	}
+	/* table k advances the crc of a byte over k more zero bytes */
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+			    crc32c_table[0][crc32c_table[j - 1][i] & 0xFF];
+	crc32c_impl = crc32c_slice8;
+}
+
+u32 ext4_crc32c(u32 crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	return crc32c_impl(crc, buf, len);
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ext4_utils.h"
+#include "dedup.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* size of each of the two buffers dedup_same_data() compares */
+#define DEDUP_CMP_BUF_SIZE (64 * 1024)
+
+struct dedup_key {
+	u64 size;
+	const u8 *digest;
+};
+
+static size_t dedup_hash(u64 size, const u8 *digest)
+{
+	size_t h;
+
+	/* the digest is already well mixed */
+	memcpy(&h, digest, sizeof(h));
+	return h ^ size;
+}
+
+static int dedup_match(const struct hash_entry *entry, const void *key)
+{
+	const struct dedup *dup = (const struct dedup *)entry;
+	const struct dedup_key *k = key;
+
+	return dup->size == k->size &&
+	    !memcmp(dup->digest, k->digest, SHA1_DIGEST_LENGTH);
+}
+
+static void dedup_init(struct hash_entry *entry, const void *key)
+{
+	struct dedup *dup = (struct dedup *)entry;
+	const struct dedup_key *k = key;
+
+	dup->size = k->size;
+	memcpy(dup->digest, k->digest, SHA1_DIGEST_LENGTH);
+}
+
+static void dedup_release(struct hash_entry *entry)
+{
+	free(((struct dedup *)entry)->path);
+}
+
+void dedup_table_init(struct dedup_table *table)
+{
+	hash_table_init(&table->table, sizeof(struct dedup));
+}
+
+void dedup_table_free(struct dedup_table *table)
+{
+	hash_table_free(&table->table, dedup_release);
+}
+
+/* Returns the entry for contents of size bytes with the given digest,
+   adding it if it is new, or NULL with errno set if memory ran out. */
+struct dedup *dedup_get(struct dedup_table *table, u64 size,
+			const u8 digest[SHA1_DIGEST_LENGTH])
+{
+	struct dedup_key key = { size, digest };
+
+	return (struct dedup *)hash_table_get(&table->table,
+					      dedup_hash(size, digest), &key,
+					      dedup_match, dedup_init);
+}
+
+/* Hashes the size bytes at offset in src, using buf to read them.  Returns
+   0, or -1 with errno set if they could not all be read. */
+int dedup_hash_data(const struct data_source *src, u64 offset, u64 size, u8 *buf, size_t buf_len,
+		  u8 digest[SHA1_DIGEST_LENGTH])
+{
+	SHA1_CTX ctx;
+	ssize_t ret;
+
+	SHA1Init(&ctx);
+	while (size > 0) {
+		ret = data_source_pread(src, buf, min(buf_len, size),
+					offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0) {
+			errno = EIO;	/* the file shrank since it was stat'ed */
+			return -1;
+		}
+		SHA1Update(&ctx, buf, ret);
+		offset += ret;
+		size -= ret;
+	}
+	SHA1Final(digest, &ctx);
+
+	return 0;
+}
+
+/* Reads up to len bytes at offset in src, retrying after a signal.
+   Returns the number read, 0 at the end of the file, or -1 on an error. */
+static ssize_t dedup_pread(const struct data_source *src, u8 *buf, size_t len,
+			   u64 offset)
+{
+	ssize_t ret;
+
+	do {
+		ret = data_source_pread(src, buf, len, offset);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+/* Compares the size bytes at offset in src with those at other_offset in
+   other.  Files with the same size and SHA-1 are not necessarily the
+   same: SHA-1 collisions can be made, so the bytes are compared before one
+   file is given the blocks of the other.  Returns 1 if they are the same,
+   or 0 if they differ or could not be read. */
+int dedup_same_data(const struct data_source *src, u64 offset,
+		    const struct data_source *other, u64 other_offset, u64 size)
+{
+	u8 *buf;
+	u8 *other_buf;
+	ssize_t ret;
+	ssize_t other_ret;
+	int same = 0;
+
+	if (src->fd == other->fd && src->gz == other->gz &&
+	    offset == other_offset)
+		return 1;
+
+	buf = malloc(2 * DEDUP_CMP_BUF_SIZE);
+	if (!buf)
+		return 0;
+	other_buf = buf + DEDUP_CMP_BUF_SIZE;
+
+	while (size > 0) {
+		ret = dedup_pread(src, buf, min(DEDUP_CMP_BUF_SIZE, size),
+				  offset);
+		if (ret <= 0)
+			goto out;
+		other_ret = dedup_pread(other, other_buf, ret,
+					other_offset);
+		if (other_ret != ret || memcmp(buf, other_buf, ret))
+			goto out;
+		offset += ret;
+		other_offset += ret;
+		size -= ret;
+	}
+	same = 1;
+
+out:
+	free(buf);
+	return same;
+}
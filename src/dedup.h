@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "allocate.h"
+#include "ext4_utils.h"
+#include "gzindex.h"
+#include "hashtable.h"
+#include "sha1.h"
+
+/* Contents shared by several regular files, when block sharing is enabled.
+   Every dentry whose data hashes the same points to the same struct dedup;
+   the first one created in the image records its inode, the blocks that
+   go to the block list and where its data came from, and the others get
+   new inodes that use its blocks once their bytes are found to match. */
+struct dedup {
+	struct hash_entry entry;
+	u64 size;
+	u8 digest[SHA1_DIGEST_LENGTH];
+	u32 inode;
+	struct block_allocation *alloc;
+	char *path;		/* of the first file, from a source directory */
+	u64 data_offset;	/* of the first file, from an archive */
+};
+
+/* File contents by size and SHA-1, safe to use from the scanner threads */
+struct dedup_table {
+	struct hash_table table;
+};
+
+void dedup_table_init(struct dedup_table *table);
+void dedup_table_free(struct dedup_table *table);
+struct dedup *dedup_get(struct dedup_table *table, u64 size,
+			const u8 digest[SHA1_DIGEST_LENGTH]);
+int dedup_hash_data(const struct data_source *src, u64 offset, u64 size,
+		    u8 *buf, size_t buf_len, u8 digest[SHA1_DIGEST_LENGTH]);
+int dedup_same_data(const struct data_source *src, u64 offset,
+		    const struct data_source *other, u64 other_offset, u64 size);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ext4_utils.h"
+#include "dirhash.h"
+
+#include <string.h>
+
+#define TEA_DELTA 0x9E3779B9
+
+/* The hash of hashed directories, as in fs/ext4/hash.c */
+static void tea_transform(u32 buf[4], const u32 in[4])
+{
+	u32 sum = 0;
+	u32 b0 = buf[0];
+	u32 b1 = buf[1];
+	u32 a = in[0];
+	u32 b = in[1];
+	u32 c = in[2];
+	u32 d = in[3];
+	int n = 16;
+
+	do {
+		sum += TEA_DELTA;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	} while (--n);
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+/* Packs up to num * 4 bytes of a name into buf, with the characters taken
+   as unsigned, as the superblock flags say */
+static void str2hashbuf(const char *msg, int len, u32 *buf, int num)
+{
+	const unsigned char *ucp = (const unsigned char *)msg;
+	u32 pad;
+	u32 val;
+	int i;
+
+	pad = (u32)len | ((u32)len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (i = 0; i < len; i++) {
+		val = ucp[i] + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+/* Returns the DX_HASH_TEA_UNSIGNED hash of a name, and its minor hash in
+   *minor_hash.  An all zero seed means the default one. */
+u32 ext4_dirhash_tea(const char *name, int len, const u32 seed[4],
+		     u32 *minor_hash)
+{
+	u32 buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	u32 in[4];
+	u32 hash;
+
+	if (seed[0] || seed[1] || seed[2] || seed[3])
+		memcpy(buf, seed, sizeof(buf));
+
+	while (len > 0) {
+		str2hashbuf(name, len, in, 4);
+		tea_transform(buf, in);
+		len -= 16;
+		name += 16;
+	}
+
+	/* the low bit marks hash collisions that continue in the next
+	   block, and the largest value is the end of the directory */
+	hash = buf[0] & ~1;
+	if (hash == (0x7fffffffU << 1))
+		hash = (0x7fffffffU - 1) << 1;
+	*minor_hash = buf[1];
+
+	return hash;
+}
@@ -108,7 +108,9 @@ struct ext4_group_desc {
 	__le16 bg_free_inodes_count_lo;
 	__le16 bg_used_dirs_count_lo;
 	__le16 bg_flags;
-	__u32 bg_reserved[2];
+	__le32 bg_exclude_bitmap_lo;
+	__le16 bg_block_bitmap_csum_lo;
+	__le16 bg_inode_bitmap_csum_lo;
 	__le16 bg_itable_unused_lo;
 	__le16 bg_checksum;
 	__le32 bg_block_bitmap_hi;
@@ -118,7 +120,10 @@ struct ext4_group_desc {
 	__le16 bg_free_inodes_count_hi;
 	__le16 bg_used_dirs_count_hi;
 	__le16 bg_itable_unused_hi;
-	__u32 bg_reserved2[3];
+	__le32 bg_exclude_bitmap_hi;
+	__le16 bg_block_bitmap_csum_hi;
+	__le16 bg_inode_bitmap_csum_hi;
+	__u32 bg_reserved;
 };
 
 #define EXT4_BG_INODE_UNINIT 0x0001
@@ -139,6 +144,9 @@ struct ext4_group_desc {
 #define EXT4_TIND_BLOCK (EXT4_DIND_BLOCK + 1)
 #define EXT4_N_BLOCKS (EXT4_TIND_BLOCK + 1)
 
+#define EXT4_MIN_INLINE_DATA_SIZE (4 * EXT4_N_BLOCKS)
+#define EXT4_INLINE_DOTDOT_SIZE 4
+
 #define EXT4_SECRM_FL 0x00000001
 #define EXT4_UNRM_FL 0x00000002
 #define EXT4_COMPR_FL 0x00000004
@@ -163,6 +171,7 @@ struct ext4_group_desc {
 #define EXT4_EXTENTS_FL 0x00080000
 #define EXT4_EA_INODE_FL 0x00200000
 #define EXT4_EOFBLOCKS_FL 0x00400000
+#define EXT4_INLINE_DATA_FL 0x10000000
 #define EXT4_RESERVED_FL 0x80000000
 
 #define EXT4_FL_USER_VISIBLE 0x004BDFFF
@@ -263,7 +272,8 @@ struct ext4_inode {
 			__le16 l_i_file_acl_high;
 			__le16 l_i_uid_high;
 			__le16 l_i_gid_high;
-			__u32 l_i_reserved2;
+			__le16 l_i_checksum_lo;
+			__le16 l_i_reserved;
 		} linux2;
 		struct {
 			__le16 h_i_reserved1;
@@ -279,7 +289,7 @@ struct ext4_inode {
 		} masix2;
 	} osd2;
 	__le16 i_extra_isize;
-	__le16 i_pad1;
+	__le16 i_checksum_hi;
 	__le32 i_ctime_extra;
 	__le32 i_mtime_extra;
 	__le32 i_atime_extra;
@@ -315,7 +325,7 @@ struct move_extent {
 #define i_gid_low i_gid
 #define i_uid_high osd2.linux2.l_i_uid_high
 #define i_gid_high osd2.linux2.l_i_gid_high
-#define i_reserved2 osd2.linux2.l_i_reserved2
+#define i_checksum_lo osd2.linux2.l_i_checksum_lo
 
 #define EXT4_VALID_FS 0x0001
 #define EXT4_ERROR_FS 0x0002
@@ -443,10 +453,11 @@ struct ext4_super_block {
 	__le64 s_mmp_block;
 	__le32 s_raid_stripe_width;
 	__u8 s_log_groups_per_flex;
-	__u8 s_reserved_char_pad2;
+	__u8 s_checksum_type;
 	__le16 s_reserved_pad;
 	__le64 s_kbytes_written;
-	__u32 s_reserved[160];
+	__u32 s_reserved[159];
+	__le32 s_checksum;
 };
 
 #define EXT4_SB(sb) (sb)
@@ -491,6 +502,8 @@ struct ext4_super_block {
 #define EXT4_FEATURE_RO_COMPAT_GDT_CSUM 0x0010
 #define EXT4_FEATURE_RO_COMPAT_DIR_NLINK 0x0020
 #define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE 0x0040
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
+#define EXT4_FEATURE_RO_COMPAT_SHARED_BLOCKS 0x4000
 
 #define EXT4_FEATURE_INCOMPAT_COMPRESSION 0x0001
 #define EXT4_FEATURE_INCOMPAT_FILETYPE 0x0002
@@ -503,11 +516,14 @@ struct ext4_super_block {
 #define EXT4_FEATURE_INCOMPAT_FLEX_BG 0x0200
 #define EXT4_FEATURE_INCOMPAT_EA_INODE 0x0400
 #define EXT4_FEATURE_INCOMPAT_DIRDATA 0x1000
+#define EXT4_FEATURE_INCOMPAT_INLINE_DATA 0x8000
 
 #define EXT4_FEATURE_COMPAT_SUPP EXT2_FEATURE_COMPAT_EXT_ATTR
 #define EXT4_FEATURE_INCOMPAT_SUPP (EXT4_FEATURE_INCOMPAT_FILETYPE|   EXT4_FEATURE_INCOMPAT_RECOVER|   EXT4_FEATURE_INCOMPAT_META_BG|   EXT4_FEATURE_INCOMPAT_EXTENTS|   EXT4_FEATURE_INCOMPAT_64BIT|   EXT4_FEATURE_INCOMPAT_FLEX_BG)
 #define EXT4_FEATURE_RO_COMPAT_SUPP (EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER|   EXT4_FEATURE_RO_COMPAT_LARGE_FILE|   EXT4_FEATURE_RO_COMPAT_GDT_CSUM|   EXT4_FEATURE_RO_COMPAT_DIR_NLINK |   EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE |   EXT4_FEATURE_RO_COMPAT_BTREE_DIR |  EXT4_FEATURE_RO_COMPAT_HUGE_FILE)
 
+#define EXT4_CRC32C_CHKSUM 1
+
 #define EXT4_DEF_RESUID 0
 #define EXT4_DEF_RESGID 0
 
@@ -556,6 +572,16 @@ struct ext4_dir_entry_2 {
 
 #define EXT4_FT_MAX 8
 
+#define EXT4_FT_DIR_CSUM 0xDE
+
+struct ext4_dir_entry_tail {
+	__le32 det_reserved_zero1;
+	__le16 det_rec_len;
+	__u8 det_reserved_zero2;
+	__u8 det_reserved_ft;
+	__le32 det_checksum;
+};
+
 #define EXT4_DIR_PAD 4
 #define EXT4_DIR_ROUND (EXT4_DIR_PAD - 1)
 #define EXT4_DIR_REC_LEN(name_len) (((name_len) + 8 + EXT4_DIR_ROUND) &   ~EXT4_DIR_ROUND)
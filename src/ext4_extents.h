@@ -53,6 +53,10 @@ struct ext4_extent_header {
 
 #define EXT4_EXT_MAGIC 0xf30a
 
+struct ext4_extent_tail {
+	__le32 et_checksum;
+};
+
 struct ext4_ext_path {
 	ext4_fsblk_t p_block;
 	__u16 p_depth;
@@ -38,6 +38,8 @@ int ext4_parse_sb(struct ext4_super_block *sb, struct fs_info *info)
 	info->feat_compat = sb->s_feature_compat;
 	info->feat_incompat = sb->s_feature_incompat;
 	info->bg_desc_reserve_blocks = sb->s_reserved_gdt_blocks;
+	if (sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_FLEX_BG)
+		info->flex_bg_size = 1 << sb->s_log_groups_per_flex;
 	info->label = sb->s_volume_name;
 	memcpy(info->uuid, sb->s_uuid, 16);
 
@@ -34,14 +34,22 @@ struct fs_info {
 	uint32_t inodes_per_group;
 	uint32_t inode_size;
 	uint32_t inodes;
+	uint32_t inodes_headroom;	/* with inodes_auto, percent more inodes
+					 * than the source tree needs */
 	uint32_t journal_blocks;
 	uint16_t feat_ro_compat;
 	uint16_t feat_compat;
 	uint16_t feat_incompat;
 	uint32_t bg_desc_reserve_blocks;
 	uint32_t reserve_pcnt;
+	uint32_t dir_index_entries;	/* hash directories with at least this
+					 * many entries, or if 0, those that
+					 * take more than one block */
+	uint32_t flex_bg_size;	/* block groups per flex group with flex_bg,
+				 * or if 0, the default */
 	const char *label;
 	uint8_t no_journal;
+	uint8_t inodes_auto;	/* size the inodes from the source tree */
 	uint8_t uuid[16];
 };
 
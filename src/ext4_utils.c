@@ -18,11 +18,14 @@
 #include "allocate.h"
 #include "indirect.h"
 #include "extent.h"
+#include "holes.h"
+#include "uuid5.h"
 
 #include "sparse/sparse.h"
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <sys/stat.h>
@@ -51,7 +54,7 @@ static int is_power_of(int a, int b)
 	return (a == b) ? 1 : 0;
 }
 
-int bitmap_get_bit(u8 *bitmap, u32 bit)
+int bitmap_get_bit(const u8 *bitmap, u32 bit)
 {
 	if (bitmap[bit / 8] & (1 << (bit % 8)))
 		return 1;
@@ -66,6 +69,92 @@ void bitmap_clear_bit(u8 *bitmap, u32 bit)
 	return;
 }
 
+/* Sets the len bits from bit start on.  The whole bytes in between are
+   left to memset, which fills them a vector at a time. */
+void bitmap_set_bits(u8 *bitmap, u32 start, u32 len)
+{
+	for (; len && start % 8; start++, len--)
+		bitmap[start / 8] |= 1 << (start % 8);
+
+	memset(bitmap + start / 8, 0xFF, len / 8);
+	start += len & ~7;
+
+	for (len %= 8; len; start++, len--)
+		bitmap[start / 8] |= 1 << (start % 8);
+}
+
+/* Clears the len bits from bit start on */
+void bitmap_clear_bits(u8 *bitmap, u32 start, u32 len)
+{
+	for (; len && start % 8; start++, len--)
+		bitmap_clear_bit(bitmap, start);
+
+	memset(bitmap + start / 8, 0, len / 8);
+	start += len & ~7;
+
+	for (len %= 8; len; start++, len--)
+		bitmap_clear_bit(bitmap, start);
+}
+
+/* Returns 1 if any of the len bits from bit start on is set */
+int bitmap_test_bits(const u8 *bitmap, u32 start, u32 len)
+{
+	for (; len && start % 8; start++, len--)
+		if (bitmap_get_bit(bitmap, start))
+			return 1;
+
+	if (!block_is_zero(bitmap + start / 8, len / 8))
+		return 1;
+	start += len & ~7;
+
+	for (len %= 8; len; start++, len--)
+		if (bitmap_get_bit(bitmap, start))
+			return 1;
+
+	return 0;
+}
+
+static unsigned int popcount64(u64 word)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(word);
+#else
+	word -= (word >> 1) & 0x5555555555555555ULL;
+	word = (word & 0x3333333333333333ULL) +
+	    ((word >> 2) & 0x3333333333333333ULL);
+	word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (word * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+/* Returns the number of set bits among the len bits from bit start on,
+   counting whole words at a time */
+u32 bitmap_count_bits(const u8 *bitmap, u32 start, u32 len)
+{
+	const u8 *bytes;
+	u32 count = 0;
+	u32 i;
+
+	for (; len && start % 8; start++, len--)
+		count += bitmap_get_bit(bitmap, start);
+
+	bytes = bitmap + start / 8;
+	for (i = 0; i + sizeof(u64) <= len / 8; i += sizeof(u64)) {
+		u64 word;
+
+		memcpy(&word, bytes + i, sizeof(word));
+		count += popcount64(word);
+	}
+	for (; i < len / 8; i++)
+		count += popcount64(bytes[i]);
+	start += len & ~7;
+
+	for (len %= 8; len; start++, len--)
+		count += bitmap_get_bit(bitmap, start);
+
+	return count;
+}
+
 /* Returns 1 if the bg contains a backup superblock.  On filesystems with
    the sparse_super feature, only block groups 0, 1, and powers of 3, 5,
    and 7 have backup superblocks.  Otherwise, all block groups have backup
@@ -85,6 +174,38 @@ int ext4_bg_has_super_block(struct fs_info *info, int bg)
 	return 0;
 }
 
+/* Returns the number of blocks taken by the superblock backup and group
+   descriptors at the start of a block group, if it has them */
+u32 ext4_bg_super_blocks(struct fs_info *info, struct fs_aux_info *aux_info,
+			 u32 bg)
+{
+	if (!ext4_bg_has_super_block(info, bg))
+		return 0;
+
+	return 1 + aux_info->bg_desc_blocks + info->bg_desc_reserve_blocks;
+}
+
+/* Finds the bitmaps and inode table of a block group.  Without flex_bg they
+   follow the superblock backup of their own group; with it, those of all
+   the groups of a flex group are packed into its first group, the block
+   bitmaps first, then the inode bitmaps, then the inode tables, so that
+   the other groups are free from their first block on. */
+void ext4_bg_metadata(struct fs_info *info, struct fs_aux_info *aux_info,
+		      u32 bg, u64 *block_bitmap, u64 *inode_bitmap,
+		      u64 *inode_table)
+{
+	u32 first = bg - bg % aux_info->groups_per_flex;
+	u32 n = min(aux_info->groups_per_flex, aux_info->groups - first);
+	u32 i = bg - first;
+	u64 block = aux_info->first_data_block +
+	    (u64)first * info->blocks_per_group +
+	    ext4_bg_super_blocks(info, aux_info, first);
+
+	*block_bitmap = block + i;
+	*inode_bitmap = block + n + i;
+	*inode_table = block + 2 * n + (u64)i * aux_info->inode_table_blocks;
+}
+
 /* Function to read the primary superblock */
 void read_sb(jmp_buf *setjmp_env, int fd, struct ext4_super_block *sb)
 {
@@ -121,10 +242,19 @@ void write_sb(jmp_buf *setjmp_env, int fd, unsigned long long offset,
 }
 
 /* Write the filesystem image to a file */
-void write_ext4_image(struct sparse_file *ext4_sparse_file, int fd, int gz,
+void write_ext4_image(jmp_buf *setjmp_env,
+		      struct sparse_file *ext4_sparse_file, int fd, int gz,
 		      int sparse, int crc)
 {
-	sparse_file_write(ext4_sparse_file, fd, gz, sparse, crc);
+	int ret = sparse_file_write(ext4_sparse_file, fd, gz, sparse, crc);
+
+	/* -1 is a failure that libsparse has already reported */
+	if (ret < -1) {
+		errno = -ret;
+		critical_error_errno(setjmp_env, "failed to write the image");
+	} else if (ret < 0) {
+		critical_error(setjmp_env, "failed to write the image");
+	}
 }
 
 /* Compute the rest of the parameters of the filesystem from the basic info */
@@ -145,17 +275,32 @@ void ext4_init_fs_aux_info(struct fs_info *info, struct fs_aux_info *aux_info,
 	aux_info->blocks_per_tind =
 	    aux_info->blocks_per_dind * aux_info->blocks_per_dind;
 
+	aux_info->desc_size = sizeof(struct ext2_group_desc);
+	if (info->feat_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+		aux_info->desc_size = EXT4_MIN_DESC_SIZE_64BIT;
 	aux_info->bg_desc_blocks =
-	    DIV_ROUND_UP(aux_info->groups * sizeof(struct ext2_group_desc),
+	    DIV_ROUND_UP((u64)aux_info->groups * aux_info->desc_size,
 			 info->block_size);
 
 	aux_info->default_i_flags = EXT4_NOATIME_FL;
 
+	/* the metadata of a flex group has to fit in its first group */
+	aux_info->groups_per_flex = 1;
+	if (info->feat_incompat & EXT4_FEATURE_INCOMPAT_FLEX_BG) {
+		aux_info->groups_per_flex = info->flex_bg_size;
+		while (aux_info->groups_per_flex > 1 &&
+		       ext4_bg_super_blocks(info, aux_info, 0) +
+		       aux_info->groups_per_flex *
+		       (2 + aux_info->inode_table_blocks) >
+		       info->blocks_per_group)
+			aux_info->groups_per_flex /= 2;
+	}
+
 	u32 last_group_size = aux_info->len_blocks % info->blocks_per_group;
-	u32 last_header_size = 2 + aux_info->inode_table_blocks;
-	if (ext4_bg_has_super_block(info, aux_info->groups - 1))
-		last_header_size += 1 + aux_info->bg_desc_blocks +
-		    info->bg_desc_reserve_blocks;
+	u32 last_header_size =
+	    ext4_bg_super_blocks(info, aux_info, aux_info->groups - 1);
+	if ((aux_info->groups - 1) % aux_info->groups_per_flex == 0)
+		last_header_size += 2 + aux_info->inode_table_blocks;
 	if (last_group_size > 0 && last_group_size < last_header_size) {
 		aux_info->groups--;
 		aux_info->len_blocks -= last_group_size;
@@ -195,6 +340,14 @@ void ext4_free_fs_aux_info(struct fs_aux_info *aux_info)
 	free(aux_info->bg_desc);
 }
 
+/* Sets the checksum of a superblock, which covers all of it but itself */
+static void ext4_sb_csum_set(struct ext4_super_block *sb)
+{
+	sb->s_checksum = ext4_crc32c(~0, sb,
+				     offsetof(struct ext4_super_block,
+					      s_checksum));
+}
+
 /* Fill in the superblock memory buffer based on the filesystem parameters */
 void ext4_fill_in_sb(struct fs_info *info, struct fs_aux_info *aux_info,
 		     struct sparse_file *ext4_sparse_file, jmp_buf *setjmp_env)
@@ -206,6 +359,8 @@ void ext4_fill_in_sb(struct fs_info *info, struct fs_aux_info *aux_info,
 	sb->s_blocks_count_lo = aux_info->len_blocks;
 	sb->s_r_blocks_count_lo =
 	    (aux_info->len_blocks / 100) * info->reserve_pcnt;
+	sb->s_r_blocks_count_hi =
+	    ((aux_info->len_blocks / 100) * info->reserve_pcnt) >> 32;
 	sb->s_free_blocks_count_lo = 0;
 	sb->s_free_inodes_count = 0;
 	sb->s_first_data_block = aux_info->first_data_block;
@@ -250,17 +405,23 @@ void ext4_fill_in_sb(struct fs_info *info, struct fs_aux_info *aux_info,
 		sb->s_journal_inum = EXT4_JOURNAL_INO;
 	sb->s_journal_dev = 0;
 	sb->s_last_orphan = 0;
-	sb->s_hash_seed[0] = 0;	/* FIXME */
+	/* derived from the UUID so that the same image comes out each time */
+	if (info->feat_compat & EXT4_FEATURE_COMPAT_DIR_INDEX) {
+		char uuid[40];
+
+		uuid5_generate((uint8_t *)sb->s_hash_seed,
+			       "extandroid/make_ext4fs/hash_seed",
+			       uuid_bin_to_str(uuid, sizeof(uuid), info->uuid));
+	}
 	sb->s_def_hash_version = DX_HASH_TEA;
 	sb->s_reserved_char_pad = EXT4_JNL_BACKUP_BLOCKS;
-	sb->s_desc_size = sizeof(struct ext2_group_desc);
+	sb->s_desc_size = aux_info->desc_size;
 	sb->s_default_mount_opts = 0;	/* FIXME */
 	sb->s_first_meta_bg = 0;
 	sb->s_mkfs_time = 0;
 	//sb->s_jnl_blocks[17]; /* FIXME */
 
 	sb->s_blocks_count_hi = aux_info->len_blocks >> 32;
-	sb->s_r_blocks_count_hi = 0;
 	sb->s_free_blocks_count_hi = 0;
 	sb->s_min_extra_isize = sizeof(struct ext4_inode) -
 	    EXT4_GOOD_OLD_INODE_SIZE;
@@ -271,13 +432,24 @@ void ext4_fill_in_sb(struct fs_info *info, struct fs_aux_info *aux_info,
 	sb->s_mmp_interval = 0;
 	sb->s_mmp_block = 0;
 	sb->s_raid_stripe_width = 0;
-	sb->s_log_groups_per_flex = 0;
+	sb->s_log_groups_per_flex = log_2(aux_info->groups_per_flex);
 	sb->s_kbytes_written = 0;
+	if (ext4_has_metadata_csum(info)) {
+		sb->s_checksum_type = EXT4_CRC32C_CHKSUM;
+		aux_info->csum_seed = ext4_crc32c(~0, sb->s_uuid,
+						  sizeof(sb->s_uuid));
+	}
 
 	for (i = 0; i < aux_info->groups; i++) {
-		u64 group_start_block = aux_info->first_data_block + i *
-		    info->blocks_per_group;
-		u32 header_size = 0;
+		struct ext2_group_desc *desc = ext4_bg_desc(aux_info, i);
+		struct ext2_group_desc_hi *desc_hi = ext4_bg_desc_hi(aux_info,
+								     i);
+		u64 group_start_block = aux_info->first_data_block +
+		    (u64)i * info->blocks_per_group;
+		u64 block_bitmap;
+		u64 inode_bitmap;
+		u64 inode_table;
+
 		if (ext4_bg_has_super_block(info, i)) {
 			if (i != 0) {
 				aux_info->backup_sb[i] =
@@ -292,6 +464,8 @@ void ext4_fill_in_sb(struct fs_info *info, struct fs_aux_info *aux_info,
 				       info->block_size);
 				/* Update the block group nr of this backup superblock */
 				aux_info->backup_sb[i]->s_block_group_nr = i;
+				if (ext4_has_metadata_csum(info))
+					ext4_sb_csum_set(aux_info->backup_sb[i]);
 				sparse_file_add_data(ext4_sparse_file,
 						     aux_info->backup_sb[i],
 						     info->block_size,
@@ -302,23 +476,22 @@ void ext4_fill_in_sb(struct fs_info *info, struct fs_aux_info *aux_info,
 					     aux_info->bg_desc_blocks *
 					     info->block_size,
 					     group_start_block + 1);
-			header_size =
-			    1 + aux_info->bg_desc_blocks +
-			    info->bg_desc_reserve_blocks;
 		}
 
-		aux_info->bg_desc[i].bg_block_bitmap =
-		    group_start_block + header_size;
-		aux_info->bg_desc[i].bg_inode_bitmap =
-		    group_start_block + header_size + 1;
-		aux_info->bg_desc[i].bg_inode_table =
-		    group_start_block + header_size + 2;
-
-		aux_info->bg_desc[i].bg_free_blocks_count =
-		    sb->s_blocks_per_group;
-		aux_info->bg_desc[i].bg_free_inodes_count =
-		    sb->s_inodes_per_group;
-		aux_info->bg_desc[i].bg_used_dirs_count = 0;
+		ext4_bg_metadata(info, aux_info, i, &block_bitmap,
+				 &inode_bitmap, &inode_table);
+		desc->bg_block_bitmap = block_bitmap;
+		desc->bg_inode_bitmap = inode_bitmap;
+		desc->bg_inode_table = inode_table;
+		if (desc_hi) {
+			desc_hi->bg_block_bitmap_hi = block_bitmap >> 32;
+			desc_hi->bg_inode_bitmap_hi = inode_bitmap >> 32;
+			desc_hi->bg_inode_table_hi = inode_table >> 32;
+		}
+
+		desc->bg_free_blocks_count = sb->s_blocks_per_group;
+		desc->bg_free_inodes_count = sb->s_inodes_per_group;
+		desc->bg_used_dirs_count = 0;
 	}
 }
 
@@ -330,6 +503,9 @@ void ext4_queue_sb(struct fs_info *info, struct fs_aux_info *aux_info,
 	 * block on a system with a block size > 1K.  So, we need to
 	 * deal with that here.
 	 */
+	if (ext4_has_metadata_csum(info))
+		ext4_sb_csum_set(aux_info->sb);
+
 	if (info->block_size > 1024) {
 		u8 *buf = calloc(info->block_size, 1);
 		if (!buf) {
@@ -383,9 +559,9 @@ void ext4_create_resize_inode(struct fs_info *info,
 
 	for (i = 0; i < aux_info->groups; i++) {
 		if (ext4_bg_has_super_block(info, i)) {
-			u64 group_start_block = aux_info->first_data_block + i *
-			    info->blocks_per_group;
-			u32 reserved_block_start = group_start_block + 1 +
+			u64 group_start_block = aux_info->first_data_block +
+			    (u64)i * info->blocks_per_group;
+			u64 reserved_block_start = group_start_block + 1 +
 			    aux_info->bg_desc_blocks;
 			u32 reserved_block_len = info->bg_desc_reserve_blocks;
 			append_region(reserve_inode_alloc, setjmp_env,
@@ -418,12 +594,13 @@ void ext4_create_journal_inode(struct fs_info *info,
 		return;
 	}
 
+	/* only the journal superblock needs a buffer, the rest is zeros */
 	u8 *journal_data = inode_allocate_data_extents(info, aux_info,
 						       ext4_sparse_file, force,
 						       setjmp_env, inode,
-						       info->journal_blocks *
+						       EXT4_JOURNAL_INO,
+						       (u64)info->journal_blocks *
 						       info->block_size,
-						       info->journal_blocks *
 						       info->block_size);
 	if (!journal_data) {
 		error(force, setjmp_env,
@@ -442,6 +619,8 @@ void ext4_create_journal_inode(struct fs_info *info,
 	jsb->s_nr_users = htonl(1);
 	jsb->s_first = htonl(1);
 	jsb->s_sequence = htonl(1);
+	if (info->feat_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+		jsb->s_feature_incompat = htonl(JBD2_FEATURE_INCOMPAT_64BIT);
 
 	memcpy(aux_info->sb->s_jnl_blocks, &inode->i_block,
 	       sizeof(inode->i_block));
@@ -451,33 +630,120 @@ void ext4_create_journal_inode(struct fs_info *info,
    block group */
 void ext4_update_free(struct fs_aux_info *aux_info)
 {
+	u64 free_blocks = 0;
 	u32 i;
 
 	for (i = 0; i < aux_info->groups; i++) {
+		struct ext2_group_desc *desc = ext4_bg_desc(aux_info, i);
+		struct ext2_group_desc_hi *desc_hi = ext4_bg_desc_hi(aux_info,
+								     i);
 		u32 bg_free_blocks = get_free_blocks(aux_info, i);
 		u32 bg_free_inodes = get_free_inodes(aux_info, i);
+		u32 bg_itable_unused;
 		u16 crc;
 
-		aux_info->bg_desc[i].bg_free_blocks_count = bg_free_blocks;
-		aux_info->sb->s_free_blocks_count_lo += bg_free_blocks;
+		desc->bg_free_blocks_count = bg_free_blocks;
+		free_blocks += bg_free_blocks;
 
-		aux_info->bg_desc[i].bg_free_inodes_count = bg_free_inodes;
+		desc->bg_free_inodes_count = bg_free_inodes;
 		aux_info->sb->s_free_inodes_count += bg_free_inodes;
 
-		aux_info->bg_desc[i].bg_used_dirs_count +=
-		    get_directories(aux_info, i);
-
-		aux_info->bg_desc[i].bg_flags = get_bg_flags(aux_info, i);
-
+		bg_itable_unused = get_itable_unused(aux_info, i);
+		desc->bg_itable_unused = bg_itable_unused;
+		if (desc_hi)
+			desc_hi->bg_itable_unused_hi = bg_itable_unused >> 16;
+
+		desc->bg_used_dirs_count += get_directories(aux_info, i);
+
+		desc->bg_flags = get_bg_flags(aux_info, i);
+
+		/* the checksum covers all of the descriptor but itself */
+		if (aux_info->sb->s_feature_ro_compat &
+		    EXT4_FEATURE_RO_COMPAT_METADATA_CSUM) {
+			u16 zero = 0;
+			u32 crc32;
+
+			crc32 = ext4_crc32c(aux_info->csum_seed, &i, sizeof(i));
+			crc32 = ext4_crc32c(crc32, desc,
+					    offsetof(struct ext2_group_desc,
+						     bg_checksum));
+			crc32 = ext4_crc32c(crc32, &zero, sizeof(zero));
+			if (aux_info->desc_size >
+			    sizeof(struct ext2_group_desc))
+				crc32 = ext4_crc32c(crc32, desc + 1,
+						    aux_info->desc_size -
+						    sizeof(struct
+							   ext2_group_desc));
+			desc->bg_checksum = crc32 & 0xFFFF;
+			continue;
+		}
 		crc =
 		    ext4_crc16(~0, aux_info->sb->s_uuid,
 			       sizeof(aux_info->sb->s_uuid));
 		crc = ext4_crc16(crc, &i, sizeof(i));
 		crc =
-		    ext4_crc16(crc, &aux_info->bg_desc[i],
+		    ext4_crc16(crc, desc,
 			       offsetof(struct ext2_group_desc, bg_checksum));
-		aux_info->bg_desc[i].bg_checksum = crc;
+		if (aux_info->desc_size > sizeof(struct ext2_group_desc))
+			crc = ext4_crc16(crc, desc + 1,
+					 aux_info->desc_size -
+					 sizeof(struct ext2_group_desc));
+		desc->bg_checksum = crc;
+	}
+
+	aux_info->sb->s_free_blocks_count_lo = free_blocks;
+	aux_info->sb->s_free_blocks_count_hi = free_blocks >> 32;
+}
+
+/* Returns the seed of the checksums of an inode's metadata, such as the
+   inode itself and its extent and directory blocks */
+u32 ext4_inode_csum_seed(struct fs_aux_info *aux_info, u32 inode_num,
+			 u32 generation)
+{
+	u32 crc;
+
+	crc = ext4_crc32c(aux_info->csum_seed, &inode_num, sizeof(inode_num));
+	return ext4_crc32c(crc, &generation, sizeof(generation));
+}
+
+/* Sets the checksum of an inode once it is complete.  The checksum covers
+   the whole inode, with its own fields as zeros, and only has its upper
+   half when the extra fields reach i_checksum_hi. */
+void ext4_inode_csum_set(struct fs_info *info, struct fs_aux_info *aux_info,
+			 u32 inode_num, struct ext4_inode *inode)
+{
+	size_t hi_end = offsetof(struct ext4_inode, i_checksum_hi) +
+	    sizeof(inode->i_checksum_hi);
+	int has_hi;
+	u16 zero = 0;
+	u8 *p = (u8 *)inode;
+	size_t off;
+	u32 crc;
+
+	if (info->inode_size > EXT4_GOOD_OLD_INODE_SIZE &&
+	    inode->i_extra_isize == 0)
+		inode->i_extra_isize = sizeof(struct ext4_inode) -
+		    EXT4_GOOD_OLD_INODE_SIZE;
+	has_hi = info->inode_size > EXT4_GOOD_OLD_INODE_SIZE &&
+	    (size_t)EXT4_GOOD_OLD_INODE_SIZE + inode->i_extra_isize >= hi_end;
+
+	crc = ext4_inode_csum_seed(aux_info, inode_num, inode->i_generation);
+	off = offsetof(struct ext4_inode, i_checksum_lo);
+	crc = ext4_crc32c(crc, p, off);
+	crc = ext4_crc32c(crc, &zero, sizeof(zero));
+	off += sizeof(zero);
+	if (has_hi) {
+		crc = ext4_crc32c(crc, p + off,
+				  offsetof(struct ext4_inode,
+					   i_checksum_hi) - off);
+		crc = ext4_crc32c(crc, &zero, sizeof(zero));
+		off = hi_end;
 	}
+	crc = ext4_crc32c(crc, p + off, info->inode_size - off);
+
+	inode->i_checksum_lo = crc & 0xFFFF;
+	if (has_hi)
+		inode->i_checksum_hi = crc >> 16;
 }
 
 u64 get_block_device_size(int fd)
@@ -675,13 +941,14 @@ int read_ext(struct fs_info *info, struct fs_aux_info *aux_info, int force,
 		printf("    Block groups: %d\n", aux_info->groups);
 		printf("    Reserved block group size: %d\n",
 		       info->bg_desc_reserve_blocks);
-		printf("    Used %d/%d inodes and %d/%d blocks\n",
+		printf("    Used %d/%d inodes and %" PRIu64 "/%" PRIu64
+		       " blocks\n",
 		       aux_info->sb->s_inodes_count -
 		       aux_info->sb->s_free_inodes_count,
 		       aux_info->sb->s_inodes_count,
-		       aux_info->sb->s_blocks_count_lo -
-		       aux_info->sb->s_free_blocks_count_lo,
-		       aux_info->sb->s_blocks_count_lo);
+		       ext4_blocks_count(aux_info->sb) -
+		       ext4_free_blocks_count(aux_info->sb),
+		       ext4_blocks_count(aux_info->sb));
 	}
 
 	return 0;
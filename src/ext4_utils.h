@@ -105,7 +105,9 @@ typedef int (*fs_config_func_t)(struct fs_config_list * config_list,
 				uint64_t *capabilities);
 
 struct block_group_info;
+struct free_space;
 struct xattr_list_element;
+struct dir_leaves;
 
 struct ext2_group_desc {
 	u32 bg_block_bitmap;
@@ -115,26 +117,54 @@ struct ext2_group_desc {
 	u16 bg_free_inodes_count;
 	u16 bg_used_dirs_count;
 	u16 bg_flags;
-	u32 bg_reserved[2];
-	u16 bg_reserved16;
+	u32 bg_exclude_bitmap;
+	u16 bg_block_bitmap_csum_lo;
+	u16 bg_inode_bitmap_csum_lo;
+	u16 bg_itable_unused;
 	u16 bg_checksum;
 };
 
+/* The second half of a group descriptor with 64bit */
+struct ext2_group_desc_hi {
+	u32 bg_block_bitmap_hi;
+	u32 bg_inode_bitmap_hi;
+	u32 bg_inode_table_hi;
+	u16 bg_free_blocks_count_hi;
+	u16 bg_free_inodes_count_hi;
+	u16 bg_used_dirs_count_hi;
+	u16 bg_itable_unused_hi;
+	u32 bg_exclude_bitmap_hi;
+	u16 bg_block_bitmap_csum_hi;
+	u16 bg_inode_bitmap_csum_hi;
+	u32 bg_reserved;
+};
+
 struct fs_aux_info {
 	struct ext4_super_block *sb;
 	struct ext4_super_block **backup_sb;
 	struct ext2_group_desc *bg_desc;
 	struct block_group_info *bgs;
+	struct free_space *free_space;
 	struct xattr_list_element *xattrs;
+	struct dir_leaves *dir_leaves;	/* waiting for their checksums */
 	u32 first_data_block;
 	u64 len_blocks;
 	u32 inode_table_blocks;
 	u32 groups;
+	u32 groups_per_flex;	/* 1 without flex_bg */
 	u32 bg_desc_blocks;
+	u32 desc_size;		/* bytes per group descriptor, 64 with 64bit */
 	u32 default_i_flags;
+	u32 csum_seed;		/* crc32c of the UUID, with metadata_csum */
 	u32 blocks_per_ind;
 	u32 blocks_per_dind;
 	u32 blocks_per_tind;
+	int goal_bg;		/* block group for new inodes and blocks, or -1 */
+	u64 *inode_groups;	/* a bit set for each group with free inodes */
+	u32 first_inode_bg;	/* first group with free inodes, or groups */
+	u64 free_inodes;	/* totals over the groups, for find_dir_group() */
+	u64 free_blocks;
+	u64 used_dirs;
 };
 
 // extern jmp_buf setjmp_env;
@@ -149,13 +179,60 @@ static inline int log_2(int j)
 	return i - 1;
 }
 
-int bitmap_get_bit(u8 *bitmap, u32 bit);
+static inline u64 ext4_blocks_count(struct ext4_super_block *sb)
+{
+	return sb->s_blocks_count_lo | (u64)sb->s_blocks_count_hi << 32;
+}
+
+static inline u64 ext4_free_blocks_count(struct ext4_super_block *sb)
+{
+	return sb->s_free_blocks_count_lo |
+	    (u64)sb->s_free_blocks_count_hi << 32;
+}
+
+/* Returns the descriptor of a block group */
+static inline struct ext2_group_desc *ext4_bg_desc(struct fs_aux_info *aux_info,
+						   u32 bg)
+{
+	return (struct ext2_group_desc *)((u8 *)aux_info->bg_desc +
+					  (size_t)bg * aux_info->desc_size);
+}
+
+/* Returns the second half of the descriptor of a block group, or NULL if
+   descriptors only have the first */
+static inline struct ext2_group_desc_hi *ext4_bg_desc_hi(struct fs_aux_info
+							 *aux_info, u32 bg)
+{
+	if (aux_info->desc_size < EXT4_MIN_DESC_SIZE_64BIT)
+		return NULL;
+
+	return (struct ext2_group_desc_hi *)(ext4_bg_desc(aux_info, bg) + 1);
+}
+
+/* Returns whether the metadata of the filesystem carries crc32c checksums */
+static inline int ext4_has_metadata_csum(struct fs_info *info)
+{
+	return (info->feat_ro_compat &
+		EXT4_FEATURE_RO_COMPAT_METADATA_CSUM) != 0;
+}
+
+int bitmap_get_bit(const u8 *bitmap, u32 bit);
 void bitmap_clear_bit(u8 *bitmap, u32 bit);
+void bitmap_set_bits(u8 *bitmap, u32 start, u32 len);
+void bitmap_clear_bits(u8 *bitmap, u32 start, u32 len);
+int bitmap_test_bits(const u8 *bitmap, u32 start, u32 len);
+u32 bitmap_count_bits(const u8 *bitmap, u32 start, u32 len);
 int ext4_bg_has_super_block(struct fs_info *info, int bg);
+u32 ext4_bg_super_blocks(struct fs_info *info, struct fs_aux_info *aux_info,
+			 u32 bg);
+void ext4_bg_metadata(struct fs_info *info, struct fs_aux_info *aux_info,
+		      u32 bg, u64 *block_bitmap, u64 *inode_bitmap,
+		      u64 *inode_table);
 void read_sb(jmp_buf *setjmp_env, int fd, struct ext4_super_block *sb);
 void write_sb(jmp_buf *setjmp_env, int fd, unsigned long long offset,
 	      struct ext4_super_block *sb);
-void write_ext4_image(struct sparse_file *ext4_sparse_file, int fd, int gz,
+void write_ext4_image(jmp_buf *setjmp_env,
+		      struct sparse_file *ext4_sparse_file, int fd, int gz,
 		      int sparse, int crc);
 void ext4_init_fs_aux_info(struct fs_info *info, struct fs_aux_info *aux_info,
 			   jmp_buf *setjmp_env);
@@ -181,6 +258,11 @@ void ext4_parse_sb_info(struct fs_info *info, struct fs_aux_info *aux_info,
 			int force, jmp_buf *setjmp_env,
 			struct ext4_super_block *sb);
 u16 ext4_crc16(u16 crc_in, const void *buf, int size);
+u32 ext4_crc32c(u32 crc, const void *buf, size_t len);
+u32 ext4_inode_csum_seed(struct fs_aux_info *aux_info, u32 inode_num,
+			 u32 generation);
+void ext4_inode_csum_set(struct fs_info *info, struct fs_aux_info *aux_info,
+			 u32 inode_num, struct ext4_inode *inode);
 uint8_t *parse_uuid(uint8_t bytes[16], const char *str, size_t len);
 char *uuid_bin_to_str(char *buf, size_t buf_size, const uint8_t bytes[16]);
 
@@ -190,9 +272,12 @@ int make_ext4fs_internal(struct fs_info *info, struct fs_aux_info *aux_info,
 			 struct fs_config_list *config_list,
 			 int force, jmp_buf *setjmp_env,
 			 int uuid_user_specified, int fd,
-			 const char *directory, fs_config_func_t fs_config_func,
+			 const char *directory, const char *archive,
+			 fs_config_func_t fs_config_func,
 			 int gzip, int sparse, int crc, int wipe, int verbose,
-			 time_t fixed_time, FILE *block_list_file);
+			 time_t fixed_time, FILE *block_list_file,
+			 int scan_threads, int async_io, int dedup,
+			 int zero_blocks, const char *layout_order, int plan);
 
 int read_ext(struct fs_info *info, struct fs_aux_info *aux_info, int force,
 	     jmp_buf *setjmp_env, int fd, int verbose);
@@ -161,7 +161,7 @@ static int read_inode(struct fs_info *info, struct fs_aux_info *aux_info,
 	bg_offset = (inum - 1) % info->inodes_per_group;
 
 	inode_offset =
-	    ((unsigned long long)aux_info->bg_desc[bg_num].bg_inode_table *
+	    ((unsigned long long)ext4_bg_desc(aux_info, bg_num)->bg_inode_table *
 	     info->block_size) + (bg_offset * info->inode_size);
 
 	if (lseek(fd, inode_offset, SEEK_SET) < 0) {
@@ -234,29 +234,27 @@ static void check_inode_bitmap(struct fs_info *info,
 {
 	unsigned int inode_bitmap_block_num;
 	unsigned char block[MAX_EXT4_BLOCK_SIZE];
-	int bitmap_updated = 0;
-	size_t i;
+	u32 stray_inodes;
 
 	/* Using the bg_num, aux_info->bg_desc[], info->inodes_per_group and
 	 * new_inodes_per_group, retrieve the inode bitmap, and make sure
 	 * the bits between the old and new size are clear
 	 */
-	inode_bitmap_block_num = aux_info->bg_desc[bg_num].bg_inode_bitmap;
+	inode_bitmap_block_num = ext4_bg_desc(aux_info, bg_num)->bg_inode_bitmap;
 
 	read_block(info, setjmp_env, fd, inode_bitmap_block_num, block);
 
-	for (i = info->inodes_per_group; i < new_inodes_per_group; i++) {
-		if (bitmap_get_bit(block, i)) {
-			bitmap_clear_bit(block, i);
-			bitmap_updated = 1;
-		}
-	}
-
-	if (bitmap_updated) {
+	stray_inodes = bitmap_count_bits(block, info->inodes_per_group,
+					 new_inodes_per_group -
+					 info->inodes_per_group);
+	if (stray_inodes) {
+		bitmap_clear_bits(block, info->inodes_per_group,
+				  new_inodes_per_group -
+				  info->inodes_per_group);
 		if (verbose) {
 			printf
-			    ("Warning: updated inode bitmap for block group %d\n",
-			     bg_num);
+			    ("Warning: cleared %u bits of inode bitmap for block group %d\n",
+			     stray_inodes, bg_num);
 		}
 		write_block(info, setjmp_env, no_write, fd,
 			    inode_bitmap_block_num, block);
@@ -292,7 +290,7 @@ static int update_superblocks_and_bg_desc(struct fs_info *info,
 	/* Update the free inodes count in each block group descriptor */
 	for (i = 0; i < num_block_groups; i++) {
 		if (state == STATE_UPDATING_SB) {
-			aux_info->bg_desc[i].bg_free_inodes_count +=
+			ext4_bg_desc(aux_info, i)->bg_free_inodes_count +=
 			    (new_inodes_per_group - sb.s_inodes_per_group);
 		}
 		check_inode_bitmap(info, aux_info, verbose, setjmp_env,
@@ -805,6 +803,12 @@ int ext4fixup_internal(struct fs_info *info, struct fs_aux_info *aux_info,
 			       "Filesystem needs recovery first, mount and unmount to do that");
 	}
 
+	/* the inodes and directories it rewrites would need new checksums */
+	if (info->feat_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM) {
+		critical_error(setjmp_env,
+			       "Cannot fix up a filesystem with metadata checksums");
+	}
+
 	/* Clear the low bit which is set while this tool is in progress.
 	 * If the tool crashes, it will still be set when we restart.
 	 * The low bit is set to make the filesystem unmountable while
@@ -16,15 +16,18 @@
 
 #include "ext4_utils.h"
 #include "extent.h"
+#include "holes.h"
 
 #include <sparse/sparse.h>
 
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
-/* Creates data buffers for the first backing_len bytes of a block allocation
-   and queues them to be written */
+/* Queues the blocks of an allocation to be written, the first backing_len
+   bytes from a zeroed data buffer, which is returned, and the rest as
+   zero fill, which takes no memory and little room in sparse images */
 static u8 *extent_create_backing(struct fs_info *info,
 				 struct sparse_file *ext4_sparse_file,
 				 jmp_buf *setjmp_env,
@@ -36,15 +39,24 @@ static u8 *extent_create_backing(struct fs_info *info,
 		critical_error_errno(setjmp_env, "calloc(%zu, 1)", backing_len);
 
 	u8 *ptr = data;
-	for (; alloc != NULL && backing_len > 0; get_next_region(alloc)) {
-		u32 region_block;
+	for (; alloc != NULL && !last_region(alloc); get_next_region(alloc)) {
+		u64 region_block;
 		u32 region_len;
+		u32 data_blocks;
 		u32 len;
 		get_region(alloc, &region_block, &region_len);
 
-		len = min(region_len * info->block_size, backing_len);
-
-		sparse_file_add_data(ext4_sparse_file, ptr, len, region_block);
+		len = min((u64)region_len * info->block_size, backing_len);
+		data_blocks = DIV_ROUND_UP(len, info->block_size);
+
+		if (len)
+			sparse_file_add_data(ext4_sparse_file, ptr, len,
+					     region_block);
+		if (data_blocks < region_len)
+			sparse_file_add_fill(ext4_sparse_file, 0,
+					     (region_len - data_blocks) *
+					     info->block_size,
+					     region_block + data_blocks);
 		ptr += len;
 		backing_len -= len;
 	}
@@ -61,7 +73,7 @@ static void extent_create_backing_file(struct fs_info *info,
 {
 	off_t offset = 0;
 	for (; alloc != NULL && backing_len > 0; get_next_region(alloc)) {
-		u32 region_block;
+		u64 region_block;
 		u32 region_len;
 		u32 len;
 		get_region(alloc, &region_block, &region_len);
@@ -75,22 +87,306 @@ static void extent_create_backing_file(struct fs_info *info,
 	}
 }
 
+/* Queues the len bytes at offset in data to be written from block on.
+   Compressed data cannot be mapped, so it is read when it is written. */
+static void extent_add_data(struct sparse_file *ext4_sparse_file,
+			    const struct data_source *data, u64 offset,
+			    u32 len, u64 block)
+{
+	if (data->gz)
+		sparse_file_add_callback(ext4_sparse_file, data_source_read,
+					 (void *)data, offset, len, block);
+	else
+		sparse_file_add_fd(ext4_sparse_file, data->fd, offset, len,
+				   block);
+}
+
+/* Queues each chunk of the len bytes at offset in data to be written to
+   contiguous data block regions */
+static void extent_create_backing_fd(struct fs_info *info,
+				     struct block_allocation *alloc,
+				     struct sparse_file *ext4_sparse_file,
+				     u64 backing_len,
+				     const struct data_source *data,
+				     u64 offset)
+{
+	for (; alloc != NULL && backing_len > 0; get_next_region(alloc)) {
+		u64 region_block;
+		u32 region_len;
+		u32 len;
+		get_region(alloc, &region_block, &region_len);
+
+		len = min(region_len * info->block_size, backing_len);
+
+		extent_add_data(ext4_sparse_file, data, offset, len,
+				region_block);
+		offset += len;
+		backing_len -= len;
+	}
+}
+
+/* The kernel does not follow extent trees deeper than this */
+#define EXT4_MAX_EXTENT_DEPTH 5
+
+/* Extents or index entries that fit in the inode, and in a tree block */
+#define EXT4_INODE_EXTENTS 3
+#define EXT4_BLOCK_EXTENTS(info) \
+	(((info)->block_size - sizeof(struct ext4_extent_header)) / \
+	 sizeof(struct ext4_extent))
+
+/* Returns the number of blocks in the extent tree of a file with count
+   extents */
+static u32 extent_tree_blocks(struct fs_info *info, u32 count)
+{
+	u32 blocks = 0;
+
+	while (count > EXT4_INODE_EXTENTS) {
+		count = DIV_ROUND_UP(count, EXT4_BLOCK_EXTENTS(info));
+		blocks += count;
+	}
+
+	return blocks;
+}
+
+/* Returns the first block of an extent */
+static u64 extent_start(const struct ext4_extent *extent)
+{
+	return extent->ee_start_lo | (u64)extent->ee_start_hi << 32;
+}
+
+/* Appends len blocks at block, for the file blocks from file_block on, to the
+   count extents in extents.  With flex_bg the data of a file can run on
+   across block groups, so the blocks are merged into the last extent if
+   they follow on from it, as far as it can grow.  Returns the new number of
+   extents, which is at most count + 1 for len up to EXT_INIT_MAX_LEN. */
+static u32 extent_append(struct ext4_extent *extents, u32 count,
+			 u32 file_block, u64 block, u32 len)
+{
+	struct ext4_extent *last = count ? &extents[count - 1] : NULL;
+
+	if (last && last->ee_block + last->ee_len == file_block &&
+	    extent_start(last) + last->ee_len == block) {
+		u32 grow = min(len, EXT_INIT_MAX_LEN - last->ee_len);
+
+		last->ee_len += grow;
+		file_block += grow;
+		block += grow;
+		len -= grow;
+	}
+
+	if (len) {
+		extents[count].ee_block = file_block;
+		extents[count].ee_len = len;
+		extents[count].ee_start_hi = block >> 32;
+		extents[count].ee_start_lo = block;
+		count++;
+	}
+
+	return count;
+}
+
+/* Fills in the extents for the regions of alloc from the current one on,
+   for a file that starts there.  Returns their number. */
+static u32 extent_from_regions(struct block_allocation *alloc,
+			       struct ext4_extent *extents)
+{
+	u32 file_block = 0;
+	u32 count = 0;
+
+	for (; !last_region(alloc); get_next_region(alloc)) {
+		u64 region_block;
+		u32 region_len;
+
+		get_region(alloc, &region_block, &region_len);
+		count = extent_append(extents, count, file_block,
+				      region_block, region_len);
+		file_block += region_len;
+	}
+
+	return count;
+}
+
+/* Allocates the blocks of an extent tree from tree_blocks[first] on */
+static int extent_tree_allocate(struct fs_aux_info *aux_info, int force,
+				jmp_buf *setjmp_env, u64 *tree_blocks,
+				u32 first, u32 tree_len)
+{
+	u32 i;
+
+	for (i = first; i < tree_len; i++) {
+		tree_blocks[i] = allocate_block(aux_info, force, setjmp_env);
+		if (tree_blocks[i] == EXT4_ALLOCATE_BLOCK_FAILED) {
+			error(force, setjmp_env, "Failed to allocate 1 block");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Writes a node of an extent tree: the header and, at depth 0, the
+   extents, or above it, index entries for the nodes starting at the file
+   blocks starts[] in the tree blocks children[] */
+static void extent_node_fill(struct ext4_extent_header *hdr, u16 max,
+			     u16 depth, const struct ext4_extent *extents,
+			     const u32 *starts, const u64 *children,
+			     u32 entries)
+{
+	struct ext4_extent_idx *idx = EXT_FIRST_INDEX(hdr);
+	u32 i;
+
+	hdr->eh_magic = EXT4_EXT_MAGIC;
+	hdr->eh_entries = entries;
+	hdr->eh_max = max;
+	hdr->eh_depth = depth;
+	hdr->eh_generation = 0;
+
+	if (depth == 0) {
+		if (entries)
+			memcpy(EXT_FIRST_EXTENT(hdr), extents,
+			       entries * sizeof(struct ext4_extent));
+		return;
+	}
+
+	for (i = 0; i < entries; i++, idx++) {
+		idx->ei_block = starts[i];
+		idx->ei_leaf_lo = children[i];
+		idx->ei_leaf_hi = children[i] >> 32;
+		idx->ei_unused = 0;
+	}
+}
+
+/* Sets the checksum in the tail after the last possible entry of a node
+   in a tree block, which covers the node up to the tail */
+static void extent_csum_set(struct ext4_extent_header *hdr, u32 csum_seed)
+{
+	size_t size = sizeof(struct ext4_extent_header) +
+	    hdr->eh_max * sizeof(struct ext4_extent);
+	struct ext4_extent_tail *tail =
+	    (struct ext4_extent_tail *)((u8 *)hdr + size);
+
+	tail->et_checksum = ext4_crc32c(csum_seed, hdr, size);
+}
+
+/* Builds the extent tree of an inode for count extents, with the tree
+   blocks given in tree_blocks, top level first.  The tree is built from
+   the leaves up, and the entries of each level are spread evenly over
+   its nodes, so that every path from the inode is as long and no node is
+   much fuller than its neighbours.  With metadata_csum, each tree block
+   is checksummed as soon as it is filled in. */
+static int extent_tree_build(struct fs_info *info,
+			     struct fs_aux_info *aux_info,
+			     struct sparse_file *ext4_sparse_file, int force,
+			     jmp_buf *setjmp_env, struct ext4_inode *inode,
+			     u32 inode_num, const struct ext4_extent *extents,
+			     u32 count, const u64 *tree_blocks, u32 tree_len)
+{
+	int csum = ext4_has_metadata_csum(info);
+	u32 csum_seed = csum ? ext4_inode_csum_seed(aux_info, inode_num,
+						    inode->i_generation) : 0;
+	u32 block_max = EXT4_BLOCK_EXTENTS(info);
+	u32 nodes[EXT4_MAX_EXTENT_DEPTH];
+	u32 depth = 0;
+	u32 total = 0;
+	u32 *starts = NULL;
+	u64 *children = NULL;
+	u32 *next_starts;
+	u32 n = count;
+	u32 first;
+	u32 end;
+	u32 d;
+	u32 i;
+	u8 *data;
+
+	/* a tree that was given a block has at least one level in blocks */
+	while (n > EXT4_INODE_EXTENTS || (depth == 0 && tree_len > 0)) {
+		if (depth == EXT4_MAX_EXTENT_DEPTH) {
+			error(force, setjmp_env,
+			      "%u extents need too deep an extent tree",
+			      count);
+			return -1;
+		}
+		n = n ? DIV_ROUND_UP(n, block_max) : 1;
+		nodes[depth++] = n;
+		total += n;
+	}
+	if (total != tree_len)
+		critical_error(setjmp_env,
+			       "extent tree of %u blocks given %u blocks",
+			       total, tree_len);
+
+	n = count;
+	for (d = 0; d < depth; d++) {
+		/* the nodes of level d follow those of the levels above */
+		total -= nodes[d];
+
+		next_starts = malloc(nodes[d] * sizeof(u32));
+		if (!next_starts)
+			critical_error_errno(setjmp_env, "malloc");
+
+		for (i = 0; i < nodes[d]; i++) {
+			first = (u64)n * i / nodes[d];
+			end = (u64)n * (i + 1) / nodes[d];
+
+			data = calloc(info->block_size, 1);
+			if (!data)
+				critical_error_errno(setjmp_env,
+						     "calloc(%zu, 1)",
+						     (size_t)info->block_size);
+			sparse_file_add_data(ext4_sparse_file, data,
+					     info->block_size,
+					     tree_blocks[total + i]);
+
+			extent_node_fill((struct ext4_extent_header *)data,
+					 block_max, d, extents + first,
+					 starts ? starts + first : NULL,
+					 children ? children + first : NULL,
+					 end - first);
+			if (csum)
+				extent_csum_set((struct ext4_extent_header *)
+						data, csum_seed);
+			next_starts[i] = d ? starts[first] :
+			    (first < n ? extents[first].ee_block : 0);
+		}
+
+		free(starts);
+		starts = next_starts;
+		children = realloc(children, nodes[d] * sizeof(u64));
+		if (!children)
+			critical_error_errno(setjmp_env, "realloc");
+		memcpy(children, tree_blocks + total, nodes[d] * sizeof(u64));
+		n = nodes[d];
+	}
+
+	extent_node_fill((struct ext4_extent_header *)&inode->i_block[0],
+			 EXT4_INODE_EXTENTS, depth, extents, starts, children,
+			 n);
+
+	free(starts);
+	free(children);
+
+	return 0;
+}
+
 static struct block_allocation *do_inode_allocate_extents(struct fs_info *info, struct fs_aux_info
 							  *aux_info, struct sparse_file
 							  *ext4_sparse_file,
 							  int force,
 							  jmp_buf *setjmp_env,
 							  struct ext4_inode
-							  *inode, u64 len)
+							  *inode, u32 inode_num,
+							  u64 len)
 {
 	u32 block_len = DIV_ROUND_UP(len, info->block_size);
 	struct block_allocation *alloc = allocate_blocks(aux_info, force,
 							 setjmp_env,
 							 block_len + 1);
-	u32 extent_block = 0;
-	u32 file_block = 0;
-	struct ext4_extent *extent;
+	struct ext4_extent *extents;
+	u64 *tree_blocks = NULL;
+	u32 tree_len = 0;
+	u32 count;
 	u64 blocks;
+	int ret;
 
 	if (alloc == NULL) {
 		error(force, setjmp_env, "Failed to allocate %d blocks",
@@ -98,88 +394,49 @@ static struct block_allocation *do_inode_allocate_extents(struct fs_info *info,
 		return NULL;
 	}
 
-	int allocation_len = block_allocation_num_regions(alloc);
-	if (allocation_len <= 3) {
+	extents = malloc(block_allocation_num_regions(alloc) *
+			 sizeof(struct ext4_extent));
+	if (!extents)
+		critical_error_errno(setjmp_env, "malloc");
+
+	/* the extra block is the first block of the extent tree, if the
+	   extents do not fit in the inode.  Taking it off the front of the
+	   data leaves one extent fewer when the first region was that block
+	   alone, so the tree is sized for the extents that remain. */
+	count = extent_from_regions(alloc, extents);
+	rewind_alloc(alloc);
+	if (count <= EXT4_INODE_EXTENTS) {
 		reduce_allocation(aux_info, alloc, 1);
 	} else {
 		reserve_oob_blocks(alloc, setjmp_env, 1);
-		extent_block = get_oob_block(alloc, 0);
-	}
-
-	if (!extent_block) {
-		struct ext4_extent_header *hdr =
-		    (struct ext4_extent_header *)&inode->i_block[0];
-		hdr->eh_magic = EXT4_EXT_MAGIC;
-		hdr->eh_entries = allocation_len;
-		hdr->eh_max = 3;
-		hdr->eh_generation = 0;
-		hdr->eh_depth = 0;
-
-		extent = (struct ext4_extent *)&inode->i_block[3];
-	} else {
-		struct ext4_extent_header *hdr =
-		    (struct ext4_extent_header *)&inode->i_block[0];
-		hdr->eh_magic = EXT4_EXT_MAGIC;
-		hdr->eh_entries = 1;
-		hdr->eh_max = 3;
-		hdr->eh_generation = 0;
-		hdr->eh_depth = 1;
-
-		struct ext4_extent_idx *idx =
-		    (struct ext4_extent_idx *)&inode->i_block[3];
-		idx->ei_block = 0;
-		idx->ei_leaf_lo = extent_block;
-		idx->ei_leaf_hi = 0;
-		idx->ei_unused = 0;
-
-		u8 *data = calloc(info->block_size, 1);
-		if (!data)
-			critical_error_errno(setjmp_env, "calloc(%zu, 1)",
-					     (size_t)info->block_size);
-
-		sparse_file_add_data(ext4_sparse_file, data, info->block_size,
-				     extent_block);
-
-		if (((int)
-		     (info->block_size -
-		      sizeof(struct ext4_extent_header) /
-		      sizeof(struct ext4_extent))) < allocation_len) {
-			error(force, setjmp_env,
-			      "File size %" PRIu64
-			      " is too big to fit in a single extent block\n",
-			      len);
+		count = extent_from_regions(alloc, extents);
+		rewind_alloc(alloc);
+		tree_len = extent_tree_blocks(info, count);
+		if (tree_len < 1)
+			tree_len = 1;
+		tree_blocks = malloc(tree_len * sizeof(u64));
+		if (!tree_blocks)
+			critical_error_errno(setjmp_env, "malloc");
+		tree_blocks[0] = get_oob_block(alloc, 0);
+		if (extent_tree_allocate(aux_info, force, setjmp_env,
+					 tree_blocks, 1, tree_len)) {
+			free(tree_blocks);
+			free(extents);
 			return NULL;
 		}
-
-		hdr = (struct ext4_extent_header *)data;
-		hdr->eh_magic = EXT4_EXT_MAGIC;
-		hdr->eh_entries = allocation_len;
-		hdr->eh_max =
-		    (info->block_size -
-		     sizeof(struct ext4_extent_header)) /
-		    sizeof(struct ext4_extent);
-		hdr->eh_generation = 0;
-		hdr->eh_depth = 0;
-
-		extent = (struct ext4_extent *)(data +
-						sizeof(struct
-						       ext4_extent_header));
 	}
 
-	for (; !last_region(alloc); extent++, get_next_region(alloc)) {
-		u32 region_block;
-		u32 region_len;
+	count = extent_from_regions(alloc, extents);
 
-		get_region(alloc, &region_block, &region_len);
-		extent->ee_block = file_block;
-		extent->ee_len = region_len;
-		extent->ee_start_hi = 0;
-		extent->ee_start_lo = region_block;
-		file_block += region_len;
-	}
+	ret = extent_tree_build(info, aux_info, ext4_sparse_file, force,
+				setjmp_env, inode, inode_num, extents, count,
+				tree_blocks, tree_len);
+	free(extents);
+	free(tree_blocks);
+	if (ret)
+		return NULL;
 
-	if (extent_block)
-		block_len += 1;
+	block_len += tree_len;
 
 	blocks = (u64)block_len *info->block_size / 512;
 
@@ -195,20 +452,21 @@ static struct block_allocation *do_inode_allocate_extents(struct fs_info *info,
 }
 
 /* Allocates enough blocks to hold len bytes, with backing_len bytes in a data
-   buffer, and connects them to an inode.  Returns a pointer to the data
-   buffer. */
+   buffer and the rest zeroed, and connects them to an inode.  Returns a
+   pointer to the data buffer. */
 u8 *inode_allocate_data_extents(struct fs_info *info,
 				struct fs_aux_info *aux_info,
 				struct sparse_file *ext4_sparse_file,
 				int force, jmp_buf *setjmp_env,
-				struct ext4_inode *inode, u64 len,
-				u64 backing_len)
+				struct ext4_inode *inode, u32 inode_num,
+				u64 len, u64 backing_len)
 {
 	struct block_allocation *alloc;
 	u8 *data = NULL;
 
 	alloc = do_inode_allocate_extents(info, aux_info, ext4_sparse_file,
-					  force, setjmp_env, inode, len);
+					  force, setjmp_env, inode, inode_num,
+					  len);
 	if (alloc == NULL) {
 		error(force, setjmp_env,
 		      "failed to allocate extents for %" PRIu64 " bytes", len);
@@ -237,13 +495,14 @@ struct block_allocation *inode_allocate_file_extents(struct fs_info *info, struc
 						     int force,
 						     jmp_buf *setjmp_env,
 						     struct ext4_inode *inode,
-						     u64 len,
+						     u32 inode_num, u64 len,
 						     const char *filename)
 {
 	struct block_allocation *alloc;
 
 	alloc = do_inode_allocate_extents(info, aux_info, ext4_sparse_file,
-					  force, setjmp_env, inode, len);
+					  force, setjmp_env, inode, inode_num,
+					  len);
 	if (alloc == NULL) {
 		error(force, setjmp_env,
 		      "failed to allocate extents for %" PRIu64 " bytes", len);
@@ -255,16 +514,195 @@ struct block_allocation *inode_allocate_file_extents(struct fs_info *info, struc
 	return alloc;
 }
 
+/* Maps the blocks of the data ranges of a file, in order, onto the regions
+   of alloc.  Returns the extents, and their number in *count. */
+static struct ext4_extent *map_data_ranges(jmp_buf *setjmp_env,
+					   struct block_allocation *alloc,
+					   const struct data_range *ranges,
+					   u32 nr_ranges, u32 *count)
+{
+	struct ext4_extent *extents = NULL;
+	size_t extents_alloc = 0;
+	u64 region_block = 0;
+	u32 region_len = 0;
+	u32 range_block;
+	u32 range_len;
+	u32 len;
+	u32 i;
+
+	*count = 0;
+	rewind_alloc(alloc);
+
+	for (i = 0; i < nr_ranges; i++) {
+		range_block = ranges[i].block;
+		range_len = ranges[i].len;
+		while (range_len > 0) {
+			if (!region_len) {
+				get_region(alloc, &region_block, &region_len);
+				get_next_region(alloc);
+			}
+			len = min(range_len, region_len);
+
+			if (*count == extents_alloc) {
+				struct ext4_extent *e;
+				extents_alloc = extents_alloc ?
+				    extents_alloc * 2 : 16;
+				e = realloc(extents,
+					    extents_alloc * sizeof(*e));
+				if (!e)
+					critical_error_errno(setjmp_env,
+							     "realloc");
+				extents = e;
+			}
+			*count = extent_append(extents, *count, range_block,
+					       region_block, len);
+
+			range_block += len;
+			range_len -= len;
+			region_block += len;
+			region_len -= len;
+		}
+	}
+
+	rewind_alloc(alloc);
+
+	return extents;
+}
+
+/* Allocates blocks for the given data ranges of a len byte file, leaving
+   the rest of it as holes, queues them to be written from filename, or
+   from offset in data if data is not NULL, and connects them to an
+   inode. */
+struct block_allocation *inode_allocate_sparse_extents(struct fs_info *info, struct fs_aux_info
+						       *aux_info, struct sparse_file
+						       *ext4_sparse_file,
+						       int force,
+						       jmp_buf *setjmp_env,
+						       struct ext4_inode *inode,
+						       u32 inode_num, u64 len,
+						       const struct data_range
+						       *ranges, u32 nr_ranges,
+						       const char *filename,
+						       const struct data_source
+						       *data, u64 offset)
+{
+	struct block_allocation *alloc = NULL;
+	struct ext4_extent *extents = NULL;
+	u64 *tree_blocks = NULL;
+	u32 tree_len;
+	u32 block_len = 0;
+	u32 count = 0;
+	u64 file_offset;
+	u64 chunk;
+	u64 blocks;
+	u32 i;
+	int ret;
+
+	for (i = 0; i < nr_ranges; i++)
+		block_len += ranges[i].len;
+
+	if (block_len) {
+		alloc = allocate_blocks(aux_info, force, setjmp_env,
+					block_len);
+		if (alloc == NULL) {
+			error(force, setjmp_env,
+			      "Failed to allocate %d blocks", block_len);
+			return NULL;
+		}
+		extents = map_data_ranges(setjmp_env, alloc, ranges,
+					  nr_ranges, &count);
+	}
+
+	tree_len = extent_tree_blocks(info, count);
+	if (tree_len) {
+		tree_blocks = malloc(tree_len * sizeof(u64));
+		if (!tree_blocks)
+			critical_error_errno(setjmp_env, "malloc");
+		if (extent_tree_allocate(aux_info, force, setjmp_env,
+					 tree_blocks, 0, tree_len)) {
+			free(tree_blocks);
+			free(extents);
+			return NULL;
+		}
+	}
+
+	ret = extent_tree_build(info, aux_info, ext4_sparse_file, force,
+				setjmp_env, inode, inode_num, extents, count,
+				tree_blocks, tree_len);
+	free(tree_blocks);
+	if (ret) {
+		free(extents);
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		file_offset = (u64)extents[i].ee_block * info->block_size;
+		chunk = min((u64)extents[i].ee_len * info->block_size,
+			    len - file_offset);
+		if (data)
+			extent_add_data(ext4_sparse_file, data,
+					offset + file_offset, chunk,
+					extent_start(&extents[i]));
+		else
+			sparse_file_add_file(ext4_sparse_file, filename,
+					     file_offset, chunk,
+					     extent_start(&extents[i]));
+	}
+
+	block_len += tree_len;
+
+	blocks = (u64)block_len * info->block_size / 512;
+
+	inode->i_flags |= EXT4_EXTENTS_FL;
+	inode->i_size_lo = len;
+	inode->i_size_high = len >> 32;
+	inode->i_blocks_lo = blocks;
+	inode->osd2.linux2.l_i_blocks_high = blocks >> 32;
+
+	free(extents);
+
+	return alloc;
+}
+
+/* Allocates enough blocks to hold len bytes, queues them to be written
+   from offset in data, and connects them to an inode. */
+struct block_allocation *inode_allocate_fd_extents(struct fs_info *info, struct fs_aux_info
+						   *aux_info, struct sparse_file
+						   *ext4_sparse_file,
+						   int force,
+						   jmp_buf *setjmp_env,
+						   struct ext4_inode *inode,
+						   u32 inode_num, u64 len,
+						   const struct data_source
+						   *data, u64 offset)
+{
+	struct block_allocation *alloc;
+
+	alloc = do_inode_allocate_extents(info, aux_info, ext4_sparse_file,
+					  force, setjmp_env, inode, inode_num,
+					  len);
+	if (alloc == NULL) {
+		error(force, setjmp_env,
+		      "failed to allocate extents for %" PRIu64 " bytes", len);
+		return NULL;
+	}
+
+	extent_create_backing_fd(info, alloc, ext4_sparse_file, len, data,
+				 offset);
+	return alloc;
+}
+
 /* Allocates enough blocks to hold len bytes and connects them to an inode */
 void inode_allocate_extents(struct fs_info *info, struct fs_aux_info *aux_info,
 			    struct sparse_file *ext4_sparse_file, int force,
 			    jmp_buf *setjmp_env, struct ext4_inode *inode,
-			    u64 len)
+			    u32 inode_num, u64 len)
 {
 	struct block_allocation *alloc;
 
 	alloc = do_inode_allocate_extents(info, aux_info, ext4_sparse_file,
-					  force, setjmp_env, inode, len);
+					  force, setjmp_env, inode, inode_num,
+					  len);
 	if (alloc == NULL) {
 		error(force, setjmp_env,
 		      "failed to allocate extents for %" PRIu64 " bytes", len);
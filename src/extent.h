@@ -19,11 +19,13 @@
 
 #include "allocate.h"
 #include "ext4_utils.h"
+#include "gzindex.h"
+#include "holes.h"
 
 void inode_allocate_extents(struct fs_info *info, struct fs_aux_info *aux_info,
 			    struct sparse_file *ext4_sparse_file, int force,
 			    jmp_buf *setjmp_env, struct ext4_inode *inode,
-			    u64 len);
+			    u32 inode_num, u64 len);
 
 struct block_allocation *inode_allocate_file_extents(struct fs_info *info, struct fs_aux_info
 						     *aux_info, struct sparse_file
@@ -31,14 +33,37 @@ struct block_allocation *inode_allocate_file_extents(struct fs_info *info, struc
 						     int force,
 						     jmp_buf *setjmp_env,
 						     struct ext4_inode *inode,
-						     u64 len,
+						     u32 inode_num, u64 len,
 						     const char *filename);
 
+struct block_allocation *inode_allocate_sparse_extents(struct fs_info *info, struct fs_aux_info
+						       *aux_info, struct sparse_file
+						       *ext4_sparse_file,
+						       int force,
+						       jmp_buf *setjmp_env,
+						       struct ext4_inode *inode,
+						       u32 inode_num, u64 len,
+						       const struct data_range
+						       *ranges, u32 nr_ranges,
+						       const char *filename,
+						       const struct data_source
+						       *data, u64 offset);
+
+struct block_allocation *inode_allocate_fd_extents(struct fs_info *info, struct fs_aux_info
+						   *aux_info, struct sparse_file
+						   *ext4_sparse_file,
+						   int force,
+						   jmp_buf *setjmp_env,
+						   struct ext4_inode *inode,
+						   u32 inode_num, u64 len,
+						   const struct data_source
+						   *data, u64 offset);
+
 u8 *inode_allocate_data_extents(struct fs_info *info,
 				struct fs_aux_info *aux_info,
 				struct sparse_file *ext4_sparse_file,
 				int force, jmp_buf *setjmp_env,
-				struct ext4_inode *inode, u64 len,
-				u64 backing_len);
+				struct ext4_inode *inode, u32 inode_num,
+				u64 len, u64 backing_len);
 
 #endif
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ext4_utils.h"
+#include "freespace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NIL (~0U)
+
+/* Treap priorities only need to look random, and a fixed hash keeps the
+   shape of the tree, and the run time, the same from run to run */
+static u32 priority(u32 group)
+{
+	u32 h = group * 0x9e3779b9U;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	return h;
+}
+
+/* Returns whether group a comes before group b: fewer free blocks first,
+   then the lower group */
+static int before(struct free_space *fs, u32 a, u32 b)
+{
+	if (fs->free[a] != fs->free[b])
+		return fs->free[a] < fs->free[b];
+	return a < b;
+}
+
+/* Splits the treap at t into the groups before key, and key and the ones
+   after it */
+static void split(struct free_space *fs, u32 t, u32 key, u32 *l, u32 *r)
+{
+	if (t == NIL) {
+		*l = NIL;
+		*r = NIL;
+	} else if (before(fs, t, key)) {
+		split(fs, fs->right[t], key, &fs->right[t], r);
+		*l = t;
+	} else {
+		split(fs, fs->left[t], key, l, &fs->left[t]);
+		*r = t;
+	}
+}
+
+/* Joins two treaps, all of l coming before all of r */
+static u32 merge(struct free_space *fs, u32 l, u32 r)
+{
+	if (l == NIL)
+		return r;
+	if (r == NIL)
+		return l;
+	if (priority(l) > priority(r)) {
+		fs->right[l] = merge(fs, fs->right[l], r);
+		return l;
+	}
+	fs->left[r] = merge(fs, l, fs->left[r]);
+	return r;
+}
+
+static void treap_insert(struct free_space *fs, u32 group)
+{
+	u32 l;
+	u32 r;
+
+	fs->left[group] = NIL;
+	fs->right[group] = NIL;
+	split(fs, fs->root, group, &l, &r);
+	fs->root = merge(fs, merge(fs, l, group), r);
+}
+
+static void treap_remove(struct free_space *fs, u32 group)
+{
+	u32 l;
+	u32 r;
+
+	/* group is the first node of r */
+	split(fs, fs->root, group, &l, &r);
+	if (r == group) {
+		r = merge(fs, fs->left[group], fs->right[group]);
+	} else {
+		u32 parent = r;
+
+		while (fs->left[parent] != group)
+			parent = fs->left[parent];
+		fs->left[parent] = fs->right[group];
+	}
+	fs->root = merge(fs, l, r);
+}
+
+/* Returns the first group in the treap with at least len free blocks,
+   which has the fewest of those, or NIL */
+static u32 lower_bound(struct free_space *fs, u32 len)
+{
+	u32 found = NIL;
+	u32 t = fs->root;
+
+	while (t != NIL) {
+		if (fs->free[t] >= len) {
+			found = t;
+			t = fs->left[t];
+		} else {
+			t = fs->right[t];
+		}
+	}
+
+	return found;
+}
+
+static void max_update(struct free_space *fs, u32 group)
+{
+	u32 i = fs->max_leaves + group;
+
+	fs->max[i] = fs->free[group];
+	for (i /= 2; i >= 1; i /= 2)
+		fs->max[i] = fs->max[2 * i] > fs->max[2 * i + 1] ?
+		    fs->max[2 * i] : fs->max[2 * i + 1];
+}
+
+void free_space_init(struct free_space *fs, jmp_buf *setjmp_env,
+		     const u32 *free, u32 groups)
+{
+	u32 i;
+
+	fs->groups = groups;
+	fs->root = NIL;
+	for (fs->max_leaves = 1; fs->max_leaves < groups; fs->max_leaves *= 2)
+		;
+
+	fs->free = malloc(groups * sizeof(u32));
+	fs->left = malloc(groups * sizeof(u32));
+	fs->right = malloc(groups * sizeof(u32));
+	fs->max = calloc(2 * fs->max_leaves, sizeof(u32));
+	if (!fs->free || !fs->left || !fs->right || !fs->max)
+		critical_error_errno(setjmp_env, "malloc");
+
+	memcpy(fs->free, free, groups * sizeof(u32));
+	for (i = 0; i < groups; i++) {
+		treap_insert(fs, i);
+		max_update(fs, i);
+	}
+}
+
+void free_space_free(struct free_space *fs)
+{
+	free(fs->free);
+	free(fs->left);
+	free(fs->right);
+	free(fs->max);
+	memset(fs, 0, sizeof(*fs));
+}
+
+/* Records that a group now has free free blocks */
+void free_space_set(struct free_space *fs, u32 group, u32 free)
+{
+	if (fs->free[group] == free)
+		return;
+
+	treap_remove(fs, group);
+	fs->free[group] = free;
+	treap_insert(fs, group);
+	max_update(fs, group);
+}
+
+/* Returns the group with the fewest free blocks that has at least len, or
+   if none does, the one with the most free blocks, the lowest group among
+   equals either way, or -1 if no group has any free blocks left */
+int free_space_best_fit(struct free_space *fs, u32 len)
+{
+	u32 group = lower_bound(fs, len);
+	u32 t;
+
+	if (group != NIL)
+		return group;
+
+	if (fs->max[1] == 0)
+		return -1;
+
+	/* the most free blocks are found in the last node, but the lowest
+	   group with as many is the first one with that many */
+	for (t = fs->root; fs->right[t] != NIL; t = fs->right[t])
+		;
+	return lower_bound(fs, fs->free[t]);
+}
+
+static int first_fit(struct free_space *fs, u32 node, u32 lo, u32 hi,
+		     u32 start, u32 len)
+{
+	u32 mid = lo + (hi - lo) / 2;
+	int found;
+
+	if (hi <= start || fs->max[node] < len)
+		return -1;
+	if (node >= fs->max_leaves)
+		return lo;
+
+	found = first_fit(fs, 2 * node, lo, mid, start, len);
+	if (found < 0)
+		found = first_fit(fs, 2 * node + 1, mid, hi, start, len);
+
+	return found;
+}
+
+/* Returns the first group from start on with at least len free blocks,
+   wrapping around to group 0, or -1 if there is none */
+int free_space_first_fit(struct free_space *fs, u32 start, u32 len)
+{
+	int found = first_fit(fs, 1, 0, fs->max_leaves, start, len);
+
+	if (found < 0 && start > 0)
+		found = first_fit(fs, 1, 0, fs->max_leaves, 0, len);
+
+	return found;
+}
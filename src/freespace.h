@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FREESPACE_H_
+#define _FREESPACE_H_
+
+#include "ext4_utils.h"
+
+/* The free blocks of each block group, indexed two ways so that the
+   allocator does not have to scan every group: a treap ordered by (free
+   blocks, group) for best fit and largest free, and a tree of the maximum
+   free blocks over ranges of groups for first fit */
+struct free_space {
+	u32 groups;
+	u32 *free;
+	/* treap nodes are the groups themselves */
+	u32 root;
+	u32 *left;
+	u32 *right;
+	/* max tree, leaves from max_leaves on */
+	u32 max_leaves;
+	u32 *max;
+};
+
+void free_space_init(struct free_space *fs, jmp_buf *setjmp_env,
+		     const u32 *free, u32 groups);
+void free_space_free(struct free_space *fs);
+void free_space_set(struct free_space *fs, u32 group, u32 free);
+int free_space_best_fit(struct free_space *fs, u32 len);
+int free_space_first_fit(struct free_space *fs, u32 start, u32 len);
+
+#endif
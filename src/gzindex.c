@@ -0,0 +1,516 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ext4_utils.h"
+#include "gzindex.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Random access to the uncompressed data of a gzip file, after zran.c in
+   the zlib examples.  The file is decompressed on demand, and every
+   GZ_INDEX_SPAN bytes of output the state needed to start decompressing
+   again from there is kept: the position in the file, down to the bit,
+   and the last 32K of output that later data may refer back to.  A read
+   decompresses from the last such point before it, or goes on from where
+   the previous read stopped if that is closer, so no read decompresses
+   more than a span it does not need.  The points are found during the
+   first pass over the data, which is the only one when the data is read
+   in order.  The files of an archive are read in the order of the image,
+   several times over, so recently read data is also kept in chunks, and
+   an archive that fits in them is only decompressed once. */
+
+/* uncompressed bytes between access points */
+#define GZ_INDEX_SPAN (1024 * 1024)
+
+/* compressed bytes read from the file at a time */
+#define GZ_INDEX_IN_SIZE (64 * 1024)
+
+/* size of the buffer the data before a read is decompressed into */
+#define GZ_INDEX_SKIP_SIZE (64 * 1024)
+
+/* uncompressed bytes kept in each chunk */
+#define GZ_INDEX_CHUNK_SIZE (256 * 1024)
+
+/* number of chunks, 64MB in all, each holding data at offsets that are
+   the same modulo their total size */
+#define GZ_INDEX_CHUNKS 256
+
+struct gz_point {
+	u64 out;		/* offset in the uncompressed data */
+	u64 in;			/* offset in the file of the next input byte */
+	int bits;		/* bits of the byte before in not used yet */
+	int header;		/* at the header of a gzip member */
+	unsigned int window_len;
+	u8 *window;		/* output before out, NULL at a header */
+};
+
+struct gz_chunk {
+	u64 out;		/* offset in the uncompressed data */
+	size_t len;		/* less than GZ_INDEX_CHUNK_SIZE at the end */
+	int cached;		/* data holds len bytes at out */
+	u8 *data;		/* NULL until the chunk is first used */
+};
+
+struct gz_index {
+	int fd;
+	struct gz_point *points;
+	size_t nr_points;
+	size_t points_alloc;
+	u64 indexed;		/* points are known up to this offset */
+	z_stream strm;
+	int raw;		/* strm was started at a point in a member */
+	int eof;		/* strm is at the end of the data */
+	int broken;		/* strm failed, start again from a point */
+	u64 in;			/* offset in the file of the next input read */
+	u64 out;		/* offset of the next output of strm */
+	u8 *in_buf;
+	u8 *skip_buf;
+	struct gz_chunk chunks[GZ_INDEX_CHUNKS];
+};
+
+/* Reads as much of len bytes at offset in fd as there are.  Returns the
+   number read, or -1 with errno set. */
+static ssize_t gz_pread(int fd, u8 *buf, size_t len, u64 offset)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, buf + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+/* Returns 1 if the data at offset in fd starts with the gzip magic */
+int gz_index_is_gzip(int fd, u64 offset)
+{
+	u8 magic[2];
+
+	return gz_pread(fd, magic, 2, offset) == 2 &&
+	    magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+/* Returns an index of the gzip data at offset in fd, a regular file, or
+   NULL with errno set.  Nothing is read yet. */
+struct gz_index *gz_index_new(int fd, u64 offset)
+{
+	struct gz_index *idx;
+
+	idx = calloc(1, sizeof(struct gz_index));
+	if (!idx)
+		return NULL;
+
+	idx->fd = fd;
+	idx->in_buf = malloc(GZ_INDEX_IN_SIZE);
+	idx->skip_buf = malloc(GZ_INDEX_SKIP_SIZE);
+	idx->points = malloc(sizeof(struct gz_point));
+	if (!idx->in_buf || !idx->skip_buf || !idx->points)
+		goto err;
+	idx->points_alloc = 1;
+
+	/* decode the gzip header and trailer */
+	if (inflateInit2(&idx->strm, 15 + 32) != Z_OK) {
+		errno = ENOMEM;
+		goto err;
+	}
+
+	memset(&idx->points[0], 0, sizeof(struct gz_point));
+	idx->points[0].in = offset;
+	idx->points[0].header = 1;
+	idx->nr_points = 1;
+	idx->in = offset;
+
+	return idx;
+
+err:
+	free(idx->points);
+	free(idx->skip_buf);
+	free(idx->in_buf);
+	free(idx);
+	return NULL;
+}
+
+void gz_index_free(struct gz_index *idx)
+{
+	size_t i;
+
+	if (!idx)
+		return;
+
+	inflateEnd(&idx->strm);
+	for (i = 0; i < idx->nr_points; i++)
+		free(idx->points[i].window);
+	for (i = 0; i < GZ_INDEX_CHUNKS; i++)
+		free(idx->chunks[i].data);
+	free(idx->points);
+	free(idx->skip_buf);
+	free(idx->in_buf);
+	free(idx);
+}
+
+/* Records an access point where strm is now, at a gzip header or at the
+   end of a deflate block.  Returns 0, or -1 if memory ran out. */
+static int gz_add_point(struct gz_index *idx, int header)
+{
+	struct gz_point *point;
+	u8 *window = NULL;
+	uInt window_len = 0;
+
+	if (!header) {
+		window = malloc(32768);
+		if (!window)
+			return -1;
+		inflateGetDictionary(&idx->strm, window, &window_len);
+	}
+
+	if (idx->nr_points == idx->points_alloc) {
+		size_t alloc = idx->points_alloc * 2;
+
+		point = realloc(idx->points, alloc * sizeof(*point));
+		if (!point) {
+			free(window);
+			return -1;
+		}
+		idx->points = point;
+		idx->points_alloc = alloc;
+	}
+
+	point = &idx->points[idx->nr_points++];
+	point->out = idx->out;
+	point->in = idx->in - idx->strm.avail_in;
+	point->bits = header ? 0 : idx->strm.data_type & 7;
+	point->header = header;
+	point->window_len = window_len;
+	point->window = window;
+
+	return 0;
+}
+
+/* Sets strm up to decompress from point.  Returns 0, or -1 with errno
+   set. */
+static int gz_restart(struct gz_index *idx, struct gz_point *point)
+{
+	ssize_t got;
+	u8 byte;
+	int ret;
+
+	if (point->header) {
+		ret = inflateReset2(&idx->strm, 15 + 32);
+	} else {
+		ret = inflateReset2(&idx->strm, -15);
+		if (ret == Z_OK && point->bits) {
+			got = gz_pread(idx->fd, &byte, 1, point->in - 1);
+			if (got != 1) {
+				if (got == 0)
+					errno = EIO;
+				return -1;
+			}
+			ret = inflatePrime(&idx->strm, point->bits,
+					   byte >> (8 - point->bits));
+		}
+		if (ret == Z_OK)
+			ret = inflateSetDictionary(&idx->strm, point->window,
+						   point->window_len);
+	}
+	if (ret != Z_OK) {
+		errno = EIO;
+		return -1;
+	}
+
+	idx->raw = !point->header;
+	idx->eof = 0;
+	idx->broken = 0;
+	idx->in = point->in;
+	idx->out = point->out;
+	idx->strm.avail_in = 0;
+
+	return 0;
+}
+
+/* Makes sure there is input for strm.  Returns the number of bytes
+   available, 0 at the end of the file, or -1 with errno set. */
+static ssize_t gz_fill(struct gz_index *idx)
+{
+	ssize_t ret;
+
+	if (idx->strm.avail_in)
+		return idx->strm.avail_in;
+
+	ret = gz_pread(idx->fd, idx->in_buf, GZ_INDEX_IN_SIZE, idx->in);
+	if (ret < 0)
+		return -1;
+	idx->in += ret;
+	idx->strm.next_in = idx->in_buf;
+	idx->strm.avail_in = ret;
+
+	return ret;
+}
+
+/* Moves on to the next gzip member, if there is one, once strm is at the
+   end of one.  A member decoded from an access point leaves its trailer to
+   be skipped.  Anything but a gzip header after a member ends the data,
+   as it does for gzip.  Returns 0, or -1 with errno set. */
+static int gz_next_member(struct gz_index *idx, int frontier)
+{
+	unsigned int skip = idx->raw ? 8 : 0;
+	u64 next;
+
+	while (skip > 0) {
+		ssize_t ret = gz_fill(idx);
+		unsigned int n;
+
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;	/* truncated */
+			return -1;
+		}
+		n = min(skip, idx->strm.avail_in);
+		idx->strm.next_in += n;
+		idx->strm.avail_in -= n;
+		skip -= n;
+	}
+
+	next = idx->in - idx->strm.avail_in;
+	if (!gz_index_is_gzip(idx->fd, next)) {
+		idx->eof = 1;
+		return 0;
+	}
+
+	if (inflateReset2(&idx->strm, 15 + 32) != Z_OK) {
+		errno = EIO;
+		return -1;
+	}
+	idx->raw = 0;
+
+	if (frontier && gz_add_point(idx, 1))
+		return -1;
+
+	return 0;
+}
+
+/* Decompresses up to len bytes at idx->out into buf, recording access
+   points on the way through data not decompressed before.  Returns the
+   number of bytes, 0 at the end of the data, or -1 with errno set. */
+static ssize_t gz_inflate(struct gz_index *idx, u8 *buf, size_t len)
+{
+	struct gz_point *last;
+	size_t done = 0;
+	size_t want;
+	ssize_t ret;
+	int frontier;
+	int zret;
+
+	while (done < len && !idx->eof) {
+		ret = gz_fill(idx);
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;	/* truncated */
+			return -1;
+		}
+
+		/* stop at the end of each block, where points can be made */
+		frontier = idx->out >= idx->indexed;
+		want = min(len - done, (size_t)UINT_MAX);
+		idx->strm.next_out = buf + done;
+		idx->strm.avail_out = want;
+		zret = inflate(&idx->strm, frontier ? Z_BLOCK : Z_NO_FLUSH);
+		want -= idx->strm.avail_out;
+		done += want;
+		idx->out += want;
+		if (idx->out > idx->indexed)
+			idx->indexed = idx->out;
+
+		if (zret == Z_MEM_ERROR) {
+			errno = ENOMEM;
+			return -1;
+		}
+		if (zret != Z_OK && zret != Z_STREAM_END &&
+		    zret != Z_BUF_ERROR) {
+			errno = EIO;	/* not deflate data */
+			return -1;
+		}
+
+		if (zret == Z_STREAM_END) {
+			if (gz_next_member(idx, frontier))
+				return -1;
+			continue;
+		}
+
+		last = &idx->points[idx->nr_points - 1];
+		if (frontier && (idx->strm.data_type & 128) &&
+		    !(idx->strm.data_type & 64) &&
+		    idx->out - last->out >= GZ_INDEX_SPAN &&
+		    gz_add_point(idx, 0))
+			return -1;
+	}
+
+	return done;
+}
+
+/* Decompresses up to len bytes at offset in the uncompressed data into
+   buf.  Returns the number of bytes, 0 past the end of the data, or -1
+   with errno set. */
+static ssize_t gz_decompress(struct gz_index *idx, u8 *buf, size_t len,
+			     u64 offset)
+{
+	struct gz_point *point;
+	size_t lo = 0;
+	size_t hi = idx->nr_points;
+	ssize_t ret;
+	size_t done = 0;
+
+	/* the last point at or before offset */
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (idx->points[mid].out <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	point = &idx->points[lo];
+
+	if (idx->broken || offset < idx->out || point->out > idx->out) {
+		if (gz_restart(idx, point)) {
+			idx->broken = 1;
+			return -1;
+		}
+	}
+
+	while (idx->out < offset) {
+		ret = gz_inflate(idx, idx->skip_buf,
+				 min((u64)GZ_INDEX_SKIP_SIZE,
+				     offset - idx->out));
+		if (ret <= 0) {
+			if (ret < 0)
+				idx->broken = 1;
+			return ret;
+		}
+	}
+
+	while (done < len) {
+		ret = gz_inflate(idx, buf + done, len - done);
+		if (ret < 0) {
+			idx->broken = 1;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+/* Returns the chunk that holds offset, decompressing it if it is not
+   cached, or NULL with errno set */
+static struct gz_chunk *gz_get_chunk(struct gz_index *idx, u64 offset)
+{
+	u64 out = offset - offset % GZ_INDEX_CHUNK_SIZE;
+	struct gz_chunk *chunk;
+	ssize_t ret;
+
+	chunk = &idx->chunks[offset / GZ_INDEX_CHUNK_SIZE % GZ_INDEX_CHUNKS];
+	if (chunk->cached && chunk->out == out)
+		return chunk;
+
+	if (!chunk->data) {
+		chunk->data = malloc(GZ_INDEX_CHUNK_SIZE);
+		if (!chunk->data)
+			return NULL;
+	}
+
+	chunk->cached = 0;
+	ret = gz_decompress(idx, chunk->data, GZ_INDEX_CHUNK_SIZE, out);
+	if (ret < 0)
+		return NULL;
+	chunk->out = out;
+	chunk->len = ret;
+	chunk->cached = 1;
+
+	return chunk;
+}
+
+/* Reads up to len bytes at offset in the uncompressed data, as pread()
+   does.  Returns the number of bytes read, 0 past the end of the data, or
+   -1 with errno set. */
+ssize_t gz_index_pread(struct gz_index *idx, void *buf, size_t len,
+		       u64 offset)
+{
+	struct gz_chunk *chunk;
+	size_t done = 0;
+	size_t from;
+	size_t n;
+
+	while (done < len) {
+		chunk = gz_get_chunk(idx, offset + done);
+		if (!chunk)
+			return done ? (ssize_t)done : -1;
+		from = offset + done - chunk->out;
+		if (from >= chunk->len)
+			break;	/* past the end of the data */
+		n = min(len - done, chunk->len - from);
+		memcpy((u8 *)buf + done, chunk->data + from, n);
+		done += n;
+	}
+
+	return done;
+}
+
+/* Reads up to len bytes at offset from src, as pread() does */
+ssize_t data_source_pread(const struct data_source *src, void *buf,
+			  size_t len, u64 offset)
+{
+	if (src->gz)
+		return gz_index_pread(src->gz, buf, len, offset);
+
+	return pread(src->fd, buf, len, offset);
+}
+
+/* Reads all len bytes at offset from the struct data_source src, for
+   sparse_file_add_callback().  Returns 0, or negative errno. */
+int data_source_read(void *src, void *buf, size_t len, int64_t offset)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = data_source_pread(src, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -EIO;	/* the data ended early */
+		buf = (u8 *)buf + ret;
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
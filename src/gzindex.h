@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GZINDEX_H_
+#define _GZINDEX_H_
+
+#include "ext4_utils.h"
+
+#include <sys/types.h>
+
+struct gz_index;
+
+/* Where the data of files is read from: fd itself, or the uncompressed
+   data of the gzip file in fd if gz is not NULL */
+struct data_source {
+	int fd;
+	struct gz_index *gz;
+};
+
+struct gz_index *gz_index_new(int fd, u64 offset);
+void gz_index_free(struct gz_index *idx);
+ssize_t gz_index_pread(struct gz_index *idx, void *buf, size_t len,
+		       u64 offset);
+int gz_index_is_gzip(int fd, u64 offset);
+
+ssize_t data_source_pread(const struct data_source *src, void *buf,
+			  size_t len, u64 offset);
+int data_source_read(void *src, void *buf, size_t len, int64_t offset);
+
+#endif
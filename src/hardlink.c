@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ext4_utils.h"
+#include "hardlink.h"
+
+struct hardlink_key {
+	u64 dev;
+	u64 ino;
+};
+
+static size_t hardlink_hash(u64 dev, u64 ino)
+{
+	u64 h = ino * 0x9e3779b97f4a7c15ULL ^ dev;
+
+	return h ^ (h >> 32);
+}
+
+static int hardlink_match(const struct hash_entry *entry, const void *key)
+{
+	const struct hardlink *link = (const struct hardlink *)entry;
+	const struct hardlink_key *k = key;
+
+	return link->dev == k->dev && link->ino == k->ino;
+}
+
+static void hardlink_init(struct hash_entry *entry, const void *key)
+{
+	struct hardlink *link = (struct hardlink *)entry;
+	const struct hardlink_key *k = key;
+
+	link->dev = k->dev;
+	link->ino = k->ino;
+}
+
+void hardlink_table_init(struct hardlink_table *table)
+{
+	hash_table_init(&table->table, sizeof(struct hardlink));
+}
+
+void hardlink_table_free(struct hardlink_table *table)
+{
+	hash_table_free(&table->table, NULL);
+}
+
+/* Returns the entry for (dev, ino), adding it if it is new, or NULL with
+   errno set if memory ran out. */
+struct hardlink *hardlink_get(struct hardlink_table *table, u64 dev, u64 ino)
+{
+	struct hardlink_key key = { dev, ino };
+
+	return (struct hardlink *)hash_table_get(&table->table,
+						 hardlink_hash(dev, ino), &key,
+						 hardlink_match, hardlink_init);
+}
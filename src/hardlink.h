@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HARDLINK_H_
+#define _HARDLINK_H_
+
+#include "ext4_utils.h"
+#include "hashtable.h"
+
+/* A file with more than one name in the source.  Every dentry naming it
+   points to the same struct hardlink; the first one created in the image
+   records its inode, and the others only become directory entries for
+   that inode. */
+struct hardlink {
+	struct hash_entry entry;
+	u64 dev;
+	u64 ino;
+	u32 inode;
+};
+
+/* Hard linked files by (dev, ino), safe to use from the scanner threads */
+struct hardlink_table {
+	struct hash_table table;
+};
+
+void hardlink_table_init(struct hardlink_table *table);
+void hardlink_table_free(struct hardlink_table *table);
+struct hardlink *hardlink_get(struct hardlink_table *table, u64 dev, u64 ino);
+
+#endif
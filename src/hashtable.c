@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hashtable.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void hash_table_init(struct hash_table *table, size_t entry_size)
+{
+	memset(table, 0, sizeof(*table));
+	table->entry_size = entry_size;
+	pthread_mutex_init(&table->lock, NULL);
+}
+
+/* Frees every entry, calling release first if it is not NULL */
+void hash_table_free(struct hash_table *table, hash_release_func_t release)
+{
+	struct hash_entry *entry;
+	size_t i;
+
+	for (i = 0; i < table->size; i++) {
+		while ((entry = table->buckets[i])) {
+			table->buckets[i] = entry->next;
+			if (release)
+				release(entry);
+			free(entry);
+		}
+	}
+	free(table->buckets);
+	table->buckets = NULL;
+	table->size = 0;
+	table->used = 0;
+	pthread_mutex_destroy(&table->lock);
+}
+
+static int hash_table_grow(struct hash_table *table)
+{
+	size_t size = table->size ? table->size * 2 : 256;
+	struct hash_entry **buckets = calloc(size, sizeof(*buckets));
+	struct hash_entry *entry;
+	size_t i;
+
+	if (!buckets)
+		return -1;
+
+	for (i = 0; i < table->size; i++) {
+		while ((entry = table->buckets[i])) {
+			size_t h = entry->hash & (size - 1);
+			table->buckets[i] = entry->next;
+			entry->next = buckets[h];
+			buckets[h] = entry;
+		}
+	}
+	free(table->buckets);
+	table->buckets = buckets;
+	table->size = size;
+
+	return 0;
+}
+
+/* Returns the entry that match() finds to have key, among those with the
+   given hash.  If there is none, a new entry is added and filled in by
+   init().  Returns NULL with errno set if memory ran out. */
+struct hash_entry *hash_table_get(struct hash_table *table, size_t hash,
+				  const void *key, hash_match_func_t match,
+				  hash_init_func_t init)
+{
+	struct hash_entry *entry = NULL;
+	size_t h;
+
+	pthread_mutex_lock(&table->lock);
+
+	if (table->used >= table->size / 2 && hash_table_grow(table))
+		goto out;
+
+	h = hash & (table->size - 1);
+	for (entry = table->buckets[h]; entry; entry = entry->next)
+		if (entry->hash == hash && match(entry, key))
+			goto out;
+
+	entry = calloc(1, table->entry_size);
+	if (!entry)
+		goto out;
+	entry->hash = hash;
+	init(entry, key);
+	entry->next = table->buckets[h];
+	table->buckets[h] = entry;
+	table->used++;
+
+out:
+	pthread_mutex_unlock(&table->lock);
+	return entry;
+}
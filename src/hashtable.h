@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HASHTABLE_H_
+#define _HASHTABLE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* The first member of every entry of a hash table.  The hash of its key is
+   kept so that the table can grow without calling back into the user. */
+struct hash_entry {
+	struct hash_entry *next;
+	size_t hash;
+};
+
+/* A chained hash table, safe to use from the scanner threads.  Entries are
+   entry_size bytes, start with a struct hash_entry, and are only freed
+   with the table. */
+struct hash_table {
+	pthread_mutex_t lock;
+	struct hash_entry **buckets;
+	size_t size;
+	size_t used;
+	size_t entry_size;
+};
+
+/* Returns whether entry has the key passed to hash_table_get() */
+typedef int (*hash_match_func_t)(const struct hash_entry *entry,
+				 const void *key);
+/* Fills in the key of a new, zeroed entry */
+typedef void (*hash_init_func_t)(struct hash_entry *entry, const void *key);
+/* Frees what an entry points to, but not the entry itself */
+typedef void (*hash_release_func_t)(struct hash_entry *entry);
+
+void hash_table_init(struct hash_table *table, size_t entry_size);
+void hash_table_free(struct hash_table *table, hash_release_func_t release);
+struct hash_entry *hash_table_get(struct hash_table *table, size_t hash,
+				  const void *key, hash_match_func_t match,
+				  hash_init_func_t init);
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include "ext4_utils.h"
+#include "holes.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __GNUC__
+/* 16 bytes at a time, which the compiler turns into SSE2 or NEON */
+typedef u64 zero_vec __attribute__((vector_size(16)));
+#endif
+
+/* Returns 1 if the len bytes at buf are all zero */
+int block_is_zero(const u8 *buf, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __GNUC__
+	for (; i + 4 * sizeof(zero_vec) <= len; i += 4 * sizeof(zero_vec)) {
+		zero_vec v[4];
+
+		memcpy(v, buf + i, sizeof(v));
+		v[0] |= v[1] | v[2] | v[3];
+		if (v[0][0] | v[0][1])
+			return 0;
+	}
+#endif
+	for (; i < len; i++)
+		if (buf[i])
+			return 0;
+
+	return 1;
+}
+
+/* Appends a run of data blocks, merging it with the previous run if they
+   touch.  Returns -1 if memory ran out. */
+static int add_data_range(struct data_range **ranges, int *nr, size_t *alloc,
+			  u32 block, u32 len)
+{
+	struct data_range *range;
+
+	if (*nr > 0) {
+		range = &(*ranges)[*nr - 1];
+		if (range->block + range->len >= block) {
+			if (block + len > range->block + range->len)
+				range->len = block + len - range->block;
+			return 0;
+		}
+	}
+
+	if ((size_t)*nr == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 16;
+		range = realloc(*ranges, *alloc * sizeof(*range));
+		if (!range)
+			return -1;
+		*ranges = range;
+	}
+	(*ranges)[*nr].block = block;
+	(*ranges)[*nr].len = len;
+	(*nr)++;
+
+	return 0;
+}
+
+/* Adds the blocks of a run of data that are not all zero */
+static int add_nonzero_ranges(const struct data_source *src, u64 offset,
+			      u64 len, u32 block_size, u32 block, u32 end,
+			      u8 *buf, size_t buf_len,
+			      struct data_range **ranges, int *nr,
+			      size_t *alloc)
+{
+	u32 chunk_blocks = buf_len / block_size;
+	u64 pos;
+	size_t want;
+	size_t got;
+	ssize_t ret;
+	u32 i;
+	u32 n;
+
+	while (block < end) {
+		n = min(chunk_blocks, end - block);
+		pos = (u64)block * block_size;
+		want = min((u64)n * block_size, len - pos);
+
+		for (got = 0; got < want; got += ret) {
+			ret = data_source_pread(src, buf + got, want - got,
+						offset + pos + got);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (ret <= 0) {
+				if (ret == 0)
+					errno = EIO;	/* file shrank */
+				return -1;
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			size_t from = (size_t)i * block_size;
+
+			if (!block_is_zero(buf + from,
+					   min((size_t)block_size, got - from))
+			    && add_data_range(ranges, nr, alloc, block + i, 1))
+				return -1;
+		}
+		block += n;
+	}
+
+	return 0;
+}
+
+/* Finds the blocks of the len bytes at offset in src that need to be
+   allocated in the image.  With seek_holes, holes are found with SEEK_DATA
+   and SEEK_HOLE, which only works on uncompressed sources; with zero_blocks, the data is read into buf, whose size
+   must be a multiple of block_size, and blocks of zeros are left out as
+   well.  Returns the number of runs of data blocks put in *ranges, or -1
+   with errno set if the file could not be read, in which case all of it is
+   to be treated as data. */
+int find_data_ranges(const struct data_source *src, u64 offset, u64 len,
+		     u32 block_size, int seek_holes, int zero_blocks, u8 *buf,
+		     size_t buf_len, struct data_range **ranges)
+{
+	u32 file_blocks = DIV_ROUND_UP(len, block_size);
+	size_t alloc = 0;
+	off_t data;
+	off_t hole = offset;
+	u32 start;
+	u32 end;
+	int nr = 0;
+	int ret = 0;
+
+	*ranges = NULL;
+
+	while ((u64)hole < offset + len) {
+		if (seek_holes) {
+			data = lseek(src->fd, hole, SEEK_DATA);
+			if (data < 0) {
+				if (errno != ENXIO)
+					ret = -1;
+				break;	/* ENXIO: only a hole is left */
+			}
+			hole = lseek(src->fd, data, SEEK_HOLE);
+			if (hole < 0) {
+				ret = -1;
+				break;
+			}
+		} else {
+			data = offset;
+			hole = offset + len;
+		}
+
+		start = (data - offset) / block_size;
+		end = min(DIV_ROUND_UP((u64)(hole - offset), block_size),
+			  (u64)file_blocks);
+		if (start >= end)
+			continue;
+
+		if (zero_blocks)
+			ret = add_nonzero_ranges(src, offset, len, block_size,
+						 start, end, buf, buf_len,
+						 ranges, &nr, &alloc);
+		else
+			ret = add_data_range(ranges, &nr, &alloc, start,
+					     end - start);
+		if (ret)
+			break;
+	}
+
+	if (ret) {
+		free(*ranges);
+		*ranges = NULL;
+		return -1;
+	}
+
+	return nr;
+}
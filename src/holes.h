@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOLES_H_
+#define _HOLES_H_
+
+#include "ext4_utils.h"
+#include "gzindex.h"
+
+/* A run of blocks of a file that hold data */
+struct data_range {
+	u32 block;
+	u32 len;
+};
+
+int block_is_zero(const u8 *buf, size_t len);
+int find_data_ranges(const struct data_source *src, u64 offset, u64 len,
+		     u32 block_size, int seek_holes, int zero_blocks, u8 *buf,
+		     size_t buf_len, struct data_range **ranges);
+
+#endif
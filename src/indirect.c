@@ -42,7 +42,7 @@ static u8 *create_backing(struct fs_info *info,
 
 	u8 *ptr = data;
 	for (; alloc != NULL && backing_len > 0; get_next_region(alloc)) {
-		u32 region_block;
+		u64 region_block;
 		u32 region_len;
 		u32 len;
 		get_region(alloc, &region_block, &region_len);
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include "ext4_utils.h"
+#include "contents.h"
+#include "holes.h"
+#include "layout.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int compare_dentry(const void *key, const void *member)
+{
+	return strcmp(key, ((const struct dentry *)member)->filename);
+}
+
+/* Returns the entry called name in dir, or NULL.  The entries are sorted
+   by name, except that lost+found may have been put first. */
+static struct dentry *find_dentry(struct dentry *dir, const char *name)
+{
+	struct dentry *dentry;
+	u32 i;
+
+	dentry = bsearch(name, dir->dentries, dir->entries,
+			 sizeof(struct dentry), compare_dentry);
+	if (dentry)
+		return dentry;
+
+	for (i = 0; i < dir->entries; i++)
+		if (!strcmp(dir->dentries[i].filename, name))
+			return &dir->dentries[i];
+
+	return NULL;
+}
+
+/* Finds path, relative to the root of the image, in the scanned tree.
+   Returns the dentry of a regular file, or NULL, and sets *dir to the
+   dentry of its directory. */
+static struct dentry *find_file(struct dentry *root, char *path,
+				struct dentry **dir)
+{
+	struct dentry *dentry = root;
+	char *save = NULL;
+	char *name;
+
+	*dir = NULL;
+	for (name = strtok_r(path, "/", &save); name;
+	     name = strtok_r(NULL, "/", &save)) {
+		if (!strcmp(name, "."))
+			continue;
+		if (!dentry || dentry->file_type != EXT4_FT_DIR)
+			return NULL;
+		*dir = dentry;
+		dentry = find_dentry(dentry, name);
+	}
+
+	if (!dentry || dentry == root ||
+	    dentry->file_type != EXT4_FT_REG_FILE)
+		return NULL;
+
+	return dentry;
+}
+
+/* Reads a list of paths, one per line, in the order their data is to be
+   laid out in the image, such as the order in which they are read at
+   boot.  Blank lines and lines starting with # are skipped, and so are
+   paths that are not regular files in the scanned tree.  Returns the
+   number of files put in *files, or -1 with errno set. */
+int read_layout_order(const char *filename, struct dentry *root,
+		      struct layout_file **files)
+{
+	struct layout_file *p;
+	struct dentry *dentry;
+	struct dentry *dir;
+	size_t alloc = 0;
+	size_t len = 0;
+	char *line = NULL;
+	ssize_t ret;
+	int nr = 0;
+	FILE *f;
+
+	*files = NULL;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return -1;
+
+	while ((ret = getline(&line, &len, f)) >= 0) {
+		if (ret > 0 && line[ret - 1] == '\n')
+			line[--ret] = '\0';
+		if (ret == 0 || line[0] == '#')
+			continue;
+
+		dentry = find_file(root, line, &dir);
+		if (!dentry)
+			continue;
+
+		if ((size_t)nr == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			p = realloc(*files, alloc * sizeof(*p));
+			if (!p)
+				break;
+			*files = p;
+		}
+		(*files)[nr].dir = dir;
+		(*files)[nr].dentry = dentry;
+		nr++;
+	}
+
+	if (ret >= 0 || ferror(f)) {	/* out of memory, or a read error */
+		free(*files);
+		*files = NULL;
+		nr = -1;
+	}
+	free(line);
+	fclose(f);
+
+	return nr;
+}
+
+/* A regular file to be laid out by plan_layout(), with the number of
+   blocks it needs and its position in the walk of the tree */
+struct planned_file {
+	struct layout_file file;
+	u64 blocks;
+	size_t order;
+};
+
+/* Largest files first, and files of the same size in the order of the
+   tree, so that the plan does not depend on how qsort() breaks ties */
+static int compare_planned(const void *a, const void *b)
+{
+	const struct planned_file *pa = a;
+	const struct planned_file *pb = b;
+
+	if (pa->blocks != pb->blocks)
+		return pa->blocks < pb->blocks ? 1 : -1;
+
+	return pa->order < pb->order ? -1 : pa->order > pb->order;
+}
+
+/* Returns the number of data blocks a regular file takes */
+static u64 file_blocks(struct dentry *dentry, u32 block_size)
+{
+	u64 blocks = 0;
+	u32 i;
+
+	if (!dentry->holes)
+		return DIV_ROUND_UP((u64)dentry->size, block_size);
+
+	for (i = 0; i < dentry->nr_ranges; i++)
+		blocks += dentry->ranges[i].len;
+
+	return blocks;
+}
+
+/* Appends the regular files in and below dir that are larger than
+   min_size and not laid out yet to the nr files at *files.  Returns 0, or
+   -1 if memory ran out. */
+static int collect_files(struct dentry *dir, u64 min_size, u32 block_size,
+			 struct planned_file **files, size_t *nr,
+			 size_t *alloc)
+{
+	struct planned_file *p;
+	struct dentry *dentry;
+	u32 i;
+
+	for (i = 0; i < dir->entries; i++) {
+		dentry = &dir->dentries[i];
+
+		if (dentry->file_type == EXT4_FT_DIR) {
+			if (collect_files(dentry, min_size, block_size, files,
+					  nr, alloc) < 0)
+				return -1;
+			continue;
+		}
+
+		if (dentry->file_type != EXT4_FT_REG_FILE ||
+		    dentry->layout_inode || dentry->size <= min_size)
+			continue;
+
+		if (*nr == *alloc) {
+			*alloc = *alloc ? *alloc * 2 : 256;
+			p = realloc(*files, *alloc * sizeof(*p));
+			if (!p)
+				return -1;
+			*files = p;
+		}
+		p = &(*files)[*nr];
+		p->file.dir = dir;
+		p->file.dentry = dentry;
+		p->blocks = file_blocks(dentry, block_size);
+		p->order = *nr;
+		if (p->blocks)
+			(*nr)++;
+	}
+
+	return 0;
+}
+
+/* Plans the layout of the whole scanned tree at once: the regular files
+   larger than min_size, which is how large a file can be and still be
+   stored in its inode, largest first.  Laid out in that order, each in
+   the block group it fits best, the large files get whole groups or runs
+   of them and the small ones fill the gaps they leave, which keeps files
+   in few extents.  Returns the number of files put in *files, or -1 with
+   errno set. */
+int plan_layout(struct dentry *root, u64 min_size, u32 block_size,
+		struct layout_file **files)
+{
+	struct planned_file *planned = NULL;
+	size_t alloc = 0;
+	size_t nr = 0;
+	size_t i;
+
+	*files = NULL;
+
+	if (collect_files(root, min_size, block_size, &planned, &nr,
+			  &alloc) < 0) {
+		free(planned);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	qsort(planned, nr, sizeof(*planned), compare_planned);
+
+	*files = malloc((nr ? nr : 1) * sizeof(**files));
+	if (!*files) {
+		free(planned);
+		return -1;
+	}
+	for (i = 0; i < nr; i++)
+		(*files)[i] = planned[i].file;
+	free(planned);
+
+	return nr;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include "ext4_utils.h"
+
+struct dentry;
+
+/* A regular file named in a layout order list, and its directory */
+struct layout_file {
+	struct dentry *dir;
+	struct dentry *dentry;
+};
+
+int read_layout_order(const char *filename, struct dentry *root,
+		      struct layout_file **files);
+int plan_layout(struct dentry *root, u64 min_size, u32 block_size,
+		struct layout_file **files);
+
+#endif
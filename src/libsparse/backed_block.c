@@ -24,7 +24,7 @@
 #include "sparse_defs.h"
 
 struct backed_block {
-	unsigned int block;
+	uint64_t block;
 	unsigned int len;
 	enum backed_block_type type;
 	union {
@@ -42,6 +42,11 @@ struct backed_block {
 		struct {
 			uint32_t val;
 		} fill;
+		struct {
+			sparse_file_read_t read;
+			void *priv;
+			int64_t offset;
+		} callback;
 	};
 	struct backed_block *next;
 };
@@ -67,7 +72,7 @@ unsigned int backed_block_len(struct backed_block *bb)
 	return bb->len;
 }
 
-unsigned int backed_block_block(struct backed_block *bb)
+uint64_t backed_block_block(struct backed_block *bb)
 {
 	return bb->block;
 }
@@ -90,13 +95,28 @@ int backed_block_fd(struct backed_block *bb)
 	return bb->fd.fd;
 }
 
+sparse_file_read_t backed_block_read(struct backed_block *bb)
+{
+	assert(bb->type == BACKED_BLOCK_CALLBACK);
+	return bb->callback.read;
+}
+
+void *backed_block_priv(struct backed_block *bb)
+{
+	assert(bb->type == BACKED_BLOCK_CALLBACK);
+	return bb->callback.priv;
+}
+
 int64_t backed_block_file_offset(struct backed_block *bb)
 {
-	assert(bb->type == BACKED_BLOCK_FILE || bb->type == BACKED_BLOCK_FD);
+	assert(bb->type == BACKED_BLOCK_FILE || bb->type == BACKED_BLOCK_FD ||
+	       bb->type == BACKED_BLOCK_CALLBACK);
 	if (bb->type == BACKED_BLOCK_FILE) {
 		return bb->file.offset;
-	} else {		/* bb->type == BACKED_BLOCK_FD */
+	} else if (bb->type == BACKED_BLOCK_FD) {
 		return bb->fd.offset;
+	} else {		/* bb->type == BACKED_BLOCK_CALLBACK */
+		return bb->callback.offset;
 	}
 }
 
@@ -235,6 +255,13 @@ static int merge_bb(struct backed_block_list *bbl,
 			return -EINVAL;
 		}
 		break;
+	case BACKED_BLOCK_CALLBACK:
+		if (a->callback.read != b->callback.read ||
+		    a->callback.priv != b->callback.priv ||
+		    a->callback.offset + a->len != b->callback.offset) {
+			return -EINVAL;
+		}
+		break;
 	}
 
 	/* Blocks are compatible and adjacent, with a before b.  Merge b into a,
@@ -288,7 +315,7 @@ static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 
 /* Queues a fill block of memory to be written to the specified data blocks */
 int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
-			  unsigned int len, unsigned int block)
+			  unsigned int len, uint64_t block)
 {
 	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
 	if (bb == NULL) {
@@ -306,7 +333,7 @@ int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 
 /* Queues a block of memory to be written to the specified data blocks */
 int backed_block_add_data(struct backed_block_list *bbl, void *data,
-			  unsigned int len, unsigned int block)
+			  unsigned int len, uint64_t block)
 {
 	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
 	if (bb == NULL) {
@@ -324,7 +351,7 @@ int backed_block_add_data(struct backed_block_list *bbl, void *data,
 
 /* Queues a chunk of a file on disk to be written to the specified data blocks */
 int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
-			  int64_t offset, unsigned int len, unsigned int block)
+			  int64_t offset, unsigned int len, uint64_t block)
 {
 	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
 	if (bb == NULL) {
@@ -343,7 +370,7 @@ int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 
 /* Queues a chunk of a fd to be written to the specified data blocks */
 int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
-			unsigned int len, unsigned int block)
+			unsigned int len, uint64_t block)
 {
 	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
 	if (bb == NULL) {
@@ -360,6 +387,28 @@ int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
 	return queue_bb(bbl, bb);
 }
 
+/* Queues data read by a callback to be written to the specified data
+   blocks */
+int backed_block_add_callback(struct backed_block_list *bbl,
+			      sparse_file_read_t read, void *priv,
+			      int64_t offset, unsigned int len, uint64_t block)
+{
+	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	if (bb == NULL) {
+		return -ENOMEM;
+	}
+
+	bb->block = block;
+	bb->len = len;
+	bb->type = BACKED_BLOCK_CALLBACK;
+	bb->callback.read = read;
+	bb->callback.priv = priv;
+	bb->callback.offset = offset;
+	bb->next = NULL;
+
+	return queue_bb(bbl, bb);
+}
+
 int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 		       unsigned int max_len)
 {
@@ -394,6 +443,9 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 	case BACKED_BLOCK_FD:
 		new_bb->fd.offset += max_len;
 		break;
+	case BACKED_BLOCK_CALLBACK:
+		new_bb->callback.offset += max_len;
+		break;
 	case BACKED_BLOCK_FILL:
 		break;
 	}
@@ -19,6 +19,8 @@
 
 #include <stdint.h>
 
+#include <sparse/sparse.h>
+
 struct backed_block_list;
 struct backed_block;
 
@@ -27,24 +29,30 @@ enum backed_block_type {
 	BACKED_BLOCK_FILE,
 	BACKED_BLOCK_FD,
 	BACKED_BLOCK_FILL,
+	BACKED_BLOCK_CALLBACK,
 };
 
 int backed_block_add_data(struct backed_block_list *bbl, void *data,
-			  unsigned int len, unsigned int block);
+			  unsigned int len, uint64_t block);
 int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
-			  unsigned int len, unsigned int block);
+			  unsigned int len, uint64_t block);
 int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
-			  int64_t offset, unsigned int len, unsigned int block);
+			  int64_t offset, unsigned int len, uint64_t block);
 int backed_block_add_fd(struct backed_block_list *bbl, int fd,
-			int64_t offset, unsigned int len, unsigned int block);
+			int64_t offset, unsigned int len, uint64_t block);
+int backed_block_add_callback(struct backed_block_list *bbl,
+			      sparse_file_read_t read, void *priv,
+			      int64_t offset, unsigned int len, uint64_t block);
 
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl);
 struct backed_block *backed_block_iter_next(struct backed_block *bb);
 unsigned int backed_block_len(struct backed_block *bb);
-unsigned int backed_block_block(struct backed_block *bb);
+uint64_t backed_block_block(struct backed_block *bb);
 void *backed_block_data(struct backed_block *bb);
 const char *backed_block_filename(struct backed_block *bb);
 int backed_block_fd(struct backed_block *bb);
+sparse_file_read_t backed_block_read(struct backed_block *bb);
+void *backed_block_priv(struct backed_block *bb);
 int64_t backed_block_file_offset(struct backed_block *bb);
 uint32_t backed_block_fill_val(struct backed_block *bb);
 enum backed_block_type backed_block_type(struct backed_block *bb);
@@ -35,8 +35,9 @@ struct sparse_file;
  *
  * Creates a new sparse_file cookie that can be used to associate data
  * blocks.  Can later be written to a file with a variety of options.
- * block_size specifies the minimum size of a chunk in the file.  The maximum
- * size of the file is 2**32 * block_size (16TB for 4k block size).
+ * block_size specifies the minimum size of a chunk in the file.  The sparse
+ * format limits the size of files written with sparse set to
+ * 2**32 * block_size (16TB for 4k block size).
  *
  * Returns the sparse file cookie, or NULL on error.
  */
@@ -71,7 +72,7 @@ void sparse_file_destroy(struct sparse_file *s);
  * Returns 0 on success, negative errno on error.
  */
 int sparse_file_add_data(struct sparse_file *s,
-			 void *data, unsigned int len, unsigned int block);
+			 void *data, unsigned int len, uint64_t block);
 
 /**
  * sparse_file_add_fill - associate a fill chunk with a sparse file
@@ -90,7 +91,7 @@ int sparse_file_add_data(struct sparse_file *s,
  */
 int sparse_file_add_fill(struct sparse_file *s,
 			 uint32_t fill_val, unsigned int len,
-			 unsigned int block);
+			 uint64_t block);
 
 /**
  * sparse_file_add_file - associate a chunk of a file with a sparse file
@@ -114,7 +115,7 @@ int sparse_file_add_fill(struct sparse_file *s,
  */
 int sparse_file_add_file(struct sparse_file *s,
 			 const char *filename, int64_t file_offset,
-			 unsigned int len, unsigned int block);
+			 unsigned int len, uint64_t block);
 
 /**
  * sparse_file_add_file - associate a chunk of a file with a sparse file
@@ -141,7 +142,48 @@ int sparse_file_add_file(struct sparse_file *s,
  */
 int sparse_file_add_fd(struct sparse_file *s,
 		       int fd, int64_t file_offset, unsigned int len,
-		       unsigned int block);
+		       uint64_t block);
+
+/**
+ * sparse_file_read_t - reads the data backing a callback chunk
+ *
+ * @priv - the priv passed to sparse_file_add_callback()
+ * @data - where to put the data
+ * @len - number of bytes to read
+ * @offset - offset of the data in whatever priv reads from
+ *
+ * Returns 0 once all len bytes are read, negative errno on error.
+ */
+typedef int (*sparse_file_read_t)(void *priv, void *data, size_t len,
+				  int64_t offset);
+
+/**
+ * sparse_file_add_callback - associate data read by a callback with a
+ * sparse file
+ *
+ * @s - sparse file cookie
+ * @read - function that reads the data
+ * @priv - passed to read
+ * @offset - offset of the data, passed to read
+ * @len - length of the data
+ * @block - offset in blocks into the sparse file to place the data
+ *
+ * Associates data that cannot be mapped, such as the contents of a
+ * compressed file, with a sparse file cookie.  When the sparse file is
+ * written, read is called for the whole chunk.  The region
+ * [block * block_size : block * block_size + len) must not already be used
+ * in the sparse file.  If len is not a multiple of the block size the data
+ * will be padded with zeros.  Adjacent chunks with the same read and priv
+ * and contiguous offsets are merged.
+ *
+ * priv must remain valid until the sparse file is closed.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_add_callback(struct sparse_file *s,
+			     sparse_file_read_t read, void *priv,
+			     int64_t offset, unsigned int len,
+			     uint64_t block);
 
 /**
  * sparse_file_write - write a sparse file to a file
@@ -282,6 +324,17 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
  */
 void sparse_file_verbose(struct sparse_file *s);
 
+/**
+ * sparse_file_async_io - read file backed chunks ahead with io_uring
+ *
+ * @s - sparse file cookie
+ *
+ * When writing the sparse file, open and read the files backing its chunks
+ * ahead of the output with io_uring, keeping many reads in flight.  Falls
+ * back to reading each file when it is reached if io_uring is not available.
+ */
+void sparse_file_async_io(struct sparse_file *s);
+
 /**
  * sparse_print_verbose - function called to print verbose errors
  *
@@ -17,6 +17,7 @@
 #define _FILE_OFFSET_BITS 64
 #define _LARGEFILE64_SOURCE 1
 
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -141,13 +142,20 @@ static int file_write(struct output_file *out, void *data, int len)
 	int ret;
 	struct output_file_normal *outn = to_output_file_normal(out);
 
-	ret = write(outn->fd, data, len);
-	if (ret < 0) {
-		error_errno("write");
-		return -1;
-	} else if (ret < len) {
-		error("incomplete write");
-		return -1;
+	/* writes to a pipe stop short when io_uring work interrupts them */
+	while (len > 0) {
+		ret = write(outn->fd, data, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			error_errno("write");
+			return -1;
+		} else if (ret == 0) {
+			error("incomplete write");
+			return -1;
+		}
+		data = (char *)data + ret;
+		len -= ret;
 	}
 
 	return 0;
@@ -554,6 +562,13 @@ static int output_file_init(struct output_file *out, int block_size,
 		goto err_fill_buf;
 	}
 
+	if (sparse && out->len / out->block_size > UINT32_MAX) {
+		error("%" PRIi64 " bytes do not fit in a sparse file with %u"
+		      " byte blocks", out->len, out->block_size);
+		ret = -EINVAL;
+		goto err_write;
+	}
+
 	if (sparse) {
 		out->sparse_ops = &sparse_file_ops;
 	} else {
@@ -715,6 +730,28 @@ int write_fd_chunk(struct output_file *out, unsigned int len,
 	return ret;
 }
 
+/* Write a contiguous region of data blocks read by a callback */
+int write_callback_chunk(struct output_file *out, unsigned int len,
+			 sparse_file_read_t read, void *priv, int64_t offset)
+{
+	int ret;
+	char *data;
+
+	data = malloc(len);
+	if (!data) {
+		return -ENOMEM;
+	}
+
+	ret = read(priv, data, len, offset);
+	if (!ret) {
+		ret = out->sparse_ops->write_data_chunk(out, len, data);
+	}
+
+	free(data);
+
+	return ret;
+}
+
 /* Write a contiguous region of data blocks from a file */
 int write_file_chunk(struct output_file *out, unsigned int len,
 		     const char *file, int64_t offset)
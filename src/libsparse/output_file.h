@@ -35,6 +35,8 @@ int write_file_chunk(struct output_file *out, unsigned int len,
 		     const char *file, int64_t offset);
 int write_fd_chunk(struct output_file *out, unsigned int len,
 		   int fd, int64_t offset);
+int write_callback_chunk(struct output_file *out, unsigned int len,
+			 sparse_file_read_t read, void *priv, int64_t offset);
 int write_skip_chunk(struct output_file *out, int64_t len);
 void output_file_close(struct output_file *out);
 
@@ -15,7 +15,11 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <sparse/sparse.h>
 
@@ -26,6 +30,7 @@
 #include "backed_block.h"
 #include "sparse_defs.h"
 #include "sparse_format.h"
+#include "uring.h"
 
 struct sparse_file *sparse_file_new(unsigned int block_size, int64_t len)
 {
@@ -53,14 +58,14 @@ void sparse_file_destroy(struct sparse_file *s)
 }
 
 int sparse_file_add_data(struct sparse_file *s,
-			 void *data, unsigned int len, unsigned int block)
+			 void *data, unsigned int len, uint64_t block)
 {
 	return backed_block_add_data(s->backed_block_list, data, len, block);
 }
 
 int sparse_file_add_fill(struct sparse_file *s,
 			 uint32_t fill_val, unsigned int len,
-			 unsigned int block)
+			 uint64_t block)
 {
 	return backed_block_add_fill(s->backed_block_list, fill_val, len,
 				     block);
@@ -68,7 +73,7 @@ int sparse_file_add_fill(struct sparse_file *s,
 
 int sparse_file_add_file(struct sparse_file *s,
 			 const char *filename, int64_t file_offset,
-			 unsigned int len, unsigned int block)
+			 unsigned int len, uint64_t block)
 {
 	return backed_block_add_file(s->backed_block_list, filename,
 				     file_offset, len, block);
@@ -76,16 +81,25 @@ int sparse_file_add_file(struct sparse_file *s,
 
 int sparse_file_add_fd(struct sparse_file *s,
 		       int fd, int64_t file_offset, unsigned int len,
-		       unsigned int block)
+		       uint64_t block)
 {
 	return backed_block_add_fd(s->backed_block_list, fd, file_offset,
 				   len, block);
 }
 
+int sparse_file_add_callback(struct sparse_file *s,
+			     sparse_file_read_t read, void *priv,
+			     int64_t offset, unsigned int len,
+			     uint64_t block)
+{
+	return backed_block_add_callback(s->backed_block_list, read, priv,
+					 offset, len, block);
+}
+
 unsigned int sparse_count_chunks(struct sparse_file *s)
 {
 	struct backed_block *bb;
-	unsigned int last_block = 0;
+	uint64_t last_block = 0;
 	unsigned int chunks = 0;
 
 	for (bb = backed_block_iter_new(s->backed_block_list); bb;
@@ -98,7 +112,7 @@ unsigned int sparse_count_chunks(struct sparse_file *s)
 		last_block = backed_block_block(bb) +
 		    DIV_ROUND_UP(backed_block_len(bb), s->block_size);
 	}
-	if (last_block < DIV_ROUND_UP(s->len, s->block_size)) {
+	if ((int64_t)last_block < DIV_ROUND_UP(s->len, s->block_size)) {
 		chunks++;
 	}
 
@@ -130,28 +144,266 @@ static int sparse_file_write_block(struct output_file *out,
 		ret = write_fill_chunk(out, backed_block_len(bb),
 				       backed_block_fill_val(bb));
 		break;
+	case BACKED_BLOCK_CALLBACK:
+		ret = write_callback_chunk(out, backed_block_len(bb),
+					   backed_block_read(bb),
+					   backed_block_priv(bb),
+					   backed_block_file_offset(bb));
+		break;
 	}
 
 	return ret;
 }
 
+/*
+ * Read-ahead of blocks backed by files, for sparse_file_async_io().
+ *
+ * The next READAHEAD_SLOTS file or fd backed blocks are opened and read into
+ * memory with io_uring while earlier blocks are being written out, instead
+ * of each file being opened and mapped in turn when it is reached.  Blocks
+ * larger than READAHEAD_MAX_BYTES are left to write_file_chunk().
+ */
+#define READAHEAD_SLOTS 32
+#define READAHEAD_MAX_BYTES (32 * 1024 * 1024)
+
+struct readahead_slot {
+	struct backed_block *bb;
+	char *buf;
+	unsigned int done;
+	int fd;
+	bool own_fd;
+	bool complete;
+	int err;
+};
+
+struct readahead {
+	struct uring *ring;
+	struct readahead_slot slots[READAHEAD_SLOTS];
+	unsigned int head;
+	unsigned int count;
+	unsigned int in_flight;
+	size_t bytes;
+	struct backed_block *next;
+};
+
+static struct readahead *readahead_new(struct sparse_file *s)
+{
+	struct readahead *ra;
+
+	ra = calloc(1, sizeof(struct readahead));
+	if (!ra)
+		return NULL;
+
+	ra->ring = uring_new(READAHEAD_SLOTS);
+	if (!ra->ring || !uring_supported(ra->ring, URING_OP_OPENAT) ||
+	    !uring_supported(ra->ring, URING_OP_READ)) {
+		uring_free(ra->ring);
+		free(ra);
+		return NULL;
+	}
+	ra->next = backed_block_iter_new(s->backed_block_list);
+
+	return ra;
+}
+
+static void readahead_finish(struct readahead_slot *slot, int err)
+{
+	slot->err = err;
+	slot->complete = true;
+	if (slot->own_fd && slot->fd >= 0)
+		close(slot->fd);
+	slot->fd = -1;
+}
+
+static int readahead_read(struct readahead *ra, unsigned int i)
+{
+	struct readahead_slot *slot = &ra->slots[i];
+	unsigned int len = backed_block_len(slot->bb);
+	int ret;
+
+	ret = uring_prep_read(ra->ring, slot->fd, slot->buf + slot->done,
+			      len - slot->done,
+			      backed_block_file_offset(slot->bb) + slot->done,
+			      i);
+	if (ret < 0)
+		readahead_finish(slot, ret);
+	else
+		ra->in_flight++;
+
+	return ret;
+}
+
+/* Queues the file backed blocks that follow the last queued one */
+static void readahead_fill(struct readahead *ra)
+{
+	struct readahead_slot *slot;
+	struct backed_block *bb;
+	unsigned int len;
+	unsigned int i;
+	int ret;
+
+	while (ra->count < READAHEAD_SLOTS && ra->next) {
+		bb = ra->next;
+		if (backed_block_type(bb) != BACKED_BLOCK_FILE &&
+		    backed_block_type(bb) != BACKED_BLOCK_FD) {
+			ra->next = backed_block_iter_next(bb);
+			continue;
+		}
+
+		len = backed_block_len(bb);
+		if (len > READAHEAD_MAX_BYTES) {
+			ra->next = backed_block_iter_next(bb);
+			continue;
+		}
+		if (ra->count && ra->bytes + len > READAHEAD_MAX_BYTES)
+			break;
+
+		ra->next = backed_block_iter_next(bb);
+
+		i = (ra->head + ra->count) % READAHEAD_SLOTS;
+		slot = &ra->slots[i];
+		memset(slot, 0, sizeof(*slot));
+		slot->buf = malloc(len);
+		if (!slot->buf)
+			continue;	/* left to write_file_chunk() */
+		slot->bb = bb;
+		ra->count++;
+		ra->bytes += len;
+
+		if (backed_block_type(bb) == BACKED_BLOCK_FD) {
+			slot->fd = backed_block_fd(bb);
+			readahead_read(ra, i);
+		} else {
+			slot->fd = -1;
+			slot->own_fd = true;
+			ret = uring_prep_openat(ra->ring, AT_FDCWD,
+						backed_block_filename(bb),
+						O_RDONLY, i);
+			if (ret < 0)
+				readahead_finish(slot, ret);
+			else
+				ra->in_flight++;
+		}
+	}
+}
+
+/* Waits for one request and moves its block along */
+static int readahead_complete(struct readahead *ra)
+{
+	struct readahead_slot *slot;
+	uint64_t user_data;
+	unsigned int len;
+	int res;
+	int ret;
+
+	ret = uring_wait(ra->ring, &user_data, &res);
+	if (ret < 0)
+		return ret;
+	ra->in_flight--;
+
+	slot = &ra->slots[user_data];
+	len = backed_block_len(slot->bb);
+
+	if (res < 0) {
+		readahead_finish(slot, res);
+	} else if (slot->fd < 0) {
+		/* the file is open, read it */
+		slot->fd = res;
+		readahead_read(ra, user_data);
+	} else if (res == 0) {
+		/* the file shrank since its blocks were allocated */
+		readahead_finish(slot, -EIO);
+	} else {
+		slot->done += res;
+		if (slot->done < len)
+			readahead_read(ra, user_data);
+		else
+			readahead_finish(slot, 0);
+	}
+
+	return 0;
+}
+
+static void readahead_destroy(struct readahead *ra)
+{
+	struct readahead_slot *slot;
+
+	while (ra->in_flight)
+		if (readahead_complete(ra) < 0)
+			break;
+
+	while (ra->count) {
+		slot = &ra->slots[ra->head];
+		if (!slot->complete)
+			readahead_finish(slot, 0);
+		free(slot->buf);
+		ra->head = (ra->head + 1) % READAHEAD_SLOTS;
+		ra->count--;
+	}
+
+	uring_free(ra->ring);
+	free(ra);
+}
+
+/* Writes bb from the read-ahead buffers if it was read ahead */
+static int readahead_write_block(struct readahead *ra,
+				 struct output_file *out,
+				 struct backed_block *bb)
+{
+	struct readahead_slot *slot = &ra->slots[ra->head];
+	int ret;
+
+	if (!ra->count || slot->bb != bb)
+		return sparse_file_write_block(out, bb);
+
+	while (!slot->complete) {
+		ret = readahead_complete(ra);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = slot->err;
+	if (!ret)
+		ret = write_data_chunk(out, backed_block_len(bb), slot->buf);
+
+	free(slot->buf);
+	slot->buf = NULL;
+	ra->bytes -= backed_block_len(bb);
+	ra->head = (ra->head + 1) % READAHEAD_SLOTS;
+	ra->count--;
+
+	readahead_fill(ra);
+
+	return ret;
+}
+
 static int write_all_blocks(struct sparse_file *s, struct output_file *out)
 {
 	struct backed_block *bb;
-	unsigned int last_block = 0;
+	struct readahead *ra = NULL;
+	uint64_t last_block = 0;
 	int64_t pad;
 	int ret = 0;
 
+	if (s->async_io) {
+		ra = readahead_new(s);
+		if (ra)
+			readahead_fill(ra);
+	}
+
 	for (bb = backed_block_iter_new(s->backed_block_list); bb;
 	     bb = backed_block_iter_next(bb)) {
 		if (backed_block_block(bb) > last_block) {
-			unsigned int blocks =
+			uint64_t blocks =
 			    backed_block_block(bb) - last_block;
 			write_skip_chunk(out, (int64_t)blocks * s->block_size);
 		}
-		ret = sparse_file_write_block(out, bb);
+		if (ra)
+			ret = readahead_write_block(ra, out, bb);
+		else
+			ret = sparse_file_write_block(out, bb);
 		if (ret)
-			return ret;
+			goto out;
 		last_block = backed_block_block(bb) +
 		    DIV_ROUND_UP(backed_block_len(bb), s->block_size);
 	}
@@ -162,7 +414,11 @@ static int write_all_blocks(struct sparse_file *s, struct output_file *out)
 		write_skip_chunk(out, pad);
 	}
 
-	return 0;
+out:
+	if (ra)
+		readahead_destroy(ra);
+
+	return ret;
 }
 
 int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
@@ -346,3 +602,8 @@ void sparse_file_verbose(struct sparse_file *s)
 {
 	s->verbose = true;
 }
+
+void sparse_file_async_io(struct sparse_file *s)
+{
+	s->async_io = true;
+}
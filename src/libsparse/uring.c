@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct uring {
+	int fd;
+	unsigned int entries;
+	unsigned int pending;	/* queued, not yet submitted */
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+
+	uint8_t supported[IORING_OP_LAST];
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+				 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_probe(struct uring *ring)
+{
+	struct io_uring_probe *probe;
+	size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	int i;
+
+	probe = calloc(1, len);
+	if (!probe)
+		return;
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256)
+	    == 0) {
+		for (i = 0; i < probe->ops_len; i++)
+			if (probe->ops[i].op < IORING_OP_LAST &&
+			    probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+				ring->supported[probe->ops[i].op] = 1;
+	}
+
+	free(probe);
+}
+
+struct uring *uring_new(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+	char *sq;
+	char *cq;
+
+	ring = calloc(1, sizeof(struct uring));
+	if (!ring)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+	ring->entries = p.sq_entries;
+
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_len =
+	    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_len > ring->sq_ring_len)
+			ring->sq_ring_len = ring->cq_ring_len;
+		ring->cq_ring_len = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err_close;
+
+	if (ring->cq_ring_len) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_len,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err_unmap_sq;
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	uring_probe(ring);
+
+	return ring;
+
+err_unmap_cq:
+	if (ring->cq_ring_len)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+err_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_len);
+err_close:
+	close(ring->fd);
+	free(ring);
+	return NULL;
+}
+
+void uring_free(struct uring *ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring_len)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+	free(ring);
+}
+
+int uring_supported(struct uring *ring, enum uring_op op)
+{
+	switch (op) {
+	case URING_OP_STATX:
+		return ring->supported[IORING_OP_STATX];
+	case URING_OP_OPENAT:
+		return ring->supported[IORING_OP_OPENAT];
+	case URING_OP_READ:
+		return ring->supported[IORING_OP_READ];
+	}
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= ring->entries)
+		return NULL;
+
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+
+	return sqe;
+}
+
+static void uring_queue(struct uring *ring)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+}
+
+int uring_prep_statx(struct uring *ring, int dirfd, const char *path,
+		     int flags, unsigned int mask, struct statx *buf,
+		     uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = mask;
+	sqe->off = (uintptr_t)buf;
+	sqe->statx_flags = flags;
+	sqe->user_data = user_data;
+	uring_queue(ring);
+
+	return 0;
+}
+
+int uring_prep_openat(struct uring *ring, int dirfd, const char *path,
+		      int flags, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->open_flags = flags;
+	sqe->user_data = user_data;
+	uring_queue(ring);
+
+	return 0;
+}
+
+int uring_prep_read(struct uring *ring, int fd, void *buf, unsigned int len,
+		    int64_t offset, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	uring_queue(ring);
+
+	return 0;
+}
+
+int uring_wait(struct uring *ring, uint64_t *user_data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	unsigned int tail;
+	int ret;
+
+	for (;;) {
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if (head != tail) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			*user_data = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(ring->cq_head, head + 1,
+					 __ATOMIC_RELEASE);
+			return 0;
+		}
+
+		ret = sys_io_uring_enter(ring->fd, ring->pending, 1,
+					 IORING_ENTER_GETEVENTS);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		ring->pending -= ret;
+	}
+}
+
+#else
+
+struct uring *uring_new(unsigned int entries)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void uring_free(struct uring *ring)
+{
+}
+
+int uring_supported(struct uring *ring, enum uring_op op)
+{
+	return 0;
+}
+
+int uring_prep_statx(struct uring *ring, int dirfd, const char *path,
+		     int flags, unsigned int mask, struct statx *buf,
+		     uint64_t user_data)
+{
+	return -ENOSYS;
+}
+
+int uring_prep_openat(struct uring *ring, int dirfd, const char *path,
+		      int flags, uint64_t user_data)
+{
+	return -ENOSYS;
+}
+
+int uring_prep_read(struct uring *ring, int fd, void *buf, unsigned int len,
+		    int64_t offset, uint64_t user_data)
+{
+	return -ENOSYS;
+}
+
+int uring_wait(struct uring *ring, uint64_t *user_data, int *res)
+{
+	return -ENOSYS;
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_URING_H_
+#define _LIBSPARSE_URING_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * A minimal io_uring wrapper, talking to the kernel with raw system calls.
+ *
+ * A ring may only be used by one thread at a time.  The uring_prep_*()
+ * functions queue a request and return -EBUSY if the submission queue is
+ * full; call uring_wait() to submit what is queued and reap a completion.
+ * Where io_uring is not available at build time or at run time, uring_new()
+ * returns NULL and callers are expected to fall back to plain system calls.
+ */
+
+struct uring;
+struct statx;
+
+enum uring_op {
+	URING_OP_STATX,
+	URING_OP_OPENAT,
+	URING_OP_READ,
+};
+
+struct uring *uring_new(unsigned int entries);
+void uring_free(struct uring *ring);
+int uring_supported(struct uring *ring, enum uring_op op);
+
+int uring_prep_statx(struct uring *ring, int dirfd, const char *path,
+		     int flags, unsigned int mask, struct statx *buf,
+		     uint64_t user_data);
+int uring_prep_openat(struct uring *ring, int dirfd, const char *path,
+		      int flags, uint64_t user_data);
+int uring_prep_read(struct uring *ring, int fd, void *buf, unsigned int len,
+		    int64_t offset, uint64_t user_data);
+
+/* Submits queued requests and waits for one completion.  There must be at
+   least one request queued or in flight. */
+int uring_wait(struct uring *ring, uint64_t *user_data, int *res);
+
+#endif
@@ -16,14 +16,18 @@
 
 #include "ext4_utils.h"
 #include "allocate.h"
+#include "archive.h"
 #include "contents.h"
+#include "dedup.h"
+#include "hardlink.h"
+#include "layout.h"
+#include "scan.h"
 #include "uuid5.h"
 #include "wipe.h"
 
 #include <sparse/sparse.h>
 
 #include <assert.h>
-#include <dirent.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
@@ -33,17 +37,6 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <locale.h>
-
-/* TODO: Not implemented:
-   Allocating blocks in the same block group as the file inode
-   Hash or binary tree directories
- */
-
-static int filter_dot(const struct dirent *d)
-{
-	return (strcmp(d->d_name, "..") && strcmp(d->d_name, "."));
-}
 
 static u32 build_default_directory_structure(struct fs_info *info,
 					     struct fs_aux_info *aux_info,
@@ -63,9 +56,9 @@ static u32 build_default_directory_structure(struct fs_info *info,
 		.mtime = (fixed_time != -1) ? fixed_time : 0,
 	};
 	root_inode = make_directory(info, aux_info, ext4_sparse_file, force,
-				    setjmp_env, 0, 1, &dentries, 1);
+				    setjmp_env, 0, 1, &dentries, 1, 1);
 	inode = make_directory(info, aux_info, ext4_sparse_file, force,
-			       setjmp_env, root_inode, 0, NULL, 0);
+			       setjmp_env, root_inode, 0, NULL, 0, 0);
 	*dentries.inode = inode;
 	inode_set_permissions(info, aux_info, ext4_sparse_file, setjmp_env,
 			      inode, dentries.mode, dentries.uid, dentries.gid,
@@ -74,258 +67,357 @@ static u32 build_default_directory_structure(struct fs_info *info,
 	return root_inode;
 }
 
-/* Read a local directory and create the same tree in the generated filesystem.
-   Calls itself recursively with each directory in the given directory.
-   full_path is an absolute or relative path, with a trailing slash, to the
-   directory on disk that should be copied, or NULL if this is a directory
-   that does not exist on disk (e.g. lost+found).
-   dir_path is an absolute path, with trailing slash, to the same directory
-   if the image were mounted at the specified mount point */
-static u32 build_directory_structure(struct fs_info *info,
-				     struct fs_aux_info *aux_info,
-				     struct sparse_file *ext4_sparse_file,
-				     struct block_allocation
-				     *saved_allocation_head,
-				     struct fs_config_list *config_list,
-				     int force, jmp_buf *setjmp_env,
-				     const char *full_path,
-				     const char *dir_path,
-				     u32 dir_inode,
-				     fs_config_func_t fs_config_func,
-				     int verbose, time_t fixed_time)
+/* Scratch buffer for the paths of source files, reused for every file */
+struct source_path {
+	const char *directory;
+	size_t dir_len;
+	char *buf;
+	size_t alloc;
+	struct data_source data;	/* file data of an archive, or fd -1 */
+	u8 *inline_buf;		/* inline_data_max() bytes, or NULL */
+};
+
+/* Returns the path of name in dir, in the source tree.  The path relative
+   to the source directory starts at offset sp->dir_len. */
+static const char *source_path(struct source_path *sp, jmp_buf *setjmp_env,
+			       struct dentry *dir, const char *name)
 {
-	int entries = 0;
-	struct dentry *dentries;
-	struct dirent **namelist = NULL;
-	struct stat stat;
-	int ret;
-	int i;
+	size_t path_len = strlen(dir->path);
+	size_t name_len = strlen(name);
+	size_t len = sp->dir_len + path_len + 1 + name_len + 1;
+	char *p;
+
+	if (len > sp->alloc) {
+		p = realloc(sp->buf, len);
+		if (!p)
+			critical_error(setjmp_env, "realloc(%zu)", len);
+		sp->buf = p;
+		sp->alloc = len;
+	}
+
+	p = sp->buf;
+	memcpy(p, sp->directory, sp->dir_len);
+	p += sp->dir_len;
+	memcpy(p, dir->path, path_len);
+	p += path_len;
+	if (path_len)
+		*p++ = '/';
+	memcpy(p, name, name_len + 1);
+
+	return sp->buf;
+}
+
+/* Reads the contents of a file small enough to be stored in its inode
+   into sp->inline_buf.  Returns 0, or -1 if the file could not be read, in
+   which case it is left to make_file() to report. */
+static int read_inline_data(struct source_path *sp, const char *path,
+			    struct dentry *dentry)
+{
+	size_t got = 0;
+	ssize_t ret;
+	int fd = sp->data.fd;
+
+	if (fd < 0) {
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return -1;
+	}
+
+	while (got < dentry->size) {
+		if (sp->data.fd >= 0)
+			ret = data_source_pread(&sp->data,
+						sp->inline_buf + got,
+						dentry->size - got,
+						dentry->data_offset + got);
+		else
+			ret = read(fd, sp->inline_buf + got,
+				   dentry->size - got);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		got += ret;
+	}
+
+	if (sp->data.fd < 0)
+		close(fd);
+
+	return got == dentry->size ? 0 : -1;
+}
+
+/* Returns whether a file has the same bytes as the first file created with
+   its contents, whose blocks it is about to share */
+static int same_as_dedup(struct source_path *sp, const char *path,
+			 struct dentry *dentry)
+{
+	struct dedup *dup = dentry->dedup;
+	struct data_source src = sp->data;
+	struct data_source first = sp->data;
+	int same;
+
+	if (sp->data.fd < 0) {
+		src.fd = open(path, O_RDONLY | O_CLOEXEC);
+		first.fd = open(dup->path, O_RDONLY | O_CLOEXEC);
+	}
+
+	same = src.fd >= 0 && first.fd >= 0 &&
+	    dedup_same_data(&src, dentry->data_offset, &first,
+			    dup->data_offset, dentry->size);
+
+	if (sp->data.fd < 0) {
+		if (src.fd >= 0)
+			close(src.fd);
+		if (first.fd >= 0)
+			close(first.fd);
+	}
+
+	return same;
+}
+
+/* Creates a regular file, sharing the blocks of an identical file or
+   storing it in its inode when possible.  Returns the inode number. */
+static u32 build_file(struct fs_info *info, struct fs_aux_info *aux_info,
+		      struct sparse_file *ext4_sparse_file,
+		      struct block_allocation *saved_allocation_head,
+		      int force, jmp_buf *setjmp_env, struct source_path *sp,
+		      struct dentry *dir, struct dentry *dentry)
+{
+	u32 inline_max = sp->inline_buf ? inline_data_max(info) : 0;
+	struct block_allocation *saved = saved_allocation_head->next;
+	const char *path;
 	u32 inode;
-	u32 entry_inode;
-	u32 dirs = 0;
-	bool needs_lost_and_found = false;
-
-	/* alphasort is locale-dependent; let's fix the locale to some sane value */
-	setlocale(LC_COLLATE, "C");
-
-	if (full_path) {
-		entries =
-		    scandir(full_path, &namelist, filter_dot,
-			    (void *)alphasort);
-		if (entries < 0) {
-#ifdef __GLIBC__
-			/* The scandir function implemented in glibc has a bug that makes it
-			   erroneously fail with ENOMEM under certain circumstances.
-			   As a workaround we can retry the scandir call with the same arguments.
-			   GLIBC BZ: https://sourceware.org/bugzilla/show_bug.cgi?id=17804 */
-			if (errno == ENOMEM)
-				entries =
-				    scandir(full_path, &namelist, filter_dot,
-					    (void *)alphasort);
-#endif
-			if (entries < 0) {
-				error_errno(force, setjmp_env, "scandir");
-				return EXT4_ALLOCATE_FAILED;
-			}
-		}
+
+	path = source_path(sp, setjmp_env, dir, dentry->filename);
+
+	/* a file that only hashes the same is stored on its own */
+	if (dentry->dedup && dentry->dedup->inode &&
+	    !same_as_dedup(sp, path, dentry))
+		dentry->dedup = NULL;
+
+	if (dentry->dedup && dentry->dedup->inode) {
+		/* the same contents as a file already in the image */
+		inode = make_shared_file(info, aux_info, ext4_sparse_file,
+					 saved_allocation_head, force,
+					 setjmp_env, path, dentry->dedup->inode,
+					 dentry->dedup->alloc);
+		if (inode)
+			return inode;
 	}
 
-	if (dir_inode == 0) {
-		/* root directory, check if lost+found already exists */
-		for (i = 0; i < entries; i++)
-			if (strcmp(namelist[i]->d_name, "lost+found") == 0)
-				break;
-		if (i == entries)
-			needs_lost_and_found = true;
+	if (dentry->size > 0 && dentry->size <= inline_max &&
+	    !dentry->capabilities && read_inline_data(sp, path, dentry) == 0)
+		return make_inline_file(info, aux_info, ext4_sparse_file,
+					force, setjmp_env, sp->inline_buf,
+					dentry->size);
+
+	inode = make_file(info, aux_info, ext4_sparse_file,
+			  saved_allocation_head, force, setjmp_env, path,
+			  sp->data.fd >= 0 ? &sp->data : NULL,
+			  dentry->data_offset, dentry->size,
+			  dentry->ranges,
+			  dentry->holes ? (int)dentry->nr_ranges : -1);
+	if (dentry->dedup) {
+		dentry->dedup->inode = inode;
+		dentry->dedup->data_offset = dentry->data_offset;
+		if (sp->data.fd < 0) {
+			free(dentry->dedup->path);
+			dentry->dedup->path = strdup(path);
+			if (!dentry->dedup->path)
+				critical_error_errno(setjmp_env, "strdup");
+		}
+		/* make_file() puts the blocks of a file first in the list,
+		   unless it has none */
+		if (saved_allocation_head->next != saved)
+			dentry->dedup->alloc = saved_allocation_head->next;
 	}
 
-	dentries = calloc(entries, sizeof(struct dentry));
-	if (dentries == NULL)
-		critical_error_errno(setjmp_env, "calloc(%zu, %zu)",
-				     (size_t)entries, sizeof(struct dentry));
+	return inode;
+}
 
-	for (i = 0; i < entries; i++) {
-		dentries[i].filename = strdup(namelist[i]->d_name);
-		if (dentries[i].filename == NULL)
-			critical_error_errno(setjmp_env, "strdup");
+/* Sets the permissions and capabilities of a new inode from its dentry */
+static void set_attributes(struct fs_info *info, struct fs_aux_info *aux_info,
+			   struct sparse_file *ext4_sparse_file, int force,
+			   jmp_buf *setjmp_env, struct source_path *sp,
+			   struct dentry *dir, struct dentry *dentry, u32 inode)
+{
+	int ret;
 
-		asprintf(&dentries[i].path, "%s%s", dir_path,
-			 namelist[i]->d_name);
-		asprintf(&dentries[i].full_path, "%s%s", full_path,
-			 namelist[i]->d_name);
+	ret = inode_set_permissions(info, aux_info, ext4_sparse_file,
+				    setjmp_env, inode, dentry->mode,
+				    dentry->uid, dentry->gid, dentry->mtime);
+	if (ret)
+		error(force, setjmp_env, "failed to set permissions on %s",
+		      source_path(sp, setjmp_env, dir,
+				  dentry->filename) + sp->dir_len);
+
+	ret = inode_set_capabilities(info, aux_info, ext4_sparse_file, force,
+				     setjmp_env, inode, dentry->capabilities);
+	if (ret)
+		error(force, setjmp_env, "failed to set capability on %s",
+		      source_path(sp, setjmp_env, dir,
+				  dentry->filename) + sp->dir_len);
+}
+
+/* Creates the regular files of a layout order list ahead of the rest of
+   the tree, so that their data is laid out in the order of the list, each
+   file after the one before it, or with planned set, each in the block
+   group it fits best.  The walk of the tree then only links them into
+   their directories. */
+static void build_layout_files(struct fs_info *info,
+			       struct fs_aux_info *aux_info,
+			       struct sparse_file *ext4_sparse_file,
+			       struct block_allocation *saved_allocation_head,
+			       int force, jmp_buf *setjmp_env,
+			       struct source_path *sp,
+			       struct layout_file *files, int nr, int planned)
+{
+	struct dentry *dentry;
+	u32 blocks;
+	u32 bg = 0;
+	u32 next;
+	u32 inode;
+	int i;
 
-		free(namelist[i]);
+	for (i = 0; i < nr; i++) {
+		dentry = files[i].dentry;
 
-		ret = lstat(dentries[i].full_path, &stat);
-		if (ret < 0) {
-			error_errno(force, setjmp_env, "lstat");
-			i--;
-			entries--;
+		/* listed twice, or another name of a file already made */
+		if (dentry->layout_inode ||
+		    (dentry->hardlink && dentry->hardlink->inode))
 			continue;
-		}
 
-		dentries[i].size = stat.st_size;
-		dentries[i].mode =
-		    stat.st_mode & (S_ISUID | S_ISGID | S_ISVTX | S_IRWXU |
-				    S_IRWXG | S_IRWXO);
-		if (fixed_time == -1) {
-			dentries[i].mtime = stat.st_mtime;
+		blocks = DIV_ROUND_UP(dentry->size, info->block_size);
+		if (planned) {
+			/* with the block that an extent tree may need */
+			set_alloc_goal_fit(aux_info, blocks + 1);
 		} else {
-			dentries[i].mtime = fixed_time;
-		}
-		uint64_t capabilities;
-		if (fs_config_func != NULL) {
-			unsigned int mode = 0;
-			unsigned int uid = 0;
-			unsigned int gid = 0;
-			int dir = S_ISDIR(stat.st_mode);
-			if (fs_config_func(config_list, dentries[i].path, dir,
-					   &uid, &gid, &mode, &capabilities)) {
-				dentries[i].mode = mode;
-				dentries[i].uid = uid;
-				dentries[i].gid = gid;
-				dentries[i].capabilities = capabilities;
-			}
+			/* fill the block groups in order, moving on to the
+			   next one that has room when a file does not fit */
+			for (next = bg; next < aux_info->groups; next++)
+				if (get_free_blocks(aux_info, next) >= blocks)
+					break;
+			if (next < aux_info->groups)
+				bg = next;
+			aux_info->goal_bg = bg;
 		}
 
-		if (S_ISREG(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_REG_FILE;
-		} else if (S_ISDIR(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_DIR;
-			dirs++;
-		} else if (S_ISCHR(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_CHRDEV;
-		} else if (S_ISBLK(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_BLKDEV;
-		} else if (S_ISFIFO(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_FIFO;
-		} else if (S_ISSOCK(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_SOCK;
-		} else if (S_ISLNK(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_SYMLINK;
-			dentries[i].link = calloc(info->block_size, 1);
-			if (!dentries[i].link) {
-				critical_error(setjmp_env, "calloc(%zu, 1)",
-					       (size_t)info->block_size);
-			}
-			readlink(dentries[i].full_path, dentries[i].link,
-				 info->block_size - 1);
-		} else {
-			error(force, setjmp_env, "unknown file type on %s",
-			      dentries[i].path);
-			i--;
-			entries--;
-		}
+		inode = build_file(info, aux_info, ext4_sparse_file,
+				   saved_allocation_head, force, setjmp_env,
+				   sp, files[i].dir, dentry);
+		dentry->layout_inode = inode;
+		if (dentry->hardlink)
+			dentry->hardlink->inode = inode;
+
+		set_attributes(info, aux_info, ext4_sparse_file, force,
+			       setjmp_env, sp, files[i].dir, dentry, inode);
 	}
-	free(namelist);
-
-	if (needs_lost_and_found) {
-		/* insert a lost+found directory at the beginning of the dentries */
-		struct dentry *tmp = calloc(entries + 1, sizeof(struct dentry));
-		if (!tmp) {
-			critical_error(setjmp_env, "calloc(%zu, %zu)",
-				       (size_t)entries + 1,
-				       sizeof(struct dentry));
-		}
-		memset(tmp, 0, sizeof(struct dentry));
-		memcpy(tmp + 1, dentries, entries * sizeof(struct dentry));
-		dentries = tmp;
-
-		dentries[0].filename = strdup("lost+found");
-		asprintf(&dentries[0].path, "%slost+found", dir_path);
-		dentries[0].full_path = NULL;
-		dentries[0].size = 0;
-		dentries[0].mode = S_IRWXU;
-		dentries[0].file_type = EXT4_FT_DIR;
-		dentries[0].uid = 0;
-		dentries[0].gid = 0;
-		entries++;
-		dirs++;
+}
+
+/* Create the tree read by scan_directory_tree() in the generated filesystem.
+   Calls itself recursively with each directory in the given directory.
+   dir is the dentry of the directory to create; its dentries array holds
+   the directory's entries in sorted order, or is NULL if this is a
+   directory that does not exist on disk (e.g. lost+found). */
+static u32 build_directory_structure(struct fs_info *info,
+				     struct fs_aux_info *aux_info,
+				     struct sparse_file *ext4_sparse_file,
+				     struct block_allocation
+				     *saved_allocation_head,
+				     int force, jmp_buf *setjmp_env,
+				     struct source_path *sp,
+				     struct dentry *dir, u32 dir_inode,
+				     int verbose)
+{
+	struct dentry *dentries = dir->dentries;
+	u32 entries = dir->entries;
+	struct scan_error *scan_error;
+	u32 i;
+	u32 inode;
+	u32 entry_inode;
+	int inline_ok;
+
+	for (scan_error = dir->scan_errors; scan_error;
+	     scan_error = scan_error->next)
+		error(force, setjmp_env, "%s", scan_error->msg);
+	free_scan_errors(dir);
+
+	if (dir->scan_errno) {
+		errno = dir->scan_errno;
+		error_errno(force, setjmp_env, "opendir %s%s", sp->directory,
+			    dir->path);
+		return EXT4_ALLOCATE_FAILED;
 	}
 
+	/* e2fsck wants lost+found in blocks it can add entries to, and
+	   system.data has to come after any security.capability */
+	inline_ok = !dir->capabilities &&
+	    !(dir_inode == EXT4_ROOT_INO && dir->filename &&
+	      !strcmp(dir->filename, "lost+found"));
 	inode = make_directory(info, aux_info, ext4_sparse_file, force,
-			       setjmp_env, dir_inode, entries, dentries, dirs);
+			       setjmp_env, dir_inode, entries, dentries,
+			       dir->dirs, inline_ok);
 
 	for (i = 0; i < entries; i++) {
+		/* already made by build_layout_files() */
+		if (dentries[i].layout_inode) {
+			*dentries[i].inode = dentries[i].layout_inode;
+			continue;
+		}
+
+		/* keep files in the block group of their directory, which the
+		   directories made before this entry moved away from */
+		set_alloc_goal(info, aux_info, inode);
+
+		/* a further name of a file that is already in the image; the
+		   permissions of the first name created are the ones kept */
+		if (dentries[i].hardlink && dentries[i].hardlink->inode &&
+		    inode_add_link(info, aux_info, ext4_sparse_file,
+				   setjmp_env,
+				   dentries[i].hardlink->inode) == 0) {
+			*dentries[i].inode = dentries[i].hardlink->inode;
+			continue;
+		}
+
 		if (dentries[i].file_type == EXT4_FT_REG_FILE) {
-			entry_inode = make_file(info, aux_info,
-						ext4_sparse_file,
-						saved_allocation_head,
-						force, setjmp_env,
-						dentries[i].full_path,
-						dentries[i].size);
+			entry_inode = build_file(info, aux_info,
+						 ext4_sparse_file,
+						 saved_allocation_head, force,
+						 setjmp_env, sp, dir,
+						 &dentries[i]);
 		} else if (dentries[i].file_type == EXT4_FT_DIR) {
-			char *subdir_full_path = NULL;
-			char *subdir_dir_path;
-			if (dentries[i].full_path) {
-				ret =
-				    asprintf(&subdir_full_path, "%s/",
-					     dentries[i].full_path);
-				if (ret < 0)
-					critical_error_errno(setjmp_env,
-							     "asprintf");
-			}
-			ret =
-			    asprintf(&subdir_dir_path, "%s/", dentries[i].path);
-			if (ret < 0)
-				critical_error_errno(setjmp_env, "asprintf");
 			entry_inode = build_directory_structure(info, aux_info,
 								ext4_sparse_file,
 								saved_allocation_head,
-								config_list,
 								force,
 								setjmp_env,
-								subdir_full_path,
-								subdir_dir_path,
+								sp,
+								&dentries[i],
 								inode,
-								fs_config_func,
-								verbose,
-								fixed_time);
-			free(subdir_full_path);
-			free(subdir_dir_path);
+								verbose);
 		} else if (dentries[i].file_type == EXT4_FT_SYMLINK) {
 			entry_inode = make_link(info, aux_info,
 						ext4_sparse_file, force,
 						setjmp_env, dentries[i].link);
-		} else if (dentries[i].file_type == EXT4_FT_CHRDEV ||
-			   dentries[i].file_type == EXT4_FT_BLKDEV ||
-			   dentries[i].file_type == EXT4_FT_SOCK ||
-			   dentries[i].file_type == EXT4_FT_FIFO) {
+		} else {
 			entry_inode = make_special(info, aux_info,
 						   ext4_sparse_file, force,
 						   setjmp_env,
-						   dentries[i].full_path);
-		} else {
-			error(force, setjmp_env, "unknown file type on %s",
-			      dentries[i].path);
-			entry_inode = 0;
+						   dentries[i].file_type,
+						   dentries[i].rdev);
 		}
 		*dentries[i].inode = entry_inode;
+		if (dentries[i].hardlink)
+			dentries[i].hardlink->inode = entry_inode;
 
-		ret = inode_set_permissions(info, aux_info, ext4_sparse_file,
-					    setjmp_env, entry_inode,
-					    dentries[i].mode, dentries[i].uid,
-					    dentries[i].gid, dentries[i].mtime);
-		if (ret)
-			error(force, setjmp_env,
-			      "failed to set permissions on %s",
-			      dentries[i].path);
-
-		ret = inode_set_capabilities(info, aux_info, ext4_sparse_file,
-					     force, setjmp_env, entry_inode,
-					     dentries[i].capabilities);
-		if (ret)
-			error(force, setjmp_env,
-			      "failed to set capability on %s",
-			      dentries[i].path);
-
-		free(dentries[i].path);
-		free(dentries[i].full_path);
-		free(dentries[i].link);
-		free((void *)dentries[i].filename);
+		set_attributes(info, aux_info, ext4_sparse_file, force,
+			       setjmp_env, sp, dir, &dentries[i], entry_inode);
 	}
 
+	/* the dentries and all of their strings are a single allocation */
+	for (i = 0; i < entries; i++)
+		free(dentries[i].ranges);
 	free(dentries);
+	dir->dentries = NULL;
 	return inode;
 }
 
@@ -336,7 +428,7 @@ static u32 compute_block_size(void)
 
 static u32 compute_journal_blocks(struct fs_info *info)
 {
-	u32 journal_blocks = DIV_ROUND_UP(info->len, info->block_size) / 64;
+	u64 journal_blocks = DIV_ROUND_UP(info->len, info->block_size) / 64;
 	if (journal_blocks < 1024)
 		journal_blocks = 1024;
 	if (journal_blocks > 32768)
@@ -351,14 +443,58 @@ static u32 compute_blocks_per_group(struct fs_info *info)
 
 static u32 compute_inodes(struct fs_info *info)
 {
-	return DIV_ROUND_UP(info->len, info->block_size) / 4;
+	u64 inodes = DIV_ROUND_UP(info->len, info->block_size) / 4;
+
+	/* inode numbers are 32 bit, also with 64bit */
+	return min(inodes, (u64)UINT32_MAX);
+}
+
+/* Inodes the files of a scanned directory take, counting the names of a
+   hard linked file as one */
+static u64 count_tree_inodes(const struct dentry *dir)
+{
+	u64 inodes = 0;
+	u32 i;
+
+	for (i = 0; i < dir->entries; i++) {
+		if (!dir->dentries[i].hardlink)
+			inodes++;
+		if (dir->dentries[i].file_type == EXT4_FT_DIR)
+			inodes += count_tree_inodes(&dir->dentries[i]);
+	}
+
+	return inodes;
+}
+
+/* Just the inodes a source tree needs, and headroom percent more */
+static u32 compute_inodes_auto(struct fs_info *info, const struct dentry *root,
+			       const struct hardlink_table *hardlinks,
+			       int verbose)
+{
+	u64 inodes;
+
+	/* the scan adds lost+found, which is all there is without a tree */
+	if (root->dentries)
+		inodes = count_tree_inodes(root) + hardlinks->table.used;
+	else
+		inodes = 1;
+	if (verbose)
+		printf("Source tree needs %" PRIu64 " inodes\n", inodes);
+
+	inodes += EXT4_GOOD_OLD_FIRST_INO - 1;
+	inodes += DIV_ROUND_UP(inodes * info->inodes_headroom, 100);
+
+	return min(inodes, (u64)UINT32_MAX);
 }
 
 static u32 compute_inodes_per_group(struct fs_info *info)
 {
-	u32 blocks = DIV_ROUND_UP(info->len, info->block_size);
+	u64 blocks = DIV_ROUND_UP(info->len, info->block_size);
 	u32 block_groups = DIV_ROUND_UP(blocks, info->blocks_per_group);
 	u32 inodes = DIV_ROUND_UP(info->inodes, block_groups);
+	/* whole bytes of the inode bitmap, as e2fsck and the kernel expect,
+	   and whole blocks of the inode table; both are powers of 2 */
+	inodes = EXT4_ALIGN(inodes, 8);
 	inodes = EXT4_ALIGN(inodes, (info->block_size / info->inode_size));
 
 	/* After properly rounding up the number of inodes/group,
@@ -371,14 +507,15 @@ static u32 compute_inodes_per_group(struct fs_info *info)
 
 static u32 compute_bg_desc_reserve_blocks(struct fs_info *info)
 {
-	u32 blocks = DIV_ROUND_UP(info->len, info->block_size);
+	u64 blocks = DIV_ROUND_UP(info->len, info->block_size);
 	u32 block_groups = DIV_ROUND_UP(blocks, info->blocks_per_group);
+	u32 desc_size = (info->feat_incompat & EXT4_FEATURE_INCOMPAT_64BIT) ?
+	    EXT4_MIN_DESC_SIZE_64BIT : sizeof(struct ext2_group_desc);
 	u32 bg_desc_blocks =
-	    DIV_ROUND_UP(block_groups * sizeof(struct ext2_group_desc),
-			 info->block_size);
+	    DIV_ROUND_UP((u64)block_groups * desc_size, info->block_size);
 
 	u32 bg_desc_reserve_blocks =
-	    DIV_ROUND_UP(block_groups * 1024 * sizeof(struct ext2_group_desc),
+	    DIV_ROUND_UP((u64)block_groups * 1024 * desc_size,
 			 info->block_size) - bg_desc_blocks;
 
 	if (bg_desc_reserve_blocks > info->block_size / sizeof(u32))
@@ -449,22 +586,58 @@ int make_ext4fs_internal(struct fs_info *info, struct fs_aux_info *aux_info,
 			 struct fs_config_list *config_list,
 			 int force, jmp_buf *setjmp_env,
 			 int uuid_user_specified, int fd,
-			 const char *_directory,
+			 const char *_directory, const char *archive,
 			 fs_config_func_t fs_config_func, int gzip, int sparse,
 			 int crc, int wipe, int verbose, time_t fixed_time,
-			 FILE *block_list_file)
+			 FILE *block_list_file, int scan_threads, int async_io,
+			 int dedup, int zero_blocks, const char *layout_order,
+			 int plan)
 {
 	u32 root_inode_num;
 	u16 root_mode;
 	char *directory = NULL;
+	struct dentry root;
+	struct source_path sp;
+	struct hardlink_table hardlinks;
+	struct dedup_table dedups;
 	char buf[40];
+	int ret;
 
 	if (setjmp(*setjmp_env))
 		return EXIT_FAILURE;	/* Handle a call to longjmp() */
 
-	if (_directory)
+	memset(&root, 0, sizeof(root));
+	memset(&sp, 0, sizeof(sp));
+	sp.data.fd = -1;
+	hardlink_table_init(&hardlinks);
+	dedup_table_init(&dedups);
+
+	/* the scan needs the block size to find the blocks that hold data */
+	if (info->block_size <= 0)
+		info->block_size = compute_block_size();
+
+	if (_directory) {
 		directory = canonicalize_rel_slashes(setjmp_env, _directory);
 
+		root.path = "";
+		root.file_type = EXT4_FT_DIR;
+		ret = scan_directory_tree(config_list, fs_config_func,
+					  fixed_time, scan_threads, async_io,
+					  directory, &hardlinks,
+					  dedup ? &dedups : NULL,
+					  info->block_size, zero_blocks,
+					  &root);
+		if (ret < 0) {
+			errno = -ret;
+			critical_error_errno(setjmp_env, "scan_directory_tree");
+		}
+	} else if (archive) {
+		read_archive(config_list, fs_config_func, fixed_time, force,
+			     setjmp_env, archive, &hardlinks,
+			     dedup ? &dedups : NULL, info->block_size,
+			     zero_blocks, &root, &sp.data);
+	}
+
 	if (info->len <= 0)
 		info->len = get_file_size(info, fd);
 
@@ -475,9 +648,6 @@ int make_ext4fs_internal(struct fs_info *info, struct fs_aux_info *aux_info,
 
 	ftruncate(fd, 0);
 
-	if (info->block_size <= 0)
-		info->block_size = compute_block_size();
-
 	/* Round down the filesystem length to be a multiple of the block size */
 	info->len &= ~((u64)info->block_size - 1);
 
@@ -485,14 +655,17 @@ int make_ext4fs_internal(struct fs_info *info, struct fs_aux_info *aux_info,
 		info->journal_blocks = compute_journal_blocks(info);
 
 	if (info->no_journal == 0)
-		info->feat_compat = EXT4_FEATURE_COMPAT_HAS_JOURNAL;
+		info->feat_compat |= EXT4_FEATURE_COMPAT_HAS_JOURNAL;
 	else
 		info->journal_blocks = 0;
 
 	if (info->blocks_per_group <= 0)
 		info->blocks_per_group = compute_blocks_per_group(info);
 
-	if (info->inodes <= 0)
+	if (info->inodes_auto)
+		info->inodes = compute_inodes_auto(info, &root, &hardlinks,
+						   verbose);
+	else if (info->inodes <= 0)
 		info->inodes = compute_inodes(info);
 
 	if (info->inode_size <= 0)
@@ -503,17 +676,44 @@ int make_ext4fs_internal(struct fs_info *info, struct fs_aux_info *aux_info,
 
 	info->inodes_per_group = compute_inodes_per_group(info);
 
+	if (info->flex_bg_size == 0)
+		info->flex_bg_size = 16;
+
 	info->feat_compat |=
 	    EXT4_FEATURE_COMPAT_RESIZE_INODE | EXT4_FEATURE_COMPAT_EXT_ATTR;
 
 	info->feat_ro_compat |=
 	    EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER |
-	    EXT4_FEATURE_RO_COMPAT_LARGE_FILE | EXT4_FEATURE_RO_COMPAT_GDT_CSUM;
+	    EXT4_FEATURE_RO_COMPAT_LARGE_FILE;
+
+	/* metadata_csum replaces the crc16 of the group descriptors */
+	if (!ext4_has_metadata_csum(info))
+		info->feat_ro_compat |= EXT4_FEATURE_RO_COMPAT_GDT_CSUM;
+
+	/* files sharing blocks make the filesystem read-only for the kernel */
+	if (dedup)
+		info->feat_ro_compat |= EXT4_FEATURE_RO_COMPAT_SHARED_BLOCKS;
 
 	info->feat_incompat |=
 	    EXT4_FEATURE_INCOMPAT_EXTENTS | EXT4_FEATURE_INCOMPAT_FILETYPE;
 
-	info->bg_desc_reserve_blocks = compute_bg_desc_reserve_blocks(info);
+	/* block numbers over 32 bits need 64bit, and the resize inode only
+	   has room for 32 bit ones */
+	if (DIV_ROUND_UP(info->len, info->block_size) > UINT32_MAX) {
+		info->feat_incompat |= EXT4_FEATURE_INCOMPAT_64BIT;
+		info->feat_compat &= ~EXT4_FEATURE_COMPAT_RESIZE_INODE;
+	}
+
+	if ((info->feat_incompat & EXT4_FEATURE_INCOMPAT_INLINE_DATA) &&
+	    !inline_data_max(info)) {
+		fprintf(stderr, "Inline data needs inodes larger than %d bytes\n",
+			info->inode_size);
+		return EXIT_FAILURE;
+	}
+
+	if (info->feat_compat & EXT4_FEATURE_COMPAT_RESIZE_INODE)
+		info->bg_desc_reserve_blocks =
+		    compute_bg_desc_reserve_blocks(info);
 
 	if (!uuid_user_specified) {
 		uuid5_generate(info->uuid, "extandroid/make_ext4fs",
@@ -532,17 +732,29 @@ int make_ext4fs_internal(struct fs_info *info, struct fs_aux_info *aux_info,
 
 	ext4_init_fs_aux_info(info, aux_info, setjmp_env);
 
+	/* without meta_bg, the group descriptors are all in the first group */
+	if (ext4_bg_super_blocks(info, aux_info, 0) + 2 +
+	    aux_info->inode_table_blocks > info->blocks_per_group) {
+		fprintf(stderr, "Too many block groups for %d byte blocks\n",
+			info->block_size);
+		return EXIT_FAILURE;
+	}
+
 	printf("    Blocks: %" PRIu64 "\n", aux_info->len_blocks);
 	printf("    Block groups: %d\n", aux_info->groups);
+	if (info->feat_incompat & EXT4_FEATURE_INCOMPAT_FLEX_BG)
+		printf("    Block groups per flex group: %d\n",
+		       aux_info->groups_per_flex);
 	printf("    Reserved blocks: %" PRIu64 "\n",
 	       (aux_info->len_blocks / 100) * info->reserve_pcnt);
 	printf("    Reserved block group size: %d\n",
 	       info->bg_desc_reserve_blocks);
 
 	ext4_sparse_file = sparse_file_new(info->block_size, info->len);
+	if (async_io)
+		sparse_file_async_io(ext4_sparse_file);
 
-	block_allocator_init(info, aux_info, ext4_sparse_file, force,
-			     setjmp_env);
+	block_allocator_init(info, aux_info, force, setjmp_env);
 
 	ext4_fill_in_sb(info, aux_info, ext4_sparse_file, setjmp_env);
 
@@ -557,37 +769,84 @@ int make_ext4fs_internal(struct fs_info *info, struct fs_aux_info *aux_info,
 		ext4_create_resize_inode(info, aux_info, ext4_sparse_file,
 					 force, setjmp_env);
 
-	if (directory)
+	if (directory || archive) {
+		sp.directory = directory ? directory : "";
+		sp.dir_len = strlen(sp.directory);
+		if (inline_data_max(info)) {
+			sp.inline_buf = malloc(inline_data_max(info));
+			if (!sp.inline_buf)
+				critical_error_errno(setjmp_env, "malloc");
+		}
+		if (layout_order) {
+			struct layout_file *files;
+			int nr = read_layout_order(layout_order, &root, &files);
+
+			if (nr < 0)
+				critical_error_errno(setjmp_env, "%s",
+						     layout_order);
+			if (verbose)
+				printf("Laying out %d files in the order of %s\n",
+				       nr, layout_order);
+			build_layout_files(info, aux_info, ext4_sparse_file,
+					   saved_allocation_head, force,
+					   setjmp_env, &sp, files, nr, 0);
+			free(files);
+		}
+		if (plan) {
+			struct layout_file *files;
+			int nr = plan_layout(&root, inline_data_max(info),
+					     info->block_size, &files);
+
+			if (nr < 0)
+				critical_error_errno(setjmp_env, "plan_layout");
+			if (verbose)
+				printf("Laying out %d files largest first\n",
+				       nr);
+			build_layout_files(info, aux_info, ext4_sparse_file,
+					   saved_allocation_head, force,
+					   setjmp_env, &sp, files, nr, 1);
+			free(files);
+		}
 		root_inode_num = build_directory_structure(info, aux_info,
 							   ext4_sparse_file,
 							   saved_allocation_head,
-							   config_list, force,
-							   setjmp_env,
-							   directory, "", 0,
-							   fs_config_func,
-							   verbose, fixed_time);
-	else
+							   force, setjmp_env,
+							   &sp, &root, 0,
+							   verbose);
+		free(sp.buf);
+		free(sp.inline_buf);
+	} else
 		root_inode_num = build_default_directory_structure(info,
 								   aux_info,
 								   ext4_sparse_file,
 								   force,
 								   setjmp_env,
 								   fixed_time);
+	hardlink_table_free(&hardlinks);
+	dedup_table_free(&dedups);
 
 	root_mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
 	inode_set_permissions(info, aux_info, ext4_sparse_file, setjmp_env,
 			      root_inode_num, root_mode, 0, 0,
 			      (fixed_time != 1) ? fixed_time : 0);
 
+	if (ext4_has_metadata_csum(info))
+		set_directory_csums(info, aux_info);
+
+	queue_bg_metadata(info, aux_info, ext4_sparse_file, setjmp_env);
+
 	ext4_update_free(aux_info);
 
 	ext4_queue_sb(info, aux_info, ext4_sparse_file, setjmp_env);
 
+	/* files with no blocks of their own, empty or with their data in
+	   the inode, have no allocation and are not listed */
 	if (block_list_file) {
-		size_t dirlen = strlen(directory);
-		struct block_allocation *p = saved_allocation_head;
+		size_t dirlen = directory ? strlen(directory) : 0;
+		struct block_allocation *p = saved_allocation_head->next;
 		while (p) {
-			if (strncmp(p->filename, directory, dirlen) == 0) {
+			if (directory &&
+			    strncmp(p->filename, directory, dirlen) == 0) {
 				fprintf(block_list_file, "%s",
 					p->filename + dirlen);
 			} else {
@@ -600,22 +859,26 @@ int make_ext4fs_internal(struct fs_info *info, struct fs_aux_info *aux_info,
 		}
 	}
 
-	printf("Created filesystem with %d/%d inodes and %d/%d blocks\n",
+	printf("Created filesystem with %d/%d inodes and %" PRIu64 "/%" PRIu64
+	       " blocks\n",
 	       aux_info->sb->s_inodes_count - aux_info->sb->s_free_inodes_count,
 	       aux_info->sb->s_inodes_count,
-	       aux_info->sb->s_blocks_count_lo -
-	       aux_info->sb->s_free_blocks_count_lo,
-	       aux_info->sb->s_blocks_count_lo);
+	       ext4_blocks_count(aux_info->sb) -
+	       ext4_free_blocks_count(aux_info->sb),
+	       ext4_blocks_count(aux_info->sb));
 
 	if (wipe && WIPE_IS_SUPPORTED) {
 		wipe_block_device(fd, info->len);
 	}
 
-	write_ext4_image(ext4_sparse_file, fd, gzip, sparse, crc);
+	write_ext4_image(setjmp_env, ext4_sparse_file, fd, gzip, sparse, crc);
 
 	sparse_file_destroy(ext4_sparse_file);
 	ext4_sparse_file = NULL;
 
+	gz_index_free(sp.data.gz);
+	if (sp.data.fd >= 0)
+		close(sp.data.fd);
 	free(directory);
 
 	return 0;
@@ -14,7 +14,9 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -36,14 +38,92 @@ static void usage(char *path)
 		"%s [ -l <len> ] [ -j <journal size> ] [ -b <block_size> ]\n",
 		basename(path));
 	fprintf(stderr,
-		"    [ -g <blocks per group> ] [ -i <inodes> ] [ -I <inode size> ]\n");
+		"    [ -g <blocks per group> ] [ -i <inodes> | auto[:<headroom>%%] ]\n");
 	fprintf(stderr,
-		"    [ -m <reserved blocks percent> ] [ -L <label> ] [ -u <uuid>] [ -f ]\n");
+		"    [ -I <inode size> ] [ -m <reserved blocks percent> ] [ -L <label> ]\n");
 	fprintf(stderr,
-		"    [ -S file_contexts ] [ -C fs_config ] [ -T timestamp ]\n");
+		"    [ -u <uuid>] [ -f ] [ -S file_contexts ] [ -C fs_config ]\n");
+	fprintf(stderr, "    [ -T timestamp ]\n");
 	fprintf(stderr,
 		"    [ -z | -s ] [ -w ] [ -c ] [ -J ] [ -v ] [ -B <block_list_file> ]\n");
-	fprintf(stderr, "    <filename> [<directory>]\n");
+	fprintf(stderr, "    [ -p <scan threads> ] [ -A ] [ -D ] [ -Z ]\n");
+	fprintf(stderr, "    [ -O <feature>[,...] ] [ -G <groups per flex group> ]\n");
+	fprintf(stderr, "    [ --layout-order <file> ] [ --plan-layout ]\n");
+	fprintf(stderr, "    [ --dir-index-entries <entries> ]\n");
+	fprintf(stderr, "    <filename> [<directory> | -a <tar or cpio archive>]\n");
+}
+
+/* Options without a short form */
+enum {
+	OPT_LAYOUT_ORDER = 256,
+	OPT_PLAN_LAYOUT,
+	OPT_DIR_INDEX_ENTRIES,
+};
+
+static const struct option long_options[] = {
+	{ "layout-order", required_argument, NULL, OPT_LAYOUT_ORDER },
+	{ "plan-layout", no_argument, NULL, OPT_PLAN_LAYOUT },
+	{ "dir-index-entries", required_argument, NULL,
+	 OPT_DIR_INDEX_ENTRIES },
+	{ NULL, 0, NULL, 0 },
+};
+
+/* Optional filesystem features, turned on with -O */
+static const struct {
+	const char *name;
+	u32 compat;
+	u32 incompat;
+	u32 ro_compat;
+} features[] = {
+	{ "64bit", 0, EXT4_FEATURE_INCOMPAT_64BIT, 0 },
+	{ "dir_index", EXT4_FEATURE_COMPAT_DIR_INDEX, 0, 0 },
+	{ "flex_bg", 0, EXT4_FEATURE_INCOMPAT_FLEX_BG, 0 },
+	{ "inline_data", 0, EXT4_FEATURE_INCOMPAT_INLINE_DATA, 0 },
+	{ "metadata_csum", 0, 0, EXT4_FEATURE_RO_COMPAT_METADATA_CSUM },
+};
+
+/* Turns on the features in a comma separated list.  Returns 0, or -1 if
+   one of them is not known. */
+static int parse_features(struct fs_info *info, char *list)
+{
+	char *name;
+	char *save = NULL;
+	size_t i;
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < sizeof(features) / sizeof(features[0]); i++)
+			if (!strcmp(name, features[i].name))
+				break;
+		if (i == sizeof(features) / sizeof(features[0])) {
+			fprintf(stderr, "unknown feature: '%s'\n", name);
+			return -1;
+		}
+		info->feat_compat |= features[i].compat;
+		info->feat_incompat |= features[i].incompat;
+		info->feat_ro_compat |= features[i].ro_compat;
+	}
+
+	return 0;
+}
+
+/* The rest of -i auto: nothing, or a headroom of :<percent>[%] */
+static int parse_inodes_auto(struct fs_info *info, const char *arg)
+{
+	char *end;
+
+	info->inodes_auto = 1;
+	info->inodes_headroom = 0;
+	if (*arg == '\0')
+		return 0;
+	if (*arg != ':' || !isdigit((unsigned char)arg[1]))
+		return -1;
+
+	info->inodes_headroom = strtoul(arg + 1, &end, 10);
+	if (*end == '%')
+		end++;
+
+	return *end == '\0' ? 0 : -1;
 }
 
 int main(int argc, char **argv)
@@ -51,6 +131,7 @@ int main(int argc, char **argv)
 	int opt;
 	const char *filename = NULL;
 	const char *directory = NULL;
+	const char *archive = NULL;
 	fs_config_func_t fs_config_func = NULL;
 	const char *fs_config_file = NULL;
 	int gzip = 0;
@@ -65,6 +146,12 @@ int main(int argc, char **argv)
 	struct fs_config_list config_list;
 	int uuid_user_specified = 0;
 	int force = 0;
+	int scan_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int async_io = 0;
+	int dedup = 0;
+	int zero_blocks = 0;
+	const char *layout_order = NULL;
+	int plan_layout = 0;
 	jmp_buf setjmp_env;
 	struct fs_info info;
 	struct fs_aux_info aux_info;
@@ -79,7 +166,8 @@ int main(int argc, char **argv)
 	memset(&saved_allocation_head, 0x00, sizeof(struct block_allocation));
 
 	while ((opt =
-		getopt(argc, argv, "l:j:b:g:i:I:L:u:T:C:B:m:fwzJsctv")) != -1) {
+		getopt_long(argc, argv, "l:j:b:g:i:I:L:u:T:C:B:m:p:a:O:G:fwzJsctvADZ",
+			    long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'l':
 			info.len = parse_num(optarg);
@@ -94,7 +182,16 @@ int main(int argc, char **argv)
 			info.blocks_per_group = parse_num(optarg);
 			break;
 		case 'i':
-			info.inodes = parse_num(optarg);
+			if (!strncmp(optarg, "auto", 4)) {
+				if (parse_inodes_auto(&info, optarg + 4)) {
+					fprintf(stderr,
+						"bad inode headroom: '%s'\n",
+						optarg);
+					exit(EXIT_FAILURE);
+				}
+			} else {
+				info.inodes = parse_num(optarg);
+			}
 			break;
 		case 'I':
 			info.inode_size = parse_num(optarg);
@@ -135,6 +232,42 @@ int main(int argc, char **argv)
 		case 'v':
 			verbose = 1;
 			break;
+		case 'A':
+			async_io = 1;
+			break;
+		case 'D':
+			dedup = 1;
+			break;
+		case 'Z':
+			zero_blocks = 1;
+			break;
+		case 'a':
+			archive = optarg;
+			break;
+		case 'O':
+			if (parse_features(&info, optarg))
+				exit(EXIT_FAILURE);
+			break;
+		case 'G':
+			info.flex_bg_size = strtoul(optarg, NULL, 0);
+			if (!info.flex_bg_size ||
+			    (info.flex_bg_size & (info.flex_bg_size - 1))) {
+				fprintf(stderr,
+					"flex group size must be a power of 2: '%s'\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			info.feat_incompat |= EXT4_FEATURE_INCOMPAT_FLEX_BG;
+			break;
+		case OPT_LAYOUT_ORDER:
+			layout_order = optarg;
+			break;
+		case OPT_PLAN_LAYOUT:
+			plan_layout = 1;
+			break;
+		case OPT_DIR_INDEX_ENTRIES:
+			info.dir_index_entries = strtoul(optarg, NULL, 0);
+			break;
 		case 'T':
 			fixed_time = strtoll(optarg, NULL, 0);
 			break;
@@ -153,6 +286,9 @@ int main(int argc, char **argv)
 		case 'm':
 			info.reserve_pcnt = strtoul(optarg, NULL, 0);
 			break;
+		case 'p':
+			scan_threads = strtoul(optarg, NULL, 0);
+			break;
 		default:	/* '?' */
 			usage(argv[0]);
 			exit(EXIT_FAILURE);
@@ -190,6 +326,12 @@ int main(int argc, char **argv)
 	if (optind < argc)
 		directory = argv[optind++];
 
+	if (directory && archive) {
+		fprintf(stderr, "Cannot specify both a directory and an archive\n");
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
 	if (optind < argc) {
 		fprintf(stderr, "Unexpected argument: %s\n", argv[optind]);
 		usage(argv[0]);
@@ -209,9 +351,12 @@ int main(int argc, char **argv)
 	exitcode = make_ext4fs_internal(&info, &aux_info, &ext4_sparse_file,
 					&saved_allocation_head, &config_list,
 					force, &setjmp_env, uuid_user_specified,
-					fd, directory, fs_config_func, gzip,
+					fd, directory, archive, fs_config_func,
+					gzip,
 					sparse, crc, wipe, verbose, fixed_time,
-					block_list_file);
+					block_list_file, scan_threads, async_io,
+					dedup, zero_blocks, layout_order,
+					plan_layout);
 	close(fd);
 	if (block_list_file)
 		fclose(block_list_file);
@@ -0,0 +1,818 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ext4_utils.h"
+#include "contents.h"
+#include "dedup.h"
+#include "holes.h"
+#include "scan.h"
+#include "uring.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* The source tree is read by a pool of threads before anything is allocated
+   in the image.  Each thread owns a queue of directories waiting to be
+   scanned; it pushes and pops subdirectories at the tail of its own queue
+   and, when that runs dry, steals from the head of another thread's queue.
+   The result is the same tree of dentries, in the same sorted order, as
+   a serial walk would produce, so inode and block allocation that follows
+   is unaffected by the number of threads. */
+
+/* io_uring requests kept in flight by each scanner thread */
+#define SCAN_URING_ENTRIES 64
+
+/* size of the buffer each scanner thread reads file contents into, a
+   multiple of any block size */
+#define SCAN_DATA_BUF_SIZE (128 * 1024)
+
+struct scan_context;
+
+struct scan_worker {
+	struct scan_context *ctx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct dentry **queue;
+	size_t head;
+	size_t tail;
+	size_t alloc;
+	/* scratch space, reused for every directory the worker reads */
+	char *names;
+	size_t names_alloc;
+	char **sorted;
+	size_t sorted_alloc;
+	struct stat *stats;
+	size_t stats_alloc;
+	int *errs;
+	size_t errs_alloc;
+	struct uring *ring;
+	struct statx *statx;
+	size_t statx_alloc;
+	char *path;
+	size_t path_alloc;
+	u8 *data_buf;
+};
+
+struct scan_context {
+	struct fs_config_list *config_list;
+	fs_config_func_t fs_config_func;
+	time_t fixed_time;
+	int async_io;
+	struct hardlink_table *hardlinks;
+	struct dedup_table *dedups;
+	u32 block_size;
+	int zero_blocks;
+	struct dentry *root;
+	int root_fd;
+	struct scan_worker *workers;
+	int nr_workers;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t pending;		/* directories queued or being scanned */
+	size_t queued;		/* directories queued, not yet picked up */
+	int failed;		/* errno of a failed allocation, stops the scan */
+};
+
+static void scan_fail(struct scan_context *ctx, int err)
+{
+	pthread_mutex_lock(&ctx->lock);
+	if (!ctx->failed)
+		ctx->failed = err;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void scan_error_add(struct scan_context *ctx, struct dentry *dir,
+			   const char *fmt, ...)
+{
+	struct scan_error *err;
+	struct scan_error **tail;
+	va_list ap;
+	int ret;
+
+	err = calloc(1, sizeof(struct scan_error));
+	if (!err) {
+		scan_fail(ctx, errno);
+		return;
+	}
+
+	va_start(ap, fmt);
+	ret = vasprintf(&err->msg, fmt, ap);
+	va_end(ap);
+	if (ret < 0) {
+		free(err);
+		scan_fail(ctx, errno);
+		return;
+	}
+
+	for (tail = &dir->scan_errors; *tail; tail = &(*tail)->next) ;
+	*tail = err;
+}
+
+void free_scan_errors(struct dentry *dir)
+{
+	struct scan_error *err = dir->scan_errors;
+
+	while (err) {
+		struct scan_error *next = err->next;
+		free(err->msg);
+		free(err);
+		err = next;
+	}
+	dir->scan_errors = NULL;
+}
+
+static int scan_push(struct scan_worker *worker, struct dentry *dir)
+{
+	struct scan_context *ctx = worker->ctx;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail == worker->alloc) {
+		size_t alloc = worker->alloc ? worker->alloc * 2 : 64;
+		struct dentry **queue = realloc(worker->queue,
+						alloc *
+						sizeof(struct dentry *));
+		if (!queue) {
+			pthread_mutex_unlock(&worker->lock);
+			return -1;
+		}
+		worker->queue = queue;
+		worker->alloc = alloc;
+	}
+	worker->queue[worker->tail++] = dir;
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->pending++;
+	ctx->queued++;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return 0;
+}
+
+/* Takes a directory from the tail of the worker's own queue, or, if it is
+   empty, from the head of another worker's queue */
+static struct dentry *scan_take(struct scan_worker *worker)
+{
+	struct scan_context *ctx = worker->ctx;
+	struct dentry *dir = NULL;
+	int self = worker - ctx->workers;
+	int i;
+
+	for (i = 0; i < ctx->nr_workers && !dir; i++) {
+		struct scan_worker *w =
+		    &ctx->workers[(self + i) % ctx->nr_workers];
+
+		pthread_mutex_lock(&w->lock);
+		if (w->tail > w->head) {
+			if (w == worker)
+				dir = w->queue[--w->tail];
+			else
+				dir = w->queue[w->head++];
+			if (w->head == w->tail)
+				w->head = w->tail = 0;
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	if (dir) {
+		pthread_mutex_lock(&ctx->lock);
+		ctx->queued--;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	return dir;
+}
+
+/* Grows one of the worker's scratch arrays to hold at least n elements */
+static int scan_reserve(void **array, size_t *alloc, size_t n, size_t size)
+{
+	void *p;
+	size_t new_alloc;
+
+	if (n <= *alloc)
+		return 0;
+
+	new_alloc = *alloc ? *alloc : 64;
+	while (new_alloc < n)
+		new_alloc *= 2;
+
+	p = realloc(*array, new_alloc * size);
+	if (!p)
+		return -1;
+	*array = p;
+	*alloc = new_alloc;
+	return 0;
+}
+
+/* Returns the path of name relative to the root of the source tree, in the
+   worker's scratch buffer, as fs_config expects it */
+static const char *scan_path(struct scan_worker *worker, struct dentry *dir,
+			     const char *name)
+{
+	size_t dir_len = strlen(dir->path);
+	size_t name_len = strlen(name);
+	char *p;
+
+	if (scan_reserve((void **)&worker->path, &worker->path_alloc,
+			 dir_len + name_len + 2, 1) < 0)
+		return NULL;
+
+	p = worker->path;
+	memcpy(p, dir->path, dir_len);
+	p += dir_len;
+	if (dir_len)
+		*p++ = '/';
+	memcpy(p, name, name_len + 1);
+
+	return worker->path;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Reads the names in a directory into the worker's scratch buffers, sorted
+   by strcmp (the same order alphasort gives in the C locale) */
+static int scan_read_names(struct scan_worker *worker, DIR *d, u32 *entries)
+{
+	struct dirent *de;
+	size_t used = 0;
+	size_t len;
+	u32 n = 0;
+	u32 i;
+
+	for (;;) {
+		errno = 0;
+		de = readdir(d);
+		if (!de)
+			break;
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		len = strlen(de->d_name) + 1;
+		if (scan_reserve((void **)&worker->names,
+				 &worker->names_alloc, used + len, 1) < 0)
+			return -errno;
+		/* offsets for now; the buffer may move while it grows */
+		if (scan_reserve((void **)&worker->sorted,
+				 &worker->sorted_alloc, n + 1,
+				 sizeof(char *)) < 0)
+			return -errno;
+		memcpy(worker->names + used, de->d_name, len);
+		worker->sorted[n++] = (char *)(uintptr_t) used;
+		used += len;
+	}
+	if (errno)
+		return 1;
+
+	for (i = 0; i < n; i++)
+		worker->sorted[i] =
+		    worker->names + (uintptr_t) worker->sorted[i];
+	qsort(worker->sorted, n, sizeof(char *), compare_names);
+
+	*entries = n;
+	return 0;
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+	stat->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	stat->st_ino = stx->stx_ino;
+	stat->st_mode = stx->stx_mode;
+	stat->st_nlink = stx->stx_nlink;
+	stat->st_uid = stx->stx_uid;
+	stat->st_gid = stx->stx_gid;
+	stat->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	stat->st_size = stx->stx_size;
+	stat->st_blocks = stx->stx_blocks;
+	stat->st_mtime = stx->stx_mtime.tv_sec;
+}
+
+/* Stats the sorted names of a directory into worker->stats, leaving the
+   errno of each entry that could not be stat'ed in worker->errs.  With an
+   io_uring, the statx requests of the whole directory are kept in flight
+   together instead of being issued one by one. */
+static int scan_stat_entries(struct scan_worker *worker, int fd, u32 entries)
+{
+	u32 queued = 0;
+	u32 done = 0;
+	u64 user_data;
+	int res;
+	int ret;
+	u32 i;
+
+	if (scan_reserve((void **)&worker->stats, &worker->stats_alloc,
+			 entries, sizeof(struct stat)) < 0 ||
+	    scan_reserve((void **)&worker->errs, &worker->errs_alloc,
+			 entries, sizeof(int)) < 0)
+		return -errno;
+
+	if (!worker->ring) {
+		for (i = 0; i < entries; i++) {
+			worker->errs[i] = 0;
+			if (fstatat(fd, worker->sorted[i], &worker->stats[i],
+				    AT_SYMLINK_NOFOLLOW) < 0)
+				worker->errs[i] = errno;
+		}
+		return 0;
+	}
+
+	if (scan_reserve((void **)&worker->statx, &worker->statx_alloc,
+			 entries, sizeof(struct statx)) < 0)
+		return -errno;
+
+	while (done < entries) {
+		while (queued < entries &&
+		       queued - done < SCAN_URING_ENTRIES &&
+		       uring_prep_statx(worker->ring, fd,
+					worker->sorted[queued],
+					AT_SYMLINK_NOFOLLOW,
+					STATX_BASIC_STATS,
+					&worker->statx[queued], queued) == 0)
+			queued++;
+
+		ret = uring_wait(worker->ring, &user_data, &res);
+		if (ret < 0)
+			return ret;
+
+		i = user_data;
+		worker->errs[i] = res < 0 ? -res : 0;
+		if (res == 0)
+			statx_to_stat(&worker->statx[i], &worker->stats[i]);
+		done++;
+	}
+
+	return 0;
+}
+
+static u8 scan_file_type(mode_t mode)
+{
+	if (S_ISREG(mode))
+		return EXT4_FT_REG_FILE;
+	else if (S_ISDIR(mode))
+		return EXT4_FT_DIR;
+	else if (S_ISCHR(mode))
+		return EXT4_FT_CHRDEV;
+	else if (S_ISBLK(mode))
+		return EXT4_FT_BLKDEV;
+	else if (S_ISFIFO(mode))
+		return EXT4_FT_FIFO;
+	else if (S_ISSOCK(mode))
+		return EXT4_FT_SOCK;
+	else if (S_ISLNK(mode))
+		return EXT4_FT_SYMLINK;
+	return EXT4_FT_UNKNOWN;
+}
+
+/* Reads a regular file for the features that need its contents: finding
+   the blocks that hold data, if it has holes or blocks of zeros are to be
+   left out, and hashing it so that files with the same contents can share
+   their blocks.  A file that cannot be read is left alone; the error is
+   reported when it is added to the image. */
+static int scan_file_data(struct scan_worker *worker, int fd,
+			  struct dentry *dentry)
+{
+	struct scan_context *ctx = worker->ctx;
+	u32 file_blocks = DIV_ROUND_UP(dentry->size, ctx->block_size);
+	u8 digest[SHA1_DIGEST_LENGTH];
+	struct data_source src = { -1, NULL };
+	int ret = 0;
+	int nr;
+
+	if (!dentry->holes && !ctx->zero_blocks && !ctx->dedups)
+		return 0;
+
+	if (!worker->data_buf) {
+		worker->data_buf = malloc(SCAN_DATA_BUF_SIZE);
+		if (!worker->data_buf)
+			return -errno;
+	}
+
+	src.fd = openat(fd, dentry->filename,
+			O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src.fd < 0) {
+		dentry->holes = 0;
+		return 0;
+	}
+
+	if (dentry->holes || ctx->zero_blocks) {
+		nr = find_data_ranges(&src, 0, dentry->size,
+				      ctx->block_size, dentry->holes,
+				      ctx->zero_blocks, worker->data_buf,
+				      SCAN_DATA_BUF_SIZE, &dentry->ranges);
+		if (nr < 0 || (nr == 1 && dentry->ranges[0].block == 0 &&
+			       dentry->ranges[0].len == file_blocks)) {
+			/* nothing to leave out */
+			free(dentry->ranges);
+			dentry->ranges = NULL;
+			dentry->holes = 0;
+		} else {
+			dentry->nr_ranges = nr;
+			dentry->holes = 1;
+		}
+	}
+
+	if (ctx->dedups &&
+	    dedup_hash_data(&src, 0, dentry->size, worker->data_buf,
+			    SCAN_DATA_BUF_SIZE, digest) == 0) {
+		dentry->dedup = dedup_get(ctx->dedups, dentry->size, digest);
+		if (!dentry->dedup)
+			ret = -errno;
+	}
+
+	close(src.fd);
+	return ret;
+}
+
+/* Reads one directory into dir->dentries and queues its subdirectories.
+
+   All dentries of a directory live in a single allocation: the array of
+   dentries, followed by their names, symlink targets and, for
+   subdirectories, their paths.  Everything is looked up relative to an
+   open descriptor of the directory, so the kernel never has to walk the
+   full path of an entry, and the path of an entry is only put together
+   when fs_config needs it. */
+static int scan_dir(struct scan_worker *worker, struct dentry *dir)
+{
+	struct scan_context *ctx = worker->ctx;
+	struct dentry *dentries;
+	struct dentry *dentry;
+	struct stat *stat;
+	const char *path;
+	size_t size;
+	char *p;
+	DIR *d;
+	int fd;
+	int extra = 0;
+	int ret;
+	u32 entries = 0;
+	u32 i;
+	u32 n;
+
+	fd = openat(ctx->root_fd, dir == ctx->root ? "." : dir->path,
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		dir->scan_errno = errno;
+		return 0;
+	}
+	d = fdopendir(fd);
+	if (!d) {
+		dir->scan_errno = errno;
+		close(fd);
+		return 0;
+	}
+
+	ret = scan_read_names(worker, d, &entries);
+	if (ret) {
+		if (ret > 0) {
+			dir->scan_errno = errno;
+			ret = 0;
+		}
+		goto out;
+	}
+
+	if (dir == ctx->root) {
+		/* root directory, check if lost+found already exists */
+		for (i = 0; i < entries; i++)
+			if (strcmp(worker->sorted[i], "lost+found") == 0)
+				break;
+		if (i == entries)
+			extra = 1;
+	}
+
+	ret = scan_stat_entries(worker, dirfd(d), entries);
+	if (ret < 0)
+		goto out;
+
+	/* size the allocation, skipping what cannot go in the image */
+	size = extra * (sizeof(struct dentry) + sizeof("lost+found"));
+	for (i = 0; i < entries; i++) {
+		const char *name = worker->sorted[i];
+		size_t len = strlen(name) + 1;
+
+		stat = &worker->stats[i];
+		if (worker->errs[i]) {
+			scan_error_add(ctx, dir, "lstat: %s",
+				       strerror(worker->errs[i]));
+			stat->st_mode = 0;
+			continue;
+		}
+		if (scan_file_type(stat->st_mode) == EXT4_FT_UNKNOWN) {
+			path = scan_path(worker, dir, name);
+			if (!path) {
+				ret = -errno;
+				goto out;
+			}
+			scan_error_add(ctx, dir, "unknown file type on %s",
+				       path);
+			stat->st_mode = 0;
+			continue;
+		}
+
+		size += sizeof(struct dentry) + len;
+		if (S_ISDIR(stat->st_mode))
+			size += strlen(dir->path) + 1 + len;
+		else if (S_ISLNK(stat->st_mode))
+			size += stat->st_size + 1;
+	}
+
+	dentries = calloc(1, size ? size : 1);
+	if (!dentries) {
+		ret = -errno;
+		goto out;
+	}
+	dir->dentries = dentries;
+
+	/* count the entries that are kept, so the strings go after them */
+	n = extra;
+	for (i = 0; i < entries; i++)
+		if (worker->stats[i].st_mode)
+			n++;
+	p = (char *)&dentries[n];
+
+	if (extra) {
+		/* insert a lost+found directory at the beginning of the dentries */
+		strcpy(p, "lost+found");
+		dentries[0].filename = p;
+		dentries[0].path = p;
+		p += sizeof("lost+found");
+		dentries[0].size = 0;
+		dentries[0].mode = S_IRWXU;
+		dentries[0].file_type = EXT4_FT_DIR;
+		dentries[0].uid = 0;
+		dentries[0].gid = 0;
+		dir->dirs++;
+	}
+
+	for (i = 0, n = extra; i < entries; i++) {
+		const char *name = worker->sorted[i];
+		size_t len = strlen(name) + 1;
+
+		stat = &worker->stats[i];
+		if (!stat->st_mode)
+			continue;
+
+		dentry = &dentries[n++];
+		memcpy(p, name, len);
+		dentry->filename = p;
+		p += len;
+
+		dentry->size = stat->st_size;
+		dentry->rdev = stat->st_rdev;
+		dentry->mode =
+		    stat->st_mode & (S_ISUID | S_ISGID | S_ISVTX | S_IRWXU |
+				     S_IRWXG | S_IRWXO);
+		if (ctx->fixed_time == -1) {
+			dentry->mtime = stat->st_mtime;
+		} else {
+			dentry->mtime = ctx->fixed_time;
+		}
+		dentry->file_type = scan_file_type(stat->st_mode);
+		dentry->holes = dentry->file_type == EXT4_FT_REG_FILE &&
+		    (u64)stat->st_blocks * 512 < (u64)stat->st_size;
+
+		if (dentry->file_type != EXT4_FT_DIR && stat->st_nlink > 1) {
+			dentry->hardlink = hardlink_get(ctx->hardlinks,
+							stat->st_dev,
+							stat->st_ino);
+			if (!dentry->hardlink) {
+				ret = -errno;
+				goto out;
+			}
+		}
+
+		path = NULL;
+		if (ctx->fs_config_func != NULL ||
+		    dentry->file_type == EXT4_FT_DIR) {
+			path = scan_path(worker, dir, name);
+			if (!path) {
+				ret = -errno;
+				goto out;
+			}
+		}
+
+		if (ctx->fs_config_func != NULL) {
+			unsigned int mode = 0;
+			unsigned int uid = 0;
+			unsigned int gid = 0;
+			uint64_t capabilities;
+			int is_dir = S_ISDIR(stat->st_mode);
+			if (ctx->fs_config_func(ctx->config_list, path, is_dir,
+						&uid, &gid, &mode,
+						&capabilities)) {
+				dentry->mode = mode;
+				dentry->uid = uid;
+				dentry->gid = gid;
+				dentry->capabilities = capabilities;
+			}
+		}
+
+		if (dentry->file_type == EXT4_FT_DIR) {
+			strcpy(p, path);
+			dentry->path = p;
+			p += strlen(path) + 1;
+			dir->dirs++;
+		} else if (dentry->file_type == EXT4_FT_SYMLINK) {
+			ssize_t link_len = readlinkat(dirfd(d), name, p,
+						      stat->st_size);
+			dentry->link = p;
+			p[link_len > 0 ? link_len : 0] = '\0';
+			p += stat->st_size + 1;
+		}
+	}
+	dir->entries = n;
+
+	for (n = extra; n < dir->entries; n++) {
+		if (dentries[n].file_type != EXT4_FT_REG_FILE ||
+		    !dentries[n].size)
+			continue;
+		ret = scan_file_data(worker, dirfd(d), &dentries[n]);
+		if (ret < 0)
+			goto out;
+	}
+
+	for (n = extra; n < dir->entries; n++) {
+		if (dentries[n].file_type == EXT4_FT_DIR) {
+			if (scan_push(worker, &dentries[n]) < 0) {
+				ret = -errno;
+				goto out;
+			}
+		}
+	}
+
+out:
+	closedir(d);
+	return ret;
+}
+
+static void *scan_worker_run(void *arg)
+{
+	struct scan_worker *worker = arg;
+	struct scan_context *ctx = worker->ctx;
+	struct dentry *dir;
+	bool done;
+	int ret;
+
+	if (ctx->async_io) {
+		worker->ring = uring_new(SCAN_URING_ENTRIES);
+		if (worker->ring &&
+		    !uring_supported(worker->ring, URING_OP_STATX)) {
+			uring_free(worker->ring);
+			worker->ring = NULL;
+		}
+	}
+
+	for (;;) {
+		dir = scan_take(worker);
+		if (!dir) {
+			pthread_mutex_lock(&ctx->lock);
+			while (ctx->queued == 0 && ctx->pending > 0 &&
+			       !ctx->failed)
+				pthread_cond_wait(&ctx->cond, &ctx->lock);
+			done = ctx->pending == 0 || ctx->failed;
+			pthread_mutex_unlock(&ctx->lock);
+			if (done)
+				break;
+			continue;
+		}
+
+		ret = scan_dir(worker, dir);
+		if (ret < 0)
+			scan_fail(ctx, -ret);
+
+		pthread_mutex_lock(&ctx->lock);
+		if (--ctx->pending == 0)
+			pthread_cond_broadcast(&ctx->cond);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	uring_free(worker->ring);
+	worker->ring = NULL;
+
+	return NULL;
+}
+
+/* Reads the whole tree below directory into memory, using up to threads
+   scanner threads, and io_uring if async_io is set and it is available.
+   Files with more than one name share an entry of hardlinks.  If dedups
+   is not NULL, regular files are hashed and files with the same contents
+   share an entry of it.  The blocks of block_size bytes of regular files
+   that hold data are found for files with holes and, if zero_blocks is
+   set, for all files, leaving out blocks of zeros.
+   Returns 0 on success or a negative errno if memory ran
+   out; per-entry problems are left in the scan_errors and scan_errno
+   fields of the directory they were found in. */
+int scan_directory_tree(struct fs_config_list *config_list,
+			fs_config_func_t fs_config_func, time_t fixed_time,
+			int threads, int async_io, const char *directory,
+			struct hardlink_table *hardlinks,
+			struct dedup_table *dedups, u32 block_size,
+			int zero_blocks, struct dentry *root)
+{
+	struct scan_context ctx;
+	int started;
+	int ret = 0;
+	int i;
+
+	if (threads < 1)
+		threads = 1;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.root_fd = open(*directory ? directory : ".",
+			   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ctx.root_fd < 0) {
+		root->scan_errno = errno;
+		return 0;
+	}
+	ctx.config_list = config_list;
+	ctx.fs_config_func = fs_config_func;
+	ctx.fixed_time = fixed_time;
+	ctx.async_io = async_io;
+	ctx.hardlinks = hardlinks;
+	ctx.dedups = dedups;
+	ctx.block_size = block_size;
+	ctx.zero_blocks = zero_blocks;
+	ctx.root = root;
+	ctx.nr_workers = threads;
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+
+	ctx.workers = calloc(threads, sizeof(struct scan_worker));
+	if (!ctx.workers) {
+		ret = -errno;
+		goto out_close;
+	}
+
+	for (i = 0; i < threads; i++) {
+		ctx.workers[i].ctx = &ctx;
+		pthread_mutex_init(&ctx.workers[i].lock, NULL);
+	}
+
+	if (scan_push(&ctx.workers[0], root) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	/* the calling thread is worker 0 */
+	for (started = 1; started < threads; started++) {
+		if (pthread_create(&ctx.workers[started].thread, NULL,
+				   scan_worker_run, &ctx.workers[started]))
+			break;
+	}
+
+	scan_worker_run(&ctx.workers[0]);
+
+	for (i = 1; i < started; i++)
+		pthread_join(ctx.workers[i].thread, NULL);
+
+	if (ctx.failed)
+		ret = -ctx.failed;
+
+out:
+	for (i = 0; i < threads; i++) {
+		struct scan_worker *worker = &ctx.workers[i];
+
+		pthread_mutex_destroy(&worker->lock);
+		free(worker->queue);
+		free(worker->names);
+		free(worker->sorted);
+		free(worker->stats);
+		free(worker->errs);
+		free(worker->statx);
+		free(worker->path);
+		free(worker->data_buf);
+	}
+	free(ctx.workers);
+out_close:
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+	close(ctx.root_fd);
+
+	return ret;
+}
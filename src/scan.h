@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include "ext4_utils.h"
+#include "contents.h"
+#include "dedup.h"
+#include "hardlink.h"
+
+/* A problem found while scanning a directory.  Scanner threads cannot
+   report errors themselves, so they are kept with the directory and
+   reported in order when the directory is created in the image. */
+struct scan_error {
+	char *msg;
+	struct scan_error *next;
+};
+
+int scan_directory_tree(struct fs_config_list *config_list,
+			fs_config_func_t fs_config_func, time_t fixed_time,
+			int threads, int async_io, const char *directory,
+			struct hardlink_table *hardlinks,
+			struct dedup_table *dedups, u32 block_size,
+			int zero_blocks, struct dentry *root);
+void free_scan_errors(struct dentry *dir);
+
+#endif
@@ -50,6 +50,7 @@ fi
 
 function cleanup() {
 	sudo umount -v $DEV_LOOPX || true
+	sudo umount -v $TEST_DIR/mnt-image || true
 	sudo losetup -v -d $DEV_LOOPX || true
 	sudo rm -vfr $TEST_DIR || true
 	echo "cleanup complete"
@@ -97,5 +98,400 @@ grep --only-matching "UUID=\"${UUID_OUT_EXPECTED}\"" \
 	$TEST_DIR/test-out/test-fs-foo.blkid.out \
 	|| ERRORS=$(( 1 + $ERRORS ))
 
+# an archive of the same files must give the same image as the directory
+tar -cf $TEST_DIR/test-fs-files.tar -C $TEST_DIR/test-fs-files .
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -L test-fs-foo -l 16M \
+	$TEST_DIR/test-out/from-dir.img $TEST_DIR/test-fs-files
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -L test-fs-foo -l 16M \
+	-a $TEST_DIR/test-fs-files.tar $TEST_DIR/test-out/from-tar.img
+cmp $TEST_DIR/test-out/from-dir.img $TEST_DIR/test-out/from-tar.img \
+	|| ERRORS=$(( 1 + $ERRORS ))
+
+# e2fsck must find nothing wrong with an image but the padding at the end
+# of the bitmaps, which make_ext4fs does not set
+function check-image() {
+	e2fsck -fn $1 > $1.e2fsck.out 2>&1 || true
+	cat $1.e2fsck.out
+	! grep -v -E \
+		-e '^(e2fsck [0-9.]+ |Pass [1-5]: |$)' \
+		-e '^Padding at end of (inode|block) bitmap is not set' \
+		-e ': \*+ WARNING: Filesystem still has errors \*+$' \
+		-e ': [0-9]+/[0-9]+ files \(' \
+		$1.e2fsck.out
+}
+
+# the files of an image, as the kernel sees them, must be those it was
+# made from
+function compare-image() {
+	local ret=0
+
+	mkdir -pv $TEST_DIR/mnt-image
+	sudo mount -o loop,ro $1 $TEST_DIR/mnt-image
+	sudo diff -r --no-dereference --exclude=lost+found \
+		$2 $TEST_DIR/mnt-image || ret=1
+	sudo umount $TEST_DIR/mnt-image
+	return $ret
+}
+
+# files filled with one character, to tell misplaced blocks apart
+function make-file() {
+	head -c $2 /dev/zero | tr '\0' ${3:-x} > $1
+}
+
+# the runs of logical blocks that the extents of a file in an image map,
+# as "first-last first-last ..."
+function mapped-blocks() {
+	debugfs -R "ex $2" $1 | awk '
+		NR > 1 { printf "%s%s-%s", sep, $5, $7; sep = " " }
+		END { print "" }'
+}
+
+# a file of single free blocks in 85 groups loses its first region to
+# the extent tree, and its 84 extents left take one leaf, not two
+mkdir -pv $TEST_DIR/nearly-full
+make-file $TEST_DIR/nearly-full/a 979968 a
+for i in $( seq 1 108 ); do
+	cp $TEST_DIR/nearly-full/a $TEST_DIR/nearly-full/a$i
+done
+make-file $TEST_DIR/nearly-full/b 712704 b
+for i in $( seq 1 8 ); do
+	cp $TEST_DIR/nearly-full/b $TEST_DIR/nearly-full/b$i
+done
+make-file $TEST_DIR/nearly-full/c0 978944 c
+make-file $TEST_DIR/nearly-full/c1 709632 c
+make-file $TEST_DIR/nearly-full/zz 86016 z
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -J -b 1024 -g 1024 -l 120M \
+	$TEST_DIR/test-out/nearly-full.img $TEST_DIR/nearly-full \
+	|| ERRORS=$(( 1 + $ERRORS ))
+check-image $TEST_DIR/test-out/nearly-full.img || ERRORS=$(( 1 + $ERRORS ))
+compare-image $TEST_DIR/test-out/nearly-full.img $TEST_DIR/nearly-full \
+	|| ERRORS=$(( 1 + $ERRORS ))
+rm -f $TEST_DIR/test-out/nearly-full.img
+rm -fr $TEST_DIR/nearly-full
+
+# flex groups, with a file across several groups and their metadata
+mkdir -pv $TEST_DIR/flex-bg
+make-file $TEST_DIR/flex-bg/big 20000000 f
+echo "small" > $TEST_DIR/flex-bg/small
+for BS in 1024 4096; do
+	IMG=$TEST_DIR/test-out/flex-bg-$BS.img
+	$TEST_DIR/make_ext4fs -T $FS_EPOCH -O flex_bg -G 4 -b $BS \
+		-g 1024 -l 32M $IMG $TEST_DIR/flex-bg \
+		|| ERRORS=$(( 1 + $ERRORS ))
+	check-image $IMG || ERRORS=$(( 1 + $ERRORS ))
+	compare-image $IMG $TEST_DIR/flex-bg || ERRORS=$(( 1 + $ERRORS ))
+done
+
+# the block list names every file with blocks, and a file that shares
+# the blocks of another with the same ones
+mkdir -pv $TEST_DIR/shared
+make-file $TEST_DIR/shared/one 50000 s
+cp $TEST_DIR/shared/one $TEST_DIR/shared/two
+echo "three" > $TEST_DIR/shared/three
+BLOCKS=$TEST_DIR/test-out/shared.blocks
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -D -B $BLOCKS -l 16M \
+	$TEST_DIR/test-out/shared.img $TEST_DIR/shared \
+	|| ERRORS=$(( 1 + $ERRORS ))
+cat $BLOCKS
+grep -E '^/?three [0-9]' $BLOCKS || ERRORS=$(( 1 + $ERRORS ))
+[ -n "$( sed -n -E 's,^/?one ,,p' $BLOCKS )" ] \
+	&& [ "$( sed -n -E 's,^/?one ,,p' $BLOCKS )" = \
+	     "$( sed -n -E 's,^/?two ,,p' $BLOCKS )" ] \
+	|| ERRORS=$(( 1 + $ERRORS ))
+check-image $TEST_DIR/test-out/shared.img || ERRORS=$(( 1 + $ERRORS ))
+
+# small files and directories in their inodes, next to ones too large
+# for it, and left out of the block list
+mkdir -pv $TEST_DIR/inline/dir/sub $TEST_DIR/inline/empty-dir
+touch $TEST_DIR/inline/empty
+for SIZE in 1 59 60 61 100 150 160 200 4000; do
+	make-file $TEST_DIR/inline/file-$SIZE $SIZE i
+	make-file $TEST_DIR/inline/dir/file-$SIZE $SIZE d
+done
+echo "sub" > $TEST_DIR/inline/dir/sub/one
+ln -s file-1 $TEST_DIR/inline/link
+BLOCKS=$TEST_DIR/test-out/inline.blocks
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -O inline_data -B $BLOCKS -l 16M \
+	$TEST_DIR/test-out/inline.img $TEST_DIR/inline \
+	|| ERRORS=$(( 1 + $ERRORS ))
+cat $BLOCKS
+grep -E '^/?file-4000 [0-9]' $BLOCKS || ERRORS=$(( 1 + $ERRORS ))
+! grep -E '^/?file-1 ' $BLOCKS || ERRORS=$(( 1 + $ERRORS ))
+check-image $TEST_DIR/test-out/inline.img || ERRORS=$(( 1 + $ERRORS ))
+compare-image $TEST_DIR/test-out/inline.img $TEST_DIR/inline \
+	|| ERRORS=$(( 1 + $ERRORS ))
+for INLINE in /dir/sub /empty-dir /file-59; do
+	debugfs -R "stat $INLINE" $TEST_DIR/test-out/inline.img \
+		| grep -E 'Size of inline data: [0-9]+' \
+		|| ERRORS=$(( 1 + $ERRORS ))
+done
+
+# checksums over inline data, hashed directories and shared blocks
+mkdir -pv $TEST_DIR/csum/many $TEST_DIR/csum/small
+for i in $( seq 1 600 ); do
+	echo "entry $i" > $TEST_DIR/csum/many/entry-with-a-longer-name-$i
+done
+echo "small" > $TEST_DIR/csum/small/file
+make-file $TEST_DIR/csum/one 50000 s
+cp $TEST_DIR/csum/one $TEST_DIR/csum/two
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -O metadata_csum,inline_data,dir_index \
+	-D -l 16M $TEST_DIR/test-out/csum.img $TEST_DIR/csum \
+	|| ERRORS=$(( 1 + $ERRORS ))
+check-image $TEST_DIR/test-out/csum.img || ERRORS=$(( 1 + $ERRORS ))
+compare-image $TEST_DIR/test-out/csum.img $TEST_DIR/csum \
+	|| ERRORS=$(( 1 + $ERRORS ))
+debugfs -R "htree /many" $TEST_DIR/test-out/csum.img | grep 'Root node dump' \
+	|| ERRORS=$(( 1 + $ERRORS ))
+dumpe2fs -h $TEST_DIR/test-out/csum.img | grep -E 'features:.* shared_blocks' \
+	|| ERRORS=$(( 1 + $ERRORS ))
+
+# hashed directories, one with a level of index nodes under its root,
+# and one indexed for its number of entries alone
+mkdir -pv $TEST_DIR/htree/big $TEST_DIR/htree/few
+seq 1 4000 | sed 's/^/a-file-name-long-enough-to-fill-the-leaf-blocks-quickly-/' \
+	| ( cd $TEST_DIR/htree/big && xargs touch )
+touch $TEST_DIR/htree/few/a $TEST_DIR/htree/few/b $TEST_DIR/htree/few/c \
+	$TEST_DIR/htree/few/d $TEST_DIR/htree/few/e
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -O dir_index --dir-index-entries 4 \
+	-b 1024 -l 16M $TEST_DIR/test-out/htree.img $TEST_DIR/htree \
+	|| ERRORS=$(( 1 + $ERRORS ))
+check-image $TEST_DIR/test-out/htree.img || ERRORS=$(( 1 + $ERRORS ))
+compare-image $TEST_DIR/test-out/htree.img $TEST_DIR/htree \
+	|| ERRORS=$(( 1 + $ERRORS ))
+debugfs -R "htree /big" $TEST_DIR/test-out/htree.img \
+	| grep 'Indirect levels: 1' || ERRORS=$(( 1 + $ERRORS ))
+debugfs -R "htree /few" $TEST_DIR/test-out/htree.img \
+	| grep 'Root node dump' || ERRORS=$(( 1 + $ERRORS ))
+
+# 64 byte group descriptors, alone and with their checksums and flex
+# groups, with a file across several groups
+mkdir -pv $TEST_DIR/64bit/dir
+make-file $TEST_DIR/64bit/big 12000000 6
+echo "small" > $TEST_DIR/64bit/dir/small
+for FEATURES in 64bit 64bit,flex_bg,metadata_csum; do
+	for BS in 1024 4096; do
+		IMG=$TEST_DIR/test-out/$FEATURES-$BS.img
+		$TEST_DIR/make_ext4fs -T $FS_EPOCH -O $FEATURES -b $BS \
+			-g 1024 -l 32M $IMG $TEST_DIR/64bit \
+			|| ERRORS=$(( 1 + $ERRORS ))
+		dumpe2fs -h $IMG | grep -E '^Group descriptor size: +64$' \
+			|| ERRORS=$(( 1 + $ERRORS ))
+		check-image $IMG || ERRORS=$(( 1 + $ERRORS ))
+		compare-image $IMG $TEST_DIR/64bit || ERRORS=$(( 1 + $ERRORS ))
+	done
+done
+
+# block groups with nothing in them are left for the kernel to set up,
+# which it does without reading their block bitmaps: garbage there must
+# go unnoticed
+mkdir -pv $TEST_DIR/uninit
+make-file $TEST_DIR/uninit/file 3000000 u
+make-file $TEST_DIR/test-out/garbage 1024 '\377'
+for FEATURES in "" "-O flex_bg"; do
+	IMG=$TEST_DIR/test-out/uninit.img
+	rm -f $IMG
+	$TEST_DIR/make_ext4fs -T $FS_EPOCH $FEATURES -b 1024 -g 1024 -l 64M \
+		$IMG $TEST_DIR/uninit || ERRORS=$(( 1 + $ERRORS ))
+	UNINIT_BITMAPS=$( dumpe2fs $IMG | awk '
+		/^Group [0-9]+:.*BLOCK_UNINIT/ { uninit = 1; next }
+		/^Group / { uninit = 0 }
+		uninit && /Block bitmap at/ { print $4 }' )
+	[ -n "$UNINIT_BITMAPS" ] || ERRORS=$(( 1 + $ERRORS ))
+	for BLOCK in $UNINIT_BITMAPS; do
+		dd if=$TEST_DIR/test-out/garbage of=$IMG bs=1024 seek=$BLOCK \
+			conv=notrunc status=none
+	done
+	check-image $IMG || ERRORS=$(( 1 + $ERRORS ))
+	compare-image $IMG $TEST_DIR/uninit || ERRORS=$(( 1 + $ERRORS ))
+done
+
+# just the inodes the tree needs, counting the names of a hard linked
+# file once, and from an archive of it the same
+mkdir -pv $TEST_DIR/auto/dir
+seq 1 300 | sed 's/^/file-/' | ( cd $TEST_DIR/auto/dir && xargs touch )
+echo "linked" > $TEST_DIR/auto/linked
+for i in $( seq 1 20 ); do
+	ln $TEST_DIR/auto/linked $TEST_DIR/auto/dir/link-$i
+done
+tar -cf $TEST_DIR/auto.tar -C $TEST_DIR/auto .
+for HEADROOM in "" ":50%"; do
+	IMG=$TEST_DIR/test-out/auto.img
+	$TEST_DIR/make_ext4fs -T $FS_EPOCH -i auto$HEADROOM -b 1024 -l 64M \
+		$IMG $TEST_DIR/auto \
+		| tee $TEST_DIR/test-out/auto.make_ext4fs.out \
+		|| ERRORS=$(( 1 + $ERRORS ))
+	$TEST_DIR/make_ext4fs -T $FS_EPOCH -i auto$HEADROOM -b 1024 -l 64M \
+		-a $TEST_DIR/auto.tar $TEST_DIR/test-out/auto-tar.img \
+		|| ERRORS=$(( 1 + $ERRORS ))
+	cmp $IMG $TEST_DIR/test-out/auto-tar.img || ERRORS=$(( 1 + $ERRORS ))
+	INODES=( $( sed -n -E \
+		's,^Created filesystem with ([0-9]+)/([0-9]+) .*,\1 \2,p' \
+		$TEST_DIR/test-out/auto.make_ext4fs.out ) )
+	# the first 11 are reserved, then dir, linked and 300 files; each
+	# of the 8 groups gets a multiple of 8, whole blocks of four
+	NEEDED=313
+	if [ -n "$HEADROOM" ]; then NEEDED=470; fi
+	[ "${INODES[0]}" = 313 ] && [ "${INODES[1]}" -ge $NEEDED ] \
+		&& [ "${INODES[1]}" -lt $(( NEEDED + 8 * 8 )) ] \
+		|| ERRORS=$(( 1 + $ERRORS ))
+	check-image $IMG || ERRORS=$(( 1 + $ERRORS ))
+	compare-image $IMG $TEST_DIR/auto || ERRORS=$(( 1 + $ERRORS ))
+done
+
+# a sparse file of 3000 runs of data needs more leaves of extents than
+# fit in the inode with 1K blocks, and so a tree two levels deep
+mkdir -pv $TEST_DIR/deep
+make-file $TEST_DIR/deep/file 4096 e
+head -c 4096 /dev/zero >> $TEST_DIR/deep/file
+for i in $( seq 1 12 ); do
+	cat $TEST_DIR/deep/file $TEST_DIR/deep/file > $TEST_DIR/deep.tmp
+	mv $TEST_DIR/deep.tmp $TEST_DIR/deep/file
+done
+truncate -s $(( 3000 * 8192 - 4096 )) $TEST_DIR/deep/file
+fallocate -d $TEST_DIR/deep/file
+for FEATURES in "" "-O metadata_csum"; do
+	IMG=$TEST_DIR/test-out/deep.img
+	rm -f $IMG
+	$TEST_DIR/make_ext4fs -T $FS_EPOCH $FEATURES -b 1024 -l 64M \
+		$IMG $TEST_DIR/deep || ERRORS=$(( 1 + $ERRORS ))
+	debugfs -R "ex /file" $IMG | grep -E '^ *2/ *2 ' > /dev/null \
+		|| ERRORS=$(( 1 + $ERRORS ))
+	check-image $IMG || ERRORS=$(( 1 + $ERRORS ))
+	compare-image $IMG $TEST_DIR/deep || ERRORS=$(( 1 + $ERRORS ))
+done
+
+# the holes of a sparse file, one at its end, are left unmapped
+mkdir -pv $TEST_DIR/holes
+make-file $TEST_DIR/holes/sparse 8192 h
+truncate -s 73728 $TEST_DIR/holes/sparse
+make-file $TEST_DIR/holes/block 4096 k
+cat $TEST_DIR/holes/block >> $TEST_DIR/holes/sparse
+truncate -s 200000 $TEST_DIR/holes/sparse
+IMG=$TEST_DIR/test-out/holes.img
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -l 16M $IMG $TEST_DIR/holes \
+	|| ERRORS=$(( 1 + $ERRORS ))
+[ "$( mapped-blocks $IMG /sparse )" = "0-1 18-18" ] \
+	|| ERRORS=$(( 1 + $ERRORS ))
+check-image $IMG || ERRORS=$(( 1 + $ERRORS ))
+compare-image $IMG $TEST_DIR/holes || ERRORS=$(( 1 + $ERRORS ))
+
+# with -Z, blocks of zeros are left unmapped as well, a partial last one
+# too, but not a partial last block with data; an archive of the same
+# files gives the same image
+mkdir -pv $TEST_DIR/zeros
+make-file $TEST_DIR/zeros/runs 4096 z
+head -c 8192 /dev/zero >> $TEST_DIR/zeros/runs
+make-file $TEST_DIR/zeros/block 4096 k
+cat $TEST_DIR/zeros/block >> $TEST_DIR/zeros/runs
+head -c 1000 /dev/zero >> $TEST_DIR/zeros/runs
+head -c 8192 /dev/zero > $TEST_DIR/zeros/tail
+echo "tail" >> $TEST_DIR/zeros/tail
+tar -cf $TEST_DIR/zeros.tar -C $TEST_DIR/zeros .
+IMG=$TEST_DIR/test-out/zeros.img
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -Z -l 16M $IMG $TEST_DIR/zeros \
+	|| ERRORS=$(( 1 + $ERRORS ))
+[ "$( mapped-blocks $IMG /runs )" = "0-0 3-3" ] \
+	|| ERRORS=$(( 1 + $ERRORS ))
+[ "$( mapped-blocks $IMG /tail )" = "2-2" ] || ERRORS=$(( 1 + $ERRORS ))
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -Z -l 16M -a $TEST_DIR/zeros.tar \
+	$TEST_DIR/test-out/zeros-tar.img || ERRORS=$(( 1 + $ERRORS ))
+cmp $IMG $TEST_DIR/test-out/zeros-tar.img || ERRORS=$(( 1 + $ERRORS ))
+check-image $IMG || ERRORS=$(( 1 + $ERRORS ))
+compare-image $IMG $TEST_DIR/zeros || ERRORS=$(( 1 + $ERRORS ))
+
+# the files of a layout order list start at increasing blocks, in the
+# order of the list rather than of the groups of their directories
+mkdir -pv $TEST_DIR/layout/a $TEST_DIR/layout/b
+make-file $TEST_DIR/layout/a/last 20000 l
+make-file $TEST_DIR/layout/b/first 30000 f
+make-file $TEST_DIR/layout/middle 10000 m
+make-file $TEST_DIR/layout/unlisted 50000 u
+printf 'b/first\n# comment\n\n/middle\nmissing\na/last\n' \
+	> $TEST_DIR/test-out/layout.order
+IMG=$TEST_DIR/test-out/layout.img
+$TEST_DIR/make_ext4fs -T $FS_EPOCH -b 1024 -g 1024 -l 16M \
+	--layout-order $TEST_DIR/test-out/layout.order \
+	$IMG $TEST_DIR/layout || ERRORS=$(( 1 + $ERRORS ))
+PREV=0
+for FILE in /b/first /middle /a/last; do
+	BLOCK=$( debugfs -R "bmap $FILE 0" $IMG )
+	[ "$BLOCK" -gt "$PREV" ] || ERRORS=$(( 1 + $ERRORS ))
+	PREV=$BLOCK
+done
+check-image $IMG || ERRORS=$(( 1 + $ERRORS ))
+compare-image $IMG $TEST_DIR/layout || ERRORS=$(( 1 + $ERRORS ))
+
+# a layout planned for the whole tree, alone and after the files of a
+# layout order list, in an image that is mostly full
+mkdir -pv $TEST_DIR/plan/d1 $TEST_DIR/plan/d2
+make-file $TEST_DIR/plan/big 3000000 b
+make-file $TEST_DIR/plan/d1/mid 2000000 m
+make-file $TEST_DIR/plan/d2/small 1500000 s
+for i in $( seq 1 40 ); do
+	make-file $TEST_DIR/plan/d$(( i % 2 + 1 ))/f$i $(( i * 1000 )) $(( i % 10 ))
+done
+printf 'd2/f7\nd1/mid\n' > $TEST_DIR/test-out/plan.order
+for ORDER in "" "--layout-order $TEST_DIR/test-out/plan.order"; do
+	IMG=$TEST_DIR/test-out/plan.img
+	rm -f $IMG
+	$TEST_DIR/make_ext4fs -T $FS_EPOCH -b 1024 -g 1024 -l 12M \
+		--plan-layout $ORDER $IMG $TEST_DIR/plan \
+		|| ERRORS=$(( 1 + $ERRORS ))
+	check-image $IMG || ERRORS=$(( 1 + $ERRORS ))
+	compare-image $IMG $TEST_DIR/plan || ERRORS=$(( 1 + $ERRORS ))
+done
+
+# the number of scanner threads changes nothing in the image of a tree
+# with many directories, hard links, sparse files and equal files
+mkdir -pv $TEST_DIR/threads
+cp -a $TEST_DIR/htree $TEST_DIR/auto $TEST_DIR/csum $TEST_DIR/holes \
+	$TEST_DIR/zeros $TEST_DIR/plan $TEST_DIR/threads
+for THREADS in 1 8; do
+	$TEST_DIR/make_ext4fs -T $FS_EPOCH -p $THREADS -D -Z -i auto -l 64M \
+		$TEST_DIR/test-out/threads-$THREADS.img $TEST_DIR/threads \
+		|| ERRORS=$(( 1 + $ERRORS ))
+done
+cmp $TEST_DIR/test-out/threads-1.img $TEST_DIR/test-out/threads-8.img \
+	|| ERRORS=$(( 1 + $ERRORS ))
+
+# nor does reading the files with io_uring, into a plain image or a
+# sparse one
+for THREADS in 1 8; do
+	$TEST_DIR/make_ext4fs -T $FS_EPOCH -p $THREADS -A -D -Z -i auto \
+		-l 64M $TEST_DIR/test-out/async-$THREADS.img $TEST_DIR/threads \
+		|| ERRORS=$(( 1 + $ERRORS ))
+	cmp $TEST_DIR/test-out/threads-1.img \
+		$TEST_DIR/test-out/async-$THREADS.img \
+		|| ERRORS=$(( 1 + $ERRORS ))
+done
+for ASYNC in "" "-A"; do
+	$TEST_DIR/make_ext4fs -T $FS_EPOCH $ASYNC -s -D -Z -i auto -l 64M \
+		$TEST_DIR/test-out/sparse$ASYNC.img $TEST_DIR/threads \
+		|| ERRORS=$(( 1 + $ERRORS ))
+done
+cmp $TEST_DIR/test-out/sparse.img $TEST_DIR/test-out/sparse-A.img \
+	|| ERRORS=$(( 1 + $ERRORS ))
+check-image $TEST_DIR/test-out/threads-1.img || ERRORS=$(( 1 + $ERRORS ))
+compare-image $TEST_DIR/test-out/threads-1.img $TEST_DIR/threads \
+	|| ERRORS=$(( 1 + $ERRORS ))
+
+# nor does reading it from an archive, plain or gzip compressed, which is
+# read in place or through an index from a file, and spooled from a pipe
+tar -cf $TEST_DIR/threads.tar -C $TEST_DIR/threads .
+gzip -c $TEST_DIR/threads.tar > $TEST_DIR/threads.tar.gz
+for ARCHIVE in threads.tar threads.tar.gz; do
+	$TEST_DIR/make_ext4fs -T $FS_EPOCH -D -Z -i auto -l 64M \
+		-a $TEST_DIR/$ARCHIVE $TEST_DIR/test-out/$ARCHIVE.img \
+		|| ERRORS=$(( 1 + $ERRORS ))
+	cmp $TEST_DIR/test-out/threads-1.img $TEST_DIR/test-out/$ARCHIVE.img \
+		|| ERRORS=$(( 1 + $ERRORS ))
+	cat $TEST_DIR/$ARCHIVE | $TEST_DIR/make_ext4fs -T $FS_EPOCH -D -Z \
+		-i auto -l 64M -a - $TEST_DIR/test-out/$ARCHIVE-pipe.img \
+		|| ERRORS=$(( 1 + $ERRORS ))
+	cmp $TEST_DIR/test-out/threads-1.img \
+		$TEST_DIR/test-out/$ARCHIVE-pipe.img \
+		|| ERRORS=$(( 1 + $ERRORS ))
+done
+
 if [ $ERRORS -gt 255 ]; then ERRORS=255; fi
 exit $ERRORS